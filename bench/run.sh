@@ -0,0 +1,257 @@
+#!/bin/sh
+#
+# Benchmarks smallsh on generated workloads and compares the
+# results with a stored baseline.
+#
+# Usage: bench/run.sh [-s scale] [-r runs] [-o results.json] [-b baseline.json] [-t tolerance] [--save]
+#
+# Each workload is a script run by smallsh with SMALLSH_TIMING set,
+# so the shell logs how long every simple command took. For each one
+# the driver reports commands per second, p50/p99 command latency,
+# growth of the shell's RSS over the run and, when strace is
+# installed, syscalls made by the shell per command (without strace,
+# read/write syscalls from /proc/PID/io). Each workload is run
+# several times (default 3) and the fastest run is kept, which
+# filters out most scheduling noise.
+#
+# Results are written as flat JSON. If the baseline exists, any metric
+# that is worse than it by more than the tolerance (default 0.25) is
+# reported and the exit status is 1. --save makes these results the
+# new baseline.
+#
+# SMALLSH may name a prebuilt binary; by default the sources in the
+# repository are built with -O2 into the work directory.
+
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+repo=$(dirname "$bench")
+scale=1
+runs=3
+results="$bench/results.json"
+baseline="$bench/baseline.json"
+tolerance=${BENCH_TOLERANCE:-0.25}
+save=0
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+		-s) scale=$2; shift ;;
+		-r) runs=$2; shift ;;
+		-o) results=$2; shift ;;
+		-b) baseline=$2; shift ;;
+		-t) tolerance=$2; shift ;;
+		--save) save=1 ;;
+		*) echo "Usage: $0 [-s scale] [-r runs] [-o results.json] [-b baseline.json] [-t tolerance] [--save]" >&2; exit 2 ;;
+	esac
+	shift
+done
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/smallsh-bench.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+
+if [ -z "$SMALLSH" ]; then
+	SMALLSH="$work/smallsh"
+	(cd "$repo" && ${CC:-gcc} -O2 -pthread -o "$SMALLSH" smallsh.c smallshedit.c smallshlib.c smallshparse.c \
+		smallshexec.c smallshjob.c smallshpath.c smallshmemo.c smallshserve.c smallshrc.c smallshpstat.c smallshproc.c smallshjournal.c smallshpsi.c)
+fi
+
+
+#
+# Workloads. Each script starts and ends by saving the shell's
+# /proc status so RSS growth can be measured.
+#
+
+prologue() {
+	echo "grep VmRSS /proc/\$\$/status > $work/$1.rss0"
+}
+
+epilogue() {
+	echo "grep VmRSS /proc/\$\$/status > $work/$1.rss1"
+	echo "cat /proc/\$\$/io > $work/$1.io"
+}
+
+# Thousands of trivial external commands
+{
+	prologue external
+	awk -v n=$((2000 * scale)) 'BEGIN { for(i = 0; i < n; i++) print "printf \"\"" }'
+	epilogue external
+} > "$work/external.sh"
+
+# Builtins, assignments and expansion only
+{
+	prologue builtin
+	awk -v n=$((5000 * scale)) 'BEGIN {
+		for(i = 0; i < n; i++) {
+			print "x=" i "; y=$x; test \"$y\" = " i " && : ; true"
+		}
+		list = ""
+		for(i = 0; i < 500; i++) {
+			list = list " w" i
+		}
+		print "for w in" list "; do x=$w; done"
+		print "i=0"
+		print "for a in 1 2 3 4 5 6 7 8 9 10; do for b in 1 2 3 4 5 6 7 8 9 10; do i=$a$b; done; done"
+	}'
+	epilogue builtin
+} > "$work/builtin.sh"
+
+# Redirections on builtins and external commands
+{
+	prologue redirect
+	awk -v n=$((1000 * scale)) -v dir="$work" 'BEGIN {
+		for(i = 0; i < n; i++) {
+			print "echo line " i " > " dir "/r.out"
+			print "test -s " dir "/r.out < " dir "/r.out"
+			print "printf x < /dev/null > " dir "/r2.out"
+		}
+	}'
+	epilogue redirect
+} > "$work/redirect.sh"
+
+# Bursts of background jobs, paced by a foreground command so the
+# number running stays under the fork limit
+{
+	prologue background
+	awk -v n=$((50 * scale)) 'BEGIN {
+		for(i = 0; i < n; i++) {
+			for(j = 0; j < 20; j++) {
+				print "printf \"\" &"
+			}
+			print "sleep 0.01"
+		}
+		print "sleep 0.2"
+	}'
+	epilogue background
+} > "$work/background.sh"
+
+# Long lines: many words, and long quoted strings
+{
+	prologue longline
+	awk -v n=$((100 * scale)) 'BEGIN {
+		words = ""
+		for(i = 0; i < 2000; i++) {
+			words = words " word" i
+		}
+		for(quoted = "q"; length(quoted) < 65536; quoted = quoted quoted) {
+		}
+		for(i = 0; i < n; i++) {
+			print "echo" words " > /dev/null"
+			print "x='\''" quoted "'\''"
+		}
+	}'
+	epilogue longline
+} > "$work/longline.sh"
+
+
+now_ns() {
+	date +%s%N
+}
+
+#
+# Runs one workload and prints its metrics as JSON members.
+#
+run_workload() {
+	name=$1
+	wall=0
+	run=0
+	while [ $run -lt "$runs" ]; do
+		started=$(now_ns)
+		SMALLSH_TIMING="$work/$name.timing.new" "$SMALLSH" "$work/$name.sh" < /dev/null > "$work/$name.out" 2>&1
+		finished=$(now_ns)
+		if [ $wall -eq 0 ] || [ $((finished - started)) -lt $wall ]; then
+			wall=$((finished - started))
+			mv "$work/$name.timing.new" "$work/$name.timing"
+			cp "$work/$name.rss0" "$work/$name.best.rss0"
+			cp "$work/$name.rss1" "$work/$name.best.rss1"
+			cp "$work/$name.io" "$work/$name.best.io"
+		fi
+		run=$((run + 1))
+	done
+
+	syscalls=null
+	if command -v strace > /dev/null 2>&1; then
+		strace -c -o "$work/$name.strace" "$SMALLSH" "$work/$name.sh" < /dev/null > /dev/null 2>&1 || true
+		# Columns can be blank, so cut the total row at the end of the calls heading
+		syscalls=$(awk '/calls/ && !end { end = index($0, "calls") + 4 }
+			$NF == "total" { n = split(substr($0, 1, end), field, " "); print field[n] }' "$work/$name.strace")
+	fi
+
+	sort -n "$work/$name.timing" > "$work/$name.sorted"
+	awk -v name="$name" -v wall=$wall -v syscalls="$syscalls" \
+		-v rss0="$(awk '{ print $2 }' "$work/$name.best.rss0")" -v rss1="$(awk '{ print $2 }' "$work/$name.best.rss1")" \
+		-v io="$(awk '$1 == "syscr:" || $1 == "syscw:" { n += $2 } END { print n + 0 }' "$work/$name.best.io")" '
+		{ t[NR] = $1 }
+		END {
+			n = NR
+			p50 = t[int((n - 1) * 0.50) + 1]
+			p99 = t[int((n - 1) * 0.99) + 1]
+			printf "\t\"%s.commands\": %d,\n", name, n
+			printf "\t\"%s.commands_per_sec\": %.1f,\n", name, n / (wall / 1e9)
+			printf "\t\"%s.p50_us\": %.2f,\n", name, p50 / 1000
+			printf "\t\"%s.p99_us\": %.2f,\n", name, p99 / 1000
+			printf "\t\"%s.rss_growth_kb\": %d,\n", name, rss1 - rss0
+			if(syscalls != "null") {
+				printf "\t\"%s.syscalls_per_command\": %.2f,\n", name, syscalls / n
+			}
+			printf "\t\"%s.rw_syscalls_per_command\": %.2f,\n", name, io / n
+		}' "$work/$name.sorted"
+}
+
+
+{
+	echo "{"
+	for workload in external builtin redirect background longline; do
+		run_workload $workload
+	done
+	printf '\t"scale": %d\n' "$scale"
+	echo "}"
+} > "$results"
+
+cat "$results"
+
+if [ $save -eq 1 ]; then
+	cp "$results" "$baseline"
+	echo "Saved baseline $baseline"
+	exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+	echo "No baseline at $baseline; run with --save to create one"
+	exit 0
+fi
+
+#
+# Throughput regresses when it drops; everything else when it grows.
+# Latencies under 5us and RSS growth under 256kB are noise.
+#
+awk -v tolerance="$tolerance" '
+	function key(line) { split(line, parts, "\""); return parts[2] }
+	function value(line) { sub(/.*: */, "", line); sub(/,$/, "", line); return line + 0 }
+	/": / {
+		if(FILENAME == ARGV[1]) { base[key($0)] = value($0); next }
+		k = key($0)
+		if(!(k in base) || k ~ /\.commands$/ || k == "scale") { next }
+		old = base[k]
+		new = value($0)
+		if(k ~ /per_sec$/) {
+			worse = new < old * (1 - tolerance)
+		}
+		else if(k ~ /_us$/) {
+			worse = new > old * (1 + tolerance) && new - old > 5
+		}
+		else if(k ~ /_kb$/) {
+			worse = new > old * (1 + tolerance) && new - old > 256
+		}
+		else {
+			worse = new > old * (1 + tolerance)
+		}
+		printf "%-40s %12.2f %12.2f%s\n", k, old, new, worse ? "  REGRESSION" : ""
+		failed += worse
+	}
+	END {
+		if(failed) {
+			printf "%d regression(s) against the baseline\n", failed
+			exit 1
+		}
+		print "No regressions against the baseline"
+	}' "$baseline" "$results"
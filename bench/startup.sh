@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Measures how long smallsh takes to start with a large rc file,
+# parsing it cold against loading its snapshot.
+#
+# Usage: bench/startup.sh [-n functions] [-r runs]
+#
+# A generated rc file defines n functions (default 2000) and as many
+# variables, and `smallsh -c :` is started runs times (default 200)
+# with no rc file, with the rc file parsed each time (SMALLSH_SNAPSHOT=0)
+# and with the rc file loaded from its snapshot. The mean time per
+# start is reported for each.
+#
+# SMALLSH may name a prebuilt binary; by default the sources in the
+# repository are built with -O2 into the work directory.
+
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+repo=$(dirname "$bench")
+functions=2000
+runs=200
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+		-n) functions=$2; shift ;;
+		-r) runs=$2; shift ;;
+		*) echo "Usage: $0 [-n functions] [-r runs]" >&2; exit 2 ;;
+	esac
+	shift
+done
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/smallsh-startup.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+
+if [ -z "$SMALLSH" ]; then
+	SMALLSH="$work/smallsh"
+	(cd "$repo" && ${CC:-gcc} -O2 -pthread -o "$SMALLSH" smallsh.c smallshedit.c smallshlib.c smallshparse.c \
+		smallshexec.c smallshjob.c smallshpath.c smallshmemo.c smallshserve.c smallshrc.c smallshpstat.c smallshproc.c smallshjournal.c smallshpsi.c)
+fi
+
+awk -v n="$functions" 'BEGIN {
+	for(i = 0; i < n; i++) {
+		print "setting" i "=\"value " i "\""
+		print "func" i " () {"
+		print "\tif test -n \"$1\"; then"
+		print "\t\tfor word in \"$@\" " i "; do echo \"$word\" >> \"$HOME/func" i ".log\" 2>&1; done"
+		print "\telif test \"$setting" i "\" = x || false; then return 1"
+		print "\telse echo none; fi"
+		print "}"
+	}
+}' > "$work/rc"
+
+now_ns() {
+	date +%s%N
+}
+
+#
+# Prints the mean time per start, in microseconds,
+# of runs shells started with SMALLSH_RC set to $1.
+#
+time_starts() {
+	run=0
+	started=$(now_ns)
+	while [ $run -lt "$runs" ]; do
+		SMALLSH_RC=$1 "$SMALLSH" -c : < /dev/null
+		run=$((run + 1))
+	done
+	finished=$(now_ns)
+	echo $(((finished - started) / runs / 1000))
+}
+
+none=$(time_starts "")
+cold=$(SMALLSH_SNAPSHOT=0 time_starts "$work/rc")
+SMALLSH_RC="$work/rc" "$SMALLSH" -c : < /dev/null
+snapshot=$(time_starts "$work/rc")
+
+printf 'rc file: %d functions, %d bytes; snapshot %d bytes\n' "$functions" "$(wc -c < "$work/rc")" "$(wc -c < "$work/rc.snap")"
+printf '%-10s %8d us\n' "no rc" "$none" "parsed" "$cold" "snapshot" "$snapshot"
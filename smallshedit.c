@@ -0,0 +1,433 @@
+/*
+ * Line editor for interactive smallsh.
+ * See smallshedit.h.
+ *
+ * The terminal is in raw mode only while
+ * a line is being read, so commands run
+ * with the settings the user had.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "smallshedit.h"
+
+const int MAX_HISTORY = 500;
+
+
+struct editor {
+
+	struct smallsh_shell *sh;
+	const char *prompt;
+	char *line;
+	size_t length;
+	size_t capacity;
+	size_t cursor;
+};
+
+/* Earlier lines, oldest first */
+static char **history;
+static int numHistory;
+
+
+static void write_string (const char *text, size_t length) {
+
+	ssize_t written;
+
+	while(length > 0) {
+
+		written = write(STDOUT_FILENO, text, length);
+		if(written <= 0) {
+			return;
+		}
+		text += written;
+		length -= written;
+	}
+}
+
+
+/*
+ * Redraws the prompt and line, then puts
+ * the terminal cursor back at the cursor.
+ */
+static void redraw (struct editor *e) {
+
+	char move[32];
+
+	write_string("\r", 1);
+	write_string(e->prompt, strlen(e->prompt));
+	write_string(e->line, e->length);
+	write_string("\x1b[K\r", 4);
+	if(strlen(e->prompt) + e->cursor > 0) {
+
+		snprintf(move, sizeof(move), "\x1b[%zuC", strlen(e->prompt) + e->cursor);
+		write_string(move, strlen(move));
+	}
+}
+
+
+/*
+ * Replaces the text from start to the
+ * cursor with text.
+ */
+static void replace (struct editor *e, size_t start, const char *text) {
+
+	size_t length = strlen(text);
+
+	if(e->length - (e->cursor - start) + length + 1 > e->capacity) {
+
+		e->capacity = e->length + length + 64;
+		e->line = realloc(e->line, e->capacity);
+	}
+
+	memmove(e->line + start + length, e->line + e->cursor, e->length - e->cursor + 1);
+	memcpy(e->line + start, text, length);
+	e->length = e->length - (e->cursor - start) + length;
+	e->cursor = start + length;
+}
+
+
+static void set_line (struct editor *e, const char *text) {
+
+	e->cursor = e->length;
+	replace(e, 0, text);
+}
+
+
+/*
+ * Prints matches in columns below the
+ * line.
+ */
+static void list_matches (char **matches, int numMatches) {
+
+	struct winsize window;
+	size_t width = 0;
+	int columns;
+	int i;
+
+	for(i = 0; i < numMatches; i++) {
+
+		if(strlen(matches[i]) > width) {
+			width = strlen(matches[i]);
+		}
+	}
+	width += 2;
+
+	columns = 1;
+	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > width) {
+		columns = window.ws_col / width;
+	}
+
+	write_string("\r\n", 2);
+	for(i = 0; i < numMatches; i++) {
+
+		write_string(matches[i], strlen(matches[i]));
+		if((i + 1) % columns == 0 || i + 1 == numMatches) {
+			write_string("\r\n", 2);
+		}
+		else {
+			write_string("                                        ", width - strlen(matches[i]) < 40 ? width - strlen(matches[i]) : 40);
+		}
+	}
+}
+
+
+/*
+ * Completes the word at the cursor to the
+ * longest prefix all matches share. A
+ * single match is finished with a space,
+ * unless it is a directory. Listing the
+ * matches is left for a second tab.
+ */
+static void complete (struct editor *e, int listing) {
+
+	char **matches;
+	size_t wordStart;
+	size_t common;
+	int numMatches;
+	int i;
+
+	numMatches = smallsh_shell_complete(e->sh, e->line, e->cursor, &wordStart, &matches);
+
+	if(numMatches == 0) {
+		write_string("\a", 1);
+	}
+	else if(numMatches == 1) {
+
+		replace(e, wordStart, matches[0]);
+		if(e->line[e->cursor - 1] != '/') {
+			replace(e, e->cursor, " ");
+		}
+	}
+	else {
+
+		common = strlen(matches[0]);
+		for(i = 1; i < numMatches; i++) {
+
+			while(strncmp(matches[0], matches[i], common)) {
+				common--;
+			}
+		}
+
+		if(common > e->cursor - wordStart) {
+
+			matches[0][common] = '\0';
+			replace(e, wordStart, matches[0]);
+		}
+		else if(listing) {
+			list_matches(matches, numMatches);
+		}
+		else {
+			write_string("\a", 1);
+		}
+	}
+
+	for(i = 0; i < numMatches; i++) {
+		free(matches[i]);
+	}
+	free(matches);
+}
+
+
+static void add_history (const char *line) {
+
+	if(line[0] == '\0' || (numHistory > 0 && !strcmp(history[numHistory - 1], line))) {
+		return;
+	}
+
+	if(numHistory == MAX_HISTORY) {
+
+		free(history[0]);
+		memmove(history, history + 1, (numHistory - 1) * sizeof(char *));
+		numHistory--;
+	}
+
+	history = realloc(history, (numHistory + 1) * sizeof(char *));
+	history[numHistory++] = strdup(line);
+}
+
+
+/*
+ * Reads keys until enter. Returns 0, or -1
+ * for Ctrl-D on an empty line.
+ */
+static int edit (struct editor *e) {
+
+	char key;
+	char sequence[3];
+	char *stash = NULL;
+	int place = numHistory;
+	int lastWasTab = 0;
+	int isTab;
+
+	redraw(e);
+
+	while(read(STDIN_FILENO, &key, 1) == 1) {
+
+		isTab = key == '\t';
+
+		switch(key) {
+
+			case '\r':
+			case '\n':
+				free(stash);
+				return 0;
+
+			case 3:				//Ctrl-C drops the line
+				write_string("^C\r\n", 4);
+				set_line(e, "");
+				place = numHistory;
+				break;
+
+			case 4:				//Ctrl-D
+				if(e->length == 0) {
+
+					free(stash);
+					return -1;
+				}
+				if(e->cursor < e->length) {
+
+					e->cursor++;
+					replace(e, e->cursor - 1, "");
+				}
+				break;
+
+			case 127:
+			case 8:
+				if(e->cursor > 0) {
+					replace(e, e->cursor - 1, "");
+				}
+				break;
+
+			case 1:				//Ctrl-A
+				e->cursor = 0;
+				break;
+
+			case 5:				//Ctrl-E
+				e->cursor = e->length;
+				break;
+
+			case 2:				//Ctrl-B
+				if(e->cursor > 0) {
+					e->cursor--;
+				}
+				break;
+
+			case 6:				//Ctrl-F
+				if(e->cursor < e->length) {
+					e->cursor++;
+				}
+				break;
+
+			case 11:			//Ctrl-K
+				e->length = e->cursor;
+				e->line[e->length] = '\0';
+				break;
+
+			case 21:			//Ctrl-U
+				replace(e, 0, "");
+				break;
+
+			case 23:			//Ctrl-W
+				{
+					size_t start = e->cursor;
+
+					while(start > 0 && e->line[start - 1] == ' ') {
+						start--;
+					}
+					while(start > 0 && e->line[start - 1] != ' ') {
+						start--;
+					}
+					replace(e, start, "");
+				}
+				break;
+
+			case 12:			//Ctrl-L
+				write_string("\x1b[H\x1b[2J", 7);
+				break;
+
+			case '\t':
+				complete(e, lastWasTab);
+				break;
+
+			case 27:
+				if(read(STDIN_FILENO, sequence, 2) != 2 || sequence[0] != '[') {
+					break;
+				}
+
+				if(sequence[1] == 'A' || sequence[1] == 'B') {
+
+					/* Keep the line being typed while browsing history */
+					if(place == numHistory) {
+
+						free(stash);
+						stash = strdup(e->line);
+					}
+
+					if(sequence[1] == 'A' && place > 0) {
+						place--;
+					}
+					else if(sequence[1] == 'B' && place < numHistory) {
+						place++;
+					}
+					set_line(e, place < numHistory ? history[place] : stash);
+				}
+				else if(sequence[1] == 'C' && e->cursor < e->length) {
+					e->cursor++;
+				}
+				else if(sequence[1] == 'D' && e->cursor > 0) {
+					e->cursor--;
+				}
+				else if(sequence[1] == 'H') {
+					e->cursor = 0;
+				}
+				else if(sequence[1] == 'F') {
+					e->cursor = e->length;
+				}
+				else if(sequence[1] == '3' && read(STDIN_FILENO, sequence + 2, 1) == 1 && e->cursor < e->length) {
+
+					e->cursor++;
+					replace(e, e->cursor - 1, "");
+				}
+				break;
+
+			default:
+				if((unsigned char)key >= ' ') {
+
+					sequence[0] = key;
+					sequence[1] = '\0';
+					replace(e, e->cursor, sequence);
+				}
+				break;
+		}
+
+		lastWasTab = isTab;
+		redraw(e);
+	}
+
+	free(stash);
+	return -1;
+}
+
+
+ssize_t smallsh_edit_line (struct smallsh_shell *sh, const char *prompt, char **buffer, size_t *size) {
+
+	struct termios original;
+	struct termios raw;
+	struct editor e;
+	int result;
+
+	if(!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &original) == -1) {
+
+		printf("%s", prompt);
+		fflush(stdout);
+		return getline(buffer, size, stdin);
+	}
+
+	/*
+	 * Raw input, but keep output processing
+	 * so newlines from background jobs still
+	 * return the carriage.
+	 */
+	raw = original;
+	raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	fflush(stdout);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+	memset(&e, 0, sizeof(e));
+	e.sh = sh;
+	e.prompt = prompt;
+	e.capacity = 128;
+	e.line = malloc(e.capacity);
+	e.line[0] = '\0';
+
+	result = edit(&e);
+
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &original);
+	write_string("\n", 1);
+
+	if(result == -1) {
+
+		free(e.line);
+		return -1;
+	}
+
+	add_history(e.line);
+
+	if(*size < e.length + 2) {
+
+		*size = e.length + 2;
+		*buffer = realloc(*buffer, *size);
+	}
+	memcpy(*buffer, e.line, e.length);
+	(*buffer)[e.length] = '\n';
+	(*buffer)[e.length + 1] = '\0';
+	free(e.line);
+	return e.length + 1;
+}
@@ -0,0 +1,22 @@
+/*
+ * Line editor for interactive smallsh, with
+ * history and tab completion from the shell.
+ */
+
+#ifndef SMALLSHEDIT_H
+#define SMALLSHEDIT_H
+
+#include <sys/types.h>
+#include "smallshlib.h"
+
+
+/*
+ * Prints prompt and reads a line the way
+ * getline does, into a malloc'd buffer
+ * ending in a newline. Returns -1 at the end
+ * of input. When stdin is not a terminal
+ * this is plain getline.
+ */
+ssize_t smallsh_edit_line (struct smallsh_shell *sh, const char *prompt, char **buffer, size_t *size);
+
+#endif
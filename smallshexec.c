@@ -0,0 +1,6735 @@
+/*
+ * Interpreter for libsmallsh. Runs the
+ * command trees built by smallshparse.c:
+ * expands words, applies redirections,
+ * runs builtins and functions in-process
+ * and starts external commands through
+ * the job launcher in smallshjob.c.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <dirent.h>
+#include <time.h>
+#include "smallshlib.h"
+#include "smallshexec.h"
+#include "smallshmemo.h"
+#include "smallshpstat.h"
+#include "smallshproc.h"
+
+const int MAX_FORKS = 100;
+const int SIGNAL_KILLED = 500;
+const int MAX_CALL_DEPTH = 1000;
+const int MAX_SOURCE_DEPTH = 100;
+const int NAME_BUCKETS = 1024;
+
+/*
+ * Saved copies of redirected descriptors
+ * are moved above this number so they do
+ * not collide with descriptors the user
+ * names.
+ */
+const int SAVED_FD_BASE = 10;
+
+/*
+ * fanout hands its workers input in
+ * line-aligned chunks of about this size.
+ */
+const size_t FANOUT_CHUNK_SIZE = 65536;
+
+
+struct saved_fd {
+
+	int fd;
+	int copy;
+};
+
+typedef int (*builtin_fn) (struct smallsh_shell *sh, int argc, char *argv[]);
+
+struct smallsh_builtin {
+
+	const char *name;
+	builtin_fn run;
+};
+
+/* Looks a name up in the builtin table at the end of the file */
+static const struct smallsh_builtin *find_builtin (const char *name);
+
+/* Runs a node of the tree; defined after the control flow it dispatches to */
+static int exec_node (struct smallsh_shell *sh, struct smallsh_node *node);
+
+/*
+ * Output of a command substitution, in a
+ * buffer read from a pipe or mapped from
+ * the memfd it was written to.
+ */
+struct capture {
+
+	char *data;
+	size_t length;
+	size_t capacity;
+	int mapped;
+};
+
+/* Runs the body of $(...); defined with the other launchers */
+static void run_substitution (struct smallsh_shell *sh, struct smallsh_node *program, const char *body,
+		struct capture *output);
+
+/* Shuts coprocesses down for exit; defined with the coproc builtin */
+static void stop_coprocs (struct smallsh_shell *sh);
+
+/* Copies part of a file to a descriptor; defined with memo */
+static off_t copy_range (int in, off_t offset, off_t length, int out);
+
+/* The live view behind jobs -w */
+static int builtin_jtop (struct smallsh_shell *sh, int argc, char *argv[]);
+
+/* Monotonic milliseconds; defined with on-change */
+static long long now_ms (void);
+
+
+/*
+ * Shell variables. Variables that are also
+ * in the environment are kept in sync with
+ * it so children see the new value.
+ */
+
+static unsigned int name_bucket (const char *name) {
+
+	unsigned int hash = 2166136261u;
+
+	for(; *name != '\0'; name++) {
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	}
+	return hash % NAME_BUCKETS;
+}
+
+
+static struct smallsh_var *find_var (struct smallsh_shell *sh, const char *name) {
+
+	struct smallsh_var *var;
+
+	for(var = sh->varBuckets[name_bucket(name)]; var != NULL; var = var->hashNext) {
+
+		if(!strcmp(var->name, name)) {
+			return var;
+		}
+	}
+	return NULL;
+}
+
+
+static const char *get_var (struct smallsh_shell *sh, const char *name) {
+
+	struct smallsh_var *var = find_var(sh, name);
+
+	if(var != NULL) {
+		return var->value;
+	}
+	return getenv(name);
+}
+
+
+static void set_var (struct smallsh_shell *sh, const char *name, const char *value) {
+
+	struct smallsh_var *var = find_var(sh, name);
+
+	if(var == NULL) {
+
+		var = calloc(1, sizeof(struct smallsh_var));
+		var->name = strdup(name);
+		var->exported = getenv(name) != NULL;
+		var->next = sh->vars;
+		sh->vars = var;
+		var->hashNext = sh->varBuckets[name_bucket(name)];
+		sh->varBuckets[name_bucket(name)] = var;
+	}
+	else {
+
+		free(var->value);
+	}
+	var->value = strdup(value);
+
+	if(var->exported) {
+		setenv(name, value, 1);
+	}
+}
+
+
+static void unset_var (struct smallsh_shell *sh, const char *name) {
+
+	struct smallsh_var *var = find_var(sh, name);
+	struct smallsh_var **link;
+
+	if(var != NULL) {
+
+		for(link = &sh->varBuckets[name_bucket(name)]; *link != var; link = &(*link)->hashNext) {
+		}
+		*link = var->hashNext;
+
+		for(link = &sh->vars; *link != var; link = &(*link)->next) {
+		}
+		*link = var->next;
+
+		free(var->name);
+		free(var->value);
+		free(var);
+	}
+	unsetenv(name);
+}
+
+
+/*
+ * Applies a NAME=value word that has
+ * already been expanded.
+ */
+static void assign (struct smallsh_shell *sh, char *assignment) {
+
+	char *equals = strchr(assignment, '=');
+
+	*equals = '\0';
+	set_var(sh, assignment, equals + 1);
+	*equals = '=';
+}
+
+
+static struct smallsh_function *find_function (struct smallsh_shell *sh, const char *name) {
+
+	struct smallsh_function *function;
+
+	for(function = sh->functionBuckets[name_bucket(name)]; function != NULL; function = function->hashNext) {
+
+		if(!strcmp(function->name, name)) {
+			return function;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * The value of $?. Commands killed by
+ * a signal report 128 plus the signal.
+ */
+static int exit_code (struct smallsh_shell *sh) {
+
+	if(sh->status == SIGNAL_KILLED) {
+		return 128 + sh->signalNum;
+	}
+	return sh->status;
+}
+
+
+/*
+ * Word expansion. A word is expanded into
+ * zero or more fields: quotes are removed,
+ * parameters are substituted, unquoted
+ * substitutions are split on whitespace and
+ * unquoted *, ? and [ are matched against
+ * file names.
+ */
+
+struct expansion {
+
+	struct smallsh_shell *sh;
+	struct smallsh_arena *arena;
+	int split;				//Split and glob, off for assignments
+	struct smallsh_word *word;		//Being expanded, with its parsed substitutions
+
+	char **fields;
+	int numFields;
+	int maxFields;
+
+	/*
+	 * The field being built, plus the same text
+	 * with quoted glob characters escaped.
+	 */
+	char *text;
+	char *pattern;
+	size_t length;
+	size_t patternLength;
+	size_t capacity;
+	int haveField;
+	int hasGlob;
+};
+
+
+static void push_field (struct expansion *e, const char *text) {
+
+	char **fields;
+
+	if(e->numFields + 1 >= e->maxFields) {
+
+		e->maxFields = e->maxFields ? e->maxFields * 2 : 16;
+		fields = smallsh_arena_alloc(e->arena, e->maxFields * sizeof(char *));
+		if(e->numFields) {
+			memcpy(fields, e->fields, e->numFields * sizeof(char *));
+		}
+		e->fields = fields;
+	}
+	e->fields[e->numFields++] = smallsh_arena_strndup(e->arena, text, strlen(text));
+	e->fields[e->numFields] = NULL;
+}
+
+
+static void add_char (struct expansion *e, char c, int quoted) {
+
+	if(e->patternLength + 3 > e->capacity) {
+
+		e->capacity = e->capacity ? e->capacity * 2 : 64;
+		e->text = realloc(e->text, e->capacity);
+		e->pattern = realloc(e->pattern, e->capacity);
+	}
+
+	if(c == '*' || c == '?' || c == '[' || c == '\\') {
+
+		if(quoted || c == '\\') {
+			e->pattern[e->patternLength++] = '\\';
+		}
+		else {
+			e->hasGlob = 1;
+		}
+	}
+
+	e->text[e->length++] = c;
+	e->pattern[e->patternLength++] = c;
+	e->haveField = 1;
+}
+
+
+static void end_field (struct expansion *e) {
+
+	glob_t matches;
+	size_t i;
+
+	if(!e->haveField) {
+		return;
+	}
+
+	add_char(e, '\0', 1);
+
+	if(e->split && e->hasGlob && glob(e->pattern, 0, NULL, &matches) == 0) {
+
+		for(i = 0; i < matches.gl_pathc; i++) {
+			push_field(e, matches.gl_pathv[i]);
+		}
+		globfree(&matches);
+	}
+	else {
+
+		push_field(e, e->text);
+	}
+
+	e->length = 0;
+	e->patternLength = 0;
+	e->haveField = 0;
+	e->hasGlob = 0;
+}
+
+
+/*
+ * Adds the result of a substitution. Unless
+ * quoted, whitespace in it separates fields.
+ */
+static void add_expansion (struct expansion *e, const char *value, int quoted) {
+
+	for(; *value != '\0'; value++) {
+
+		if(!quoted && e->split && isspace((unsigned char)*value)) {
+			end_field(e);
+		}
+		else {
+			add_char(e, *value, quoted);
+		}
+	}
+}
+
+
+/*
+ * True for a name ${...} can hold: a
+ * variable, a positional parameter or one
+ * of the special parameters.
+ */
+static int parameter_name (const char *name) {
+
+	size_t i;
+
+	if(strchr("?$#!@*", name[0]) != NULL && name[1] == '\0') {
+		return 1;
+	}
+	if(isdigit((unsigned char)name[0])) {
+
+		for(i = 1; isdigit((unsigned char)name[i]); i++) {
+		}
+		return name[i] == '\0';
+	}
+	for(i = 0; isalnum((unsigned char)name[i]) || name[i] == '_'; i++) {
+	}
+	return i > 0 && name[i] == '\0';
+}
+
+
+/*
+ * Expands the parameter starting after
+ * the $ at text, returning the number of
+ * characters consumed.
+ */
+static size_t expand_parameter (struct expansion *e, const char *text, int quoted) {
+
+	struct smallsh_shell *sh = e->sh;
+	char name[256];
+	char number[32];
+	size_t length = 0;
+	size_t consumed;
+	const char *value = NULL;
+	int i;
+
+	if(text[0] == '{') {
+
+		while(text[length + 1] != '}' && text[length + 1] != '\0') {
+			length++;
+		}
+		if(text[length + 1] != '}') {
+
+			add_char(e, '$', quoted);
+			return 0;
+		}
+		consumed = length + 2;
+		if(length < sizeof(name)) {
+
+			memcpy(name, text + 1, length);
+			name[length] = '\0';
+		}
+
+		/* Operators like ${name:-word} are not supported */
+		if(length >= sizeof(name) || !parameter_name(name)) {
+
+			if(sh->badSubstitution == NULL) {
+				sh->badSubstitution = strndup(text, consumed);
+			}
+			return consumed;
+		}
+	}
+
+	else if(strchr("?$#!@*", text[0]) != NULL || isdigit((unsigned char)text[0])) {
+
+		length = 1;
+		name[0] = text[0];
+		consumed = 1;
+	}
+
+	else {
+
+		while(isalnum((unsigned char)text[length]) || text[length] == '_') {
+			length++;
+		}
+		if(length == 0 || length >= sizeof(name) || isdigit((unsigned char)text[0])) {
+
+			/* Not a parameter, keep the $ */
+			add_char(e, '$', quoted);
+			return 0;
+		}
+		memcpy(name, text, length);
+		consumed = length;
+	}
+	name[length] = '\0';
+
+	if(!strcmp(name, "?")) {
+
+		snprintf(number, sizeof(number), "%d", exit_code(sh));
+		value = number;
+	}
+	else if(!strcmp(name, "$")) {
+
+		snprintf(number, sizeof(number), "%ld", (long)getpid());
+		value = number;
+	}
+	else if(!strcmp(name, "!")) {
+
+		snprintf(number, sizeof(number), "%ld", (long)sh->lastBackgroundPID);
+		value = sh->lastBackgroundPID ? number : "";
+	}
+	else if(!strcmp(name, "#")) {
+
+		snprintf(number, sizeof(number), "%d", sh->numParams);
+		value = number;
+	}
+	else if(!strcmp(name, "@") || !strcmp(name, "*")) {
+
+		/*
+		 * Inside quotes $@ keeps each parameter
+		 * a separate field, $* joins them.
+		 */
+		for(i = 0; i < sh->numParams; i++) {
+
+			if(i > 0) {
+
+				if(quoted && name[0] == '@') {
+					end_field(e);
+				}
+				else {
+					add_expansion(e, " ", quoted);
+				}
+			}
+			add_expansion(e, sh->params[i], quoted);
+		}
+		return consumed;
+	}
+	else if(isdigit((unsigned char)name[0])) {
+
+		i = atoi(name);
+		if(i == 0) {
+			value = sh->arg0;
+		}
+		else if(i <= sh->numParams) {
+			value = sh->params[i - 1];
+		}
+	}
+	else {
+
+		value = get_var(sh, name);
+	}
+
+	if(value != NULL) {
+		add_expansion(e, value, quoted);
+	}
+	return consumed;
+}
+
+
+/*
+ * Runs the command substitution at text and
+ * adds its output, less trailing newlines,
+ * splitting it into fields unless quoted.
+ * Each byte goes through add_char, so it is
+ * matched for globs like any other text.
+ * Returns the number of characters consumed.
+ */
+static size_t substitute (struct expansion *e, const char *text, int quoted) {
+
+	size_t length = smallsh_substitution_length(text);
+	struct smallsh_substitution *part;
+	struct capture output;
+	size_t i;
+
+	if(length == 0) {
+
+		add_char(e, text[0], quoted);
+		return 1;
+	}
+
+	/* The body was parsed with the word, unless it failed to */
+	for(part = e->word->substitutions; part != NULL && part->offset != text - e->word->text; part = part->next) {
+		;
+	}
+
+	if(part != NULL) {
+		run_substitution(e->sh, part->program, NULL, &output);
+	}
+	else {
+		run_substitution(e->sh, NULL, smallsh_substitution_body(e->arena, text, length), &output);
+	}
+
+	while(output.length > 0 && output.data[output.length - 1] == '\n') {
+		output.length--;
+	}
+
+	for(i = 0; i < output.length; i++) {
+
+		if(!quoted && e->split && isspace((unsigned char)output.data[i])) {
+			end_field(e);
+		}
+		else if(output.data[i] != '\0') {
+			add_char(e, output.data[i], quoted);
+		}
+	}
+
+	if(output.mapped) {
+		munmap(output.data, output.capacity);
+	}
+	else {
+		free(output.data);
+	}
+	return length;
+}
+
+
+static void expand_text (struct expansion *e, struct smallsh_word *word) {
+
+	const char *text = word->text;
+	int inDouble = 0;
+	size_t i = 0;
+	const char *home;
+	int j;
+
+	e->word = word;
+
+	/*
+	 * "$@" alone gives exactly one field per
+	 * parameter, and none when there are none.
+	 */
+	if(e->split && !strcmp(text, "\"$@\"")) {
+
+		for(j = 0; j < e->sh->numParams; j++) {
+
+			e->haveField = 1;
+			add_expansion(e, e->sh->params[j], 1);
+			end_field(e);
+		}
+		return;
+	}
+
+	/* A leading ~ is the home directory */
+	if(text[0] == '~' && (text[1] == '/' || text[1] == '\0')) {
+
+		home = get_var(e->sh, "HOME");
+		add_expansion(e, home != NULL ? home : "~", 1);
+		i = 1;
+	}
+
+	for(; text[i] != '\0'; i++) {
+
+		if(text[i] == '\'' && !inDouble) {
+
+			e->haveField = 1;
+			for(i++; text[i] != '\'' && text[i] != '\0'; i++) {
+				add_char(e, text[i], 1);
+			}
+		}
+
+		else if(text[i] == '"') {
+
+			e->haveField = 1;
+			inDouble = !inDouble;
+		}
+
+		else if(text[i] == '\\' && text[i + 1] != '\0') {
+
+			i++;
+			if(text[i] == '\n') {
+				continue;
+			}
+			if(inDouble && strchr("$`\"\\", text[i]) == NULL) {
+				add_char(e, '\\', 1);
+			}
+			add_char(e, text[i], 1);
+		}
+
+		else if((text[i] == '$' && text[i + 1] == '(') || text[i] == '`') {
+
+			i += substitute(e, text + i, inDouble) - 1;
+		}
+
+		else if(text[i] == '$') {
+
+			i += expand_parameter(e, text + i + 1, inDouble);
+		}
+
+		else {
+
+			add_char(e, text[i], inDouble);
+		}
+	}
+}
+
+
+static void expansion_init (struct expansion *e, struct smallsh_shell *sh, struct smallsh_arena *arena, int split) {
+
+	memset(e, 0, sizeof(*e));
+	e->sh = sh;
+	e->arena = arena;
+	e->split = split;
+}
+
+
+/*
+ * Reports an unsupported ${...} found by
+ * the last expansion. Returns -1 if there
+ * was one, so the command is not run.
+ */
+static int bad_substitution (struct smallsh_shell *sh) {
+
+	if(sh->badSubstitution == NULL) {
+		return 0;
+	}
+	fprintf(stderr, "smallsh: $%s: bad substitution\n", sh->badSubstitution);
+	fflush(stderr);
+	free(sh->badSubstitution);
+	sh->badSubstitution = NULL;
+	return -1;
+}
+
+
+/*
+ * Expands a list of words into a NULL
+ * terminated array allocated in arena.
+ */
+static char **expand_words (struct smallsh_shell *sh, struct smallsh_word *words, struct smallsh_arena *arena, int *count) {
+
+	struct expansion e;
+
+	expansion_init(&e, sh, arena, 1);
+
+	for(; words != NULL; words = words->next) {
+
+		expand_text(&e, words);
+		end_field(&e);
+	}
+	free(e.text);
+	free(e.pattern);
+
+	if(e.fields == NULL) {
+		push_field(&e, "");
+		e.numFields = 0;
+		e.fields[0] = NULL;
+	}
+	*count = e.numFields;
+	return e.fields;
+}
+
+
+/*
+ * Expands a single word without field
+ * splitting, as for assignments and
+ * redirection targets.
+ */
+static char *expand_string (struct smallsh_shell *sh, struct smallsh_word *word, struct smallsh_arena *arena) {
+
+	struct expansion e;
+	char *result;
+
+	expansion_init(&e, sh, arena, 0);
+	expand_text(&e, word);
+	e.haveField = 1;
+	end_field(&e);
+	result = e.fields[0];
+
+	free(e.text);
+	free(e.pattern);
+	return result;
+}
+
+
+/*
+ * Counts the descriptor actions the
+ * redirections turn into.
+ */
+static int count_redirects (struct smallsh_redirect *redirect) {
+
+	int count = 0;
+
+	for(; redirect != NULL; redirect = redirect->next) {
+
+		count++;
+		if(redirect->type == REDIRECT_ALL || redirect->type == REDIRECT_APPEND_ALL) {
+			count++;
+		}
+	}
+	return count;
+}
+
+
+/*
+ * With SMALLSH_PREALLOC set to a size
+ * (K, M or G suffix), files opened for
+ * output get that much space reserved past
+ * their end, so logs that grow a line at a
+ * time are not fragmented. 0 when unset.
+ */
+static off_t prealloc_size (void) {
+
+	return smallsh_parse_size(getenv("SMALLSH_PREALLOC"));
+}
+
+
+/*
+ * Opens the target of a file redirection,
+ * close-on-exec, printing the error if it
+ * is not available. With relocate the file
+ * is moved above the descriptors a user can
+ * name, so later redirections in the same
+ * command cannot replace it.
+ */
+static int open_redirect (struct smallsh_shell *sh, struct smallsh_redirect *redirect, struct smallsh_arena *arena,
+		int relocate) {
+
+	char *target = expand_string(sh, redirect->target, arena);
+	struct stat info;
+	off_t reserve;
+	int flags;
+	int file;
+	int moved;
+
+	if(bad_substitution(sh) == -1) {
+		return -1;
+	}
+
+	switch(redirect->type) {
+
+		case REDIRECT_INPUT:
+			flags = O_RDONLY;
+			break;
+
+		case REDIRECT_READ_WRITE:
+			flags = O_RDWR | O_CREAT;
+			break;
+
+		case REDIRECT_APPEND:
+		case REDIRECT_APPEND_ALL:
+			flags = O_WRONLY | O_APPEND | O_CREAT;
+			break;
+
+		default:
+			flags = O_WRONLY | O_TRUNC | O_CREAT;
+			break;
+	}
+
+	file = open(target, flags | O_CLOEXEC, 0666);
+	if(file == -1) {
+
+		perror(target);
+		fflush(stdout);
+		return -1;
+	}
+
+	if(relocate && file < SAVED_FD_BASE) {
+
+		moved = fcntl(file, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+		close(file);
+		file = moved;
+	}
+
+	/* Reserve space without changing the size; failure only costs the hint */
+	if(redirect->type != REDIRECT_INPUT && (reserve = prealloc_size()) > 0
+			&& fstat(file, &info) == 0 && S_ISREG(info.st_mode)) {
+
+		fallocate(file, FALLOC_FL_KEEP_SIZE, info.st_size, reserve);
+	}
+	return file;
+}
+
+
+/*
+ * Turns redirections into descriptor
+ * actions, in order, for the child or for
+ * apply_actions. Files are opened here, so
+ * errors are reported before anything is
+ * started; the caller closes opened[] once
+ * the actions are applied.
+ */
+static int redirect_actions (struct smallsh_shell *sh, struct smallsh_redirect *redirect, struct smallsh_arena *arena,
+		struct smallsh_fd_action *actions, int *numActions, int *opened, int *numOpened) {
+
+	int relocate = redirect != NULL && redirect->next != NULL;
+	char *target;
+	char *end;
+	long source;
+	int file;
+
+	for(; redirect != NULL; redirect = redirect->next) {
+
+		if(redirect->type == REDIRECT_DUP_INPUT || redirect->type == REDIRECT_DUP_OUTPUT) {
+
+			target = expand_string(sh, redirect->target, arena);
+			if(bad_substitution(sh) == -1) {
+				return -1;
+			}
+			actions[*numActions].fd = redirect->fd;
+
+			if(!strcmp(target, "-")) {
+				actions[*numActions].type = SMALLSH_FD_CLOSE;
+			}
+			else {
+
+				source = strtol(target, &end, 10);
+				if(target[0] == '\0' || *end != '\0' || source < 0 || source >= SAVED_FD_BASE) {
+
+					fprintf(stderr, "%s: bad file descriptor\n", target);
+					return -1;
+				}
+				actions[*numActions].type = SMALLSH_FD_DUP;
+				actions[*numActions].source = source;
+			}
+			(*numActions)++;
+			continue;
+		}
+
+		file = open_redirect(sh, redirect, arena, relocate);
+		if(file == -1) {
+			return -1;
+		}
+		opened[(*numOpened)++] = file;
+
+		actions[*numActions].type = SMALLSH_FD_DUP;
+		actions[*numActions].fd = redirect->fd;
+		actions[*numActions].source = file;
+		(*numActions)++;
+
+		/* &> is > followed by 2>&1 */
+		if(redirect->type == REDIRECT_ALL || redirect->type == REDIRECT_APPEND_ALL) {
+
+			actions[*numActions] = actions[*numActions - 1];
+			actions[*numActions].fd = 2;
+			(*numActions)++;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Carries out descriptor actions in this
+ * process, in order, as smallsh_spawn would
+ * in a child. When saved is given, each
+ * descriptor is copied into it first so the
+ * caller can restore it.
+ */
+static int apply_actions (const struct smallsh_fd_action *actions, int numActions, struct saved_fd *saved, int *numSaved) {
+
+	int file;
+	int i;
+
+	for(i = 0; i < numActions; i++) {
+
+		if(saved != NULL) {
+
+			saved[*numSaved].fd = actions[i].fd;
+			saved[*numSaved].copy = fcntl(actions[i].fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+			(*numSaved)++;
+		}
+
+		switch(actions[i].type) {
+
+			case SMALLSH_FD_OPEN:
+				file = open(actions[i].path, actions[i].flags, actions[i].mode);
+				if(file == -1) {
+
+					perror(actions[i].path);
+					return -1;
+				}
+				if(file != actions[i].fd) {
+
+					dup2(file, actions[i].fd);
+					close(file);
+				}
+				break;
+
+			case SMALLSH_FD_DUP:
+				if(actions[i].source != actions[i].fd && dup2(actions[i].source, actions[i].fd) == -1) {
+
+					fprintf(stderr, "%d: %s\n", actions[i].source, strerror(errno));
+					return -1;
+				}
+				break;
+
+			case SMALLSH_FD_CLOSE:
+				close(actions[i].fd);
+				break;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Applies redirections in the shell itself,
+ * saving the descriptors they replace when
+ * saved is given.
+ *
+ * If the files are not available, print the
+ * error and return -1 so the caller can set
+ * the status to 1 for failed.
+ */
+static int apply_redirects (struct smallsh_shell *sh, struct smallsh_redirect *redirect,
+		struct smallsh_arena *arena, struct saved_fd *saved, int *numSaved) {
+
+	struct smallsh_fd_action *actions;
+	int *opened;
+	int numActions = 0;
+	int numOpened = 0;
+	int result;
+	int i;
+
+	fflush(stdout);
+
+	actions = smallsh_arena_alloc(arena, (count_redirects(redirect) + 1) * sizeof(struct smallsh_fd_action));
+	opened = smallsh_arena_alloc(arena, (count_redirects(redirect) + 1) * sizeof(int));
+
+	result = redirect_actions(sh, redirect, arena, actions, &numActions, opened, &numOpened);
+	if(result == 0) {
+		result = apply_actions(actions, numActions, saved, numSaved);
+	}
+
+	for(i = 0; i < numOpened; i++) {
+		close(opened[i]);
+	}
+	return result;
+}
+
+
+static void restore_redirects (struct saved_fd *saved, int numSaved) {
+
+	fflush(stdout);
+
+	while(numSaved-- > 0) {
+
+		if(saved[numSaved].copy == -1) {
+
+			close(saved[numSaved].fd);
+		}
+		else {
+
+			dup2(saved[numSaved].copy, saved[numSaved].fd);
+			close(saved[numSaved].copy);
+		}
+	}
+}
+
+
+/*
+ * Records how a child ended in status
+ * and signalNum, as smallsh_status expects.
+ */
+static void record_child_status (struct smallsh_shell *sh, int childStatus) {
+
+	/*
+	 * If the child was killed by a
+	 * signal record that signal in signalNum
+	 * and set status to the SIGNAL_KILLED
+	 * sentinel so smallsh_status will know it
+	 * was terminated via signal.
+	 */
+	if(WIFSIGNALED(childStatus)) {
+
+		sh->signalNum = WTERMSIG(childStatus);
+		sh->status = SIGNAL_KILLED;
+	}
+
+	/*
+	 * If the child reached an exit, record the
+	 * exit status for smallsh_status.
+	 */
+	else {
+
+		sh->status = WEXITSTATUS(childStatus);
+	}
+}
+
+
+/*
+ * Coprocesses, by name. A coprocess is
+ * dropped when its job is reaped, or when
+ * the shell exits. Forked copies of the
+ * shell drop them all.
+ */
+static struct smallsh_coproc *find_coproc (struct smallsh_shell *sh, const char *name) {
+
+	struct smallsh_coproc *coproc;
+
+	for(coproc = sh->coprocs; coproc != NULL; coproc = coproc->next) {
+
+		if(!strcmp(coproc->name, name)) {
+			return coproc;
+		}
+	}
+	return NULL;
+}
+
+
+static void drop_coproc (struct smallsh_shell *sh, struct smallsh_coproc *coproc) {
+
+	struct smallsh_coproc **link;
+
+	for(link = &sh->coprocs; *link != coproc; link = &(*link)->next) {
+		;
+	}
+	*link = coproc->next;
+
+	if(coproc->input != -1) {
+		close(coproc->input);
+	}
+	close(coproc->output);
+	free(coproc->name);
+	free(coproc->buffer);
+	free(coproc);
+}
+
+
+/*
+ * Completion callback of background jobs,
+ * run when the context reaps them. Reports
+ * the job and removes it from the array of
+ * background jobs.
+ */
+static void background_done (struct smallsh_job *job, void *data) {
+
+	struct smallsh_shell *sh = data;
+	struct smallsh_finished *finished;
+	struct smallsh_coproc *coproc;
+	int childStatus;
+	int i;
+
+	smallsh_job_status(job, &childStatus, NULL);
+
+	if(WIFEXITED(childStatus)) {
+
+		printf("Background PID %ld is done: exit value %d\n", (long)smallsh_job_pid(job), WEXITSTATUS(childStatus));
+	}
+	else {
+
+		printf("Background PID %ld is done: terminated by signal %d\n", (long)smallsh_job_pid(job), WTERMSIG(childStatus));
+	}
+	fflush(stdout);
+
+	for(coproc = sh->coprocs; coproc != NULL; coproc = coproc->next) {
+
+		if(coproc->job == job) {
+
+			drop_coproc(sh, coproc);
+			break;
+		}
+	}
+
+	/*
+	 * Remove process from array when it terminates
+	 */
+	for(i = 0; i < sh->numBGProcesses; i++) {
+
+		if(sh->backgroundJobs[i].job == job) {
+
+			/* Keep the status for wait, dropping the oldest if full */
+			if(sh->numFinished == MAX_FORKS) {
+
+				sh->numFinished--;
+				memmove(&sh->finishedJobs[0], &sh->finishedJobs[1], sh->numFinished * sizeof(struct smallsh_finished));
+			}
+			finished = &sh->finishedJobs[sh->numFinished++];
+			finished->pid = smallsh_job_pid(job);
+			finished->id = sh->backgroundJobs[i].id;
+			finished->status = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 128 + WTERMSIG(childStatus);
+
+			free(sh->backgroundJobs[i].command);
+			sh->numBGProcesses--;
+			memmove(&sh->backgroundJobs[i], &sh->backgroundJobs[i + 1], (sh->numBGProcesses - i) * sizeof(struct smallsh_background));
+			smallsh_job_release(job);
+			break;
+		}
+	}
+}
+
+
+/*
+ * Reaps finished background jobs, then
+ * checks the number of running children
+ * against MAX_FORKS. Done before every
+ * fork so long scripts do not run into
+ * the limit. Returns -1 if the command
+ * must not start.
+ */
+static int check_fork_limit (struct smallsh_shell *sh) {
+
+	smallsh_ctx_dispatch(sh->ctx, 0);
+
+	/*
+	 * Fork bomb prevention. Fail the
+	 * command if the number of forks
+	 * reaches MAX_FORKS.
+	 */
+	if(smallsh_ctx_running(sh->ctx) >= MAX_FORKS) {
+
+		fflush(stdout);
+		fprintf(stderr, "smallsh: too many forked processes\n");
+		fflush(stderr);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * SIGINT taken from the shell while a builtin
+ * blocks, so it can end the wait.
+ */
+struct held_sigint {
+
+	struct sigaction savedInt;
+	sigset_t savedMask;
+	int taken;
+	int blocked;
+	int fd;
+};
+
+/*
+ * Blocks SIGINT and opens a signalfd for it,
+ * with SIGTERM and SIGHUP too when withTerm
+ * is set. The interactive shell ignores
+ * SIGINT, so it is set back to the default
+ * meanwhile; a background subshell, which
+ * ignores it, is left alone. held->fd is -1
+ * when no signals were taken.
+ */
+static void take_sigint (struct smallsh_shell *sh, struct held_sigint *held, int withTerm) {
+
+	struct sigaction handling;
+	sigset_t signals;
+
+	sigaction(SIGINT, NULL, &held->savedInt);
+	held->taken = held->savedInt.sa_handler != SIG_IGN || !sh->isSubshell;
+	held->fd = -1;
+
+	sigemptyset(&signals);
+	if(held->taken) {
+		sigaddset(&signals, SIGINT);
+	}
+	if(withTerm) {
+
+		sigaddset(&signals, SIGTERM);
+		sigaddset(&signals, SIGHUP);
+	}
+	held->blocked = held->taken || withTerm;
+	if(!held->blocked) {
+		return;
+	}
+
+	sigprocmask(SIG_BLOCK, &signals, &held->savedMask);
+	if(held->taken) {
+
+		handling = held->savedInt;
+		handling.sa_handler = SIG_DFL;
+		sigaction(SIGINT, &handling, NULL);
+	}
+	held->fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+
+/*
+ * Undoes take_sigint. SIGINT is put back
+ * before unblocking so a pending one is
+ * dropped.
+ */
+static void release_sigint (struct held_sigint *held) {
+
+	if(!held->blocked) {
+		return;
+	}
+	if(held->taken) {
+		sigaction(SIGINT, &held->savedInt, NULL);
+	}
+	sigprocmask(SIG_SETMASK, &held->savedMask, NULL);
+	if(held->fd != -1) {
+		close(held->fd);
+	}
+}
+
+
+/*
+ * Holds a background launch back while
+ * pressure on the system is over the limits
+ * in SMALLSH_PSI, reaping jobs that finish
+ * meanwhile. SIGINT lets the launch go
+ * ahead at once.
+ */
+static void throttle_launch (struct smallsh_shell *sh) {
+
+	const char *setting = getenv("SMALLSH_PSI");
+	struct pollfd fds[2];
+	struct signalfd_siginfo caught;
+	struct held_sigint interrupt;
+	long long started;
+	int over;
+
+	if(setting == NULL) {
+		setting = "";
+	}
+	if(strcmp(setting, sh->psi.setting != NULL ? sh->psi.setting : "") &&
+			smallsh_psi_configure(&sh->psi, setting) == -1) {
+		fprintf(stderr, "smallsh: SMALLSH_PSI: cannot use all of %s\n", setting);
+	}
+	if(sh->psi.setting == NULL) {
+		return;
+	}
+
+	started = now_ms();
+	over = smallsh_psi_check(&sh->psi, started);
+	if(over == -1) {
+		return;
+	}
+
+	take_sigint(sh, &interrupt, 0);
+
+	fds[0].fd = smallsh_ctx_fd(sh->ctx);
+	fds[0].events = POLLIN;
+	fds[1].fd = interrupt.fd;
+	fds[1].events = POLLIN;
+
+	while(over != -1) {
+
+		if(poll(fds, interrupt.fd == -1 ? 1 : 2, PSI_WINDOW_MS) == -1 && errno != EINTR) {
+			break;
+		}
+		if(interrupt.fd != -1 && (fds[1].revents & POLLIN)) {
+
+			read(interrupt.fd, &caught, sizeof(caught));
+			break;
+		}
+		smallsh_ctx_dispatch(sh->ctx, 0);
+		over = smallsh_psi_check(&sh->psi, now_ms());
+	}
+
+	release_sigint(&interrupt);
+
+	sh->psi.numThrottled++;
+	sh->psi.throttledMs += now_ms() - started;
+}
+
+
+/*
+ * Forks a copy of the shell, tracked as
+ * a job in the parent. The child forgets
+ * the parent's jobs.
+ */
+static pid_t shell_fork (struct smallsh_shell *sh, int background, struct smallsh_job **job) {
+
+	pid_t forkedPID;
+
+	if(background) {
+		throttle_launch(sh);
+	}
+	if(check_fork_limit(sh) == -1) {
+		return -1;
+	}
+
+	fflush(stdout);
+	if(sh->timing != NULL) {
+		fflush(sh->timing);
+	}
+	if(sh->pstatLog != NULL) {
+		fflush(sh->pstatLog);
+	}
+	forkedPID = fork();
+
+	if(forkedPID == -1) {
+
+		perror("fork");
+		fflush(stdout);
+	}
+	else if(forkedPID == 0) {
+
+		smallsh_ctx_after_fork(sh->ctx);
+		sh->numBGProcesses = 0;
+		sh->numFinished = 0;
+
+		/* Coprocesses must see end of input when the shell that started them closes it */
+		while(sh->coprocs != NULL) {
+			drop_coproc(sh, sh->coprocs);
+		}
+
+		/* Only the top shell logs timings, counters and progress */
+		sh->timing = NULL;
+		sh->pstatLog = NULL;
+		sh->journal = NULL;
+	}
+	else {
+
+		*job = smallsh_job_adopt(sh->ctx, forkedPID, background ? background_done : NULL, sh);
+	}
+	return forkedPID;
+}
+
+
+/*
+ * Child side setup of a forked subshell.
+ */
+static void setup_child (struct smallsh_shell *sh, int background) {
+
+	struct sigaction handling;
+	int nullFile;
+
+	/*
+	 * The job leads its own process group, and
+	 * can be stopped from the terminal even if
+	 * the shell ignores the stop signals.
+	 */
+	if(background || sh->jobControl) {
+		setpgid(0, 0);
+	}
+	sigemptyset(&(handling.sa_mask));
+	handling.sa_flags = 0;
+	handling.sa_handler = SIG_DFL;
+	sigaction(SIGTSTP, &handling, NULL);
+	sigaction(SIGTTIN, &handling, NULL);
+	sigaction(SIGTTOU, &handling, NULL);
+	sh->jobControl = 0;
+
+	/*
+	 * If the process will run in the
+	 * foreground, register it to handle
+	 * SIGINT with the default action,
+	 * undoing the SIG_IGN flag set
+	 * at the top of the parent.
+	 *
+	 * A background process keeps ignoring
+	 * SIGINT. Its input and output are
+	 * redirected to /dev/null; redirections
+	 * given on the command line are applied
+	 * after this and take their place.
+	 */
+
+	if(!background) {
+
+		sigemptyset(&(handling.sa_mask));
+		handling.sa_flags = 0;
+		handling.sa_handler = SIG_DFL;
+		sigaction(SIGINT, &handling, NULL);
+		return;
+	}
+
+	nullFile = open("/dev/null", O_RDWR);
+	if(nullFile == -1) {
+
+		perror("open");
+		fflush(stdout);
+		return;
+	}
+
+	dup2(nullFile, 0);
+	dup2(nullFile, 1);
+	if(nullFile > 1) {
+		close(nullFile);
+	}
+}
+
+
+/*
+ * Records a job started in the background,
+ * listed by jobs as command.
+ */
+static void add_background (struct smallsh_shell *sh, struct smallsh_job *job, const char *command) {
+
+	struct smallsh_background *entry = &sh->backgroundJobs[sh->numBGProcesses];
+
+	entry->job = job;
+	entry->id = sh->numBGProcesses > 0 ? entry[-1].id + 1 : 1;
+	entry->command = strdup(command);
+	entry->stopped = 0;
+	entry->hasModes = 0;
+	sh->numBGProcesses++;
+	sh->lastBackgroundPID = smallsh_job_pid(job);
+}
+
+
+/*
+ * Waits for a foreground job. With job
+ * control it gets the terminal, with its
+ * saved modes if resuming, until it exits
+ * or stops; a stop returns a WIFSTOPPED
+ * status with the job's modes in modes.
+ */
+static int wait_foreground (struct smallsh_shell *sh, struct smallsh_job *job, struct smallsh_background *resuming,
+		struct termios *modes) {
+
+	pid_t group = smallsh_job_pid(job);
+	int childStatus;
+
+	if(!sh->jobControl) {
+		return smallsh_job_wait(job);
+	}
+
+	setpgid(group, group);
+	if(resuming != NULL && resuming->hasModes) {
+		tcsetattr(sh->terminal, TCSADRAIN, &resuming->modes);
+	}
+	tcsetpgrp(sh->terminal, group);
+	if(resuming != NULL) {
+		killpg(group, SIGCONT);
+	}
+
+	/* A read or mode change before the handover stops the job; let it go on */
+	while(WIFSTOPPED(childStatus = smallsh_job_wait_stop(job)) &&
+			(WSTOPSIG(childStatus) == SIGTTIN || WSTOPSIG(childStatus) == SIGTTOU)) {
+		killpg(group, SIGCONT);
+	}
+
+	tcsetpgrp(sh->terminal, sh->shellGroup);
+	if(WIFSTOPPED(childStatus)) {
+		tcgetattr(sh->terminal, modes);
+	}
+	tcsetattr(sh->terminal, TCSADRAIN, &sh->shellModes);
+	return childStatus;
+}
+
+
+/*
+ * Records a foreground job that was stopped
+ * as a stopped background job.
+ */
+static void stop_foreground (struct smallsh_shell *sh, struct smallsh_job *job, const char *command, int childStatus,
+		struct termios *modes) {
+
+	struct smallsh_background *entry = &sh->backgroundJobs[sh->numBGProcesses];
+
+	add_background(sh, job, command);
+	entry->stopped = 1;
+	entry->hasModes = 1;
+	entry->modes = *modes;
+	smallsh_job_set_callback(job, background_done, sh);
+
+	printf("\n[%d] Stopped %s\n", entry->id, entry->command);
+	fflush(stdout);
+	sh->status = 128 + WSTOPSIG(childStatus);
+}
+
+
+/*
+ * Parent side of a launch: wait on a
+ * foreground job, or record a
+ * background one.
+ */
+static int finish_launch (struct smallsh_shell *sh, struct smallsh_job *job, struct smallsh_node *node, int background) {
+
+	struct termios modes;
+	char command[256];
+	int childStatus;
+
+	/*
+	 * If launched as a background process,
+	 * add the job to the array of
+	 * background jobs.
+	 *
+	 * The shell reaps background jobs before
+	 * asking for input each loop.
+	 */
+
+	if(background) {
+
+		setpgid(smallsh_job_pid(job), smallsh_job_pid(job));
+		printf("Background PID is %ld\n", (long)smallsh_job_pid(job));
+		fflush(stdout);
+
+		smallsh_node_text(node, command, sizeof(command));
+		add_background(sh, job, command);
+		sh->status = 0;
+		return 0;
+	}
+
+	/*
+	 * If launched as a foreground process,
+	 * the shell will wait for the child.
+	 */
+
+	childStatus = wait_foreground(sh, job, NULL, &modes);
+	if(WIFSTOPPED(childStatus)) {
+
+		smallsh_node_text(node, command, sizeof(command));
+		stop_foreground(sh, job, command, childStatus, &modes);
+		return sh->status;
+	}
+
+	record_child_status(sh, childStatus);
+	smallsh_job_release(job);
+
+	if(sh->status == SIGNAL_KILLED) {
+
+		printf("Terminated by signal %d\n", sh->signalNum);
+		fflush(stdout);
+	}
+	return sh->status;
+}
+
+
+/*
+ * The SMALLSH_PSTAT log, reopened when the
+ * variable has changed since the last
+ * launch, so it can be set from the rc file
+ * or with export. NULL when unset and in
+ * subshells, where only the top shell logs.
+ */
+static FILE *pstat_log (struct smallsh_shell *sh) {
+
+	const char *path = getenv("SMALLSH_PSTAT");
+
+	if(sh->isSubshell) {
+		return NULL;
+	}
+	if(path != NULL && path[0] == '\0') {
+		path = NULL;
+	}
+	if(path == NULL ? sh->pstatPath == NULL : sh->pstatPath != NULL && !strcmp(path, sh->pstatPath)) {
+		return sh->pstatLog;
+	}
+
+	if(sh->pstatLog != NULL) {
+		fclose(sh->pstatLog);
+	}
+	free(sh->pstatPath);
+	sh->pstatLog = NULL;
+	sh->pstatPath = NULL;
+
+	if(path != NULL) {
+
+		sh->pstatPath = strdup(path);
+		sh->pstatLog = fopen(path, "ae");
+		if(sh->pstatLog == NULL) {
+			fprintf(stderr, "smallsh: SMALLSH_PSTAT: %s: %s\n", path, strerror(errno));
+		}
+	}
+	return sh->pstatLog;
+}
+
+
+/*
+ * Starts an external command through the
+ * job launcher. The command is looked up
+ * in the PATH table first, and the launcher
+ * searches PATH the way execvp does if the
+ * table does not have it.
+ */
+static int launch_external (struct smallsh_shell *sh, struct smallsh_node *node, int argc, char *argv[],
+		char *assignments[], struct smallsh_arena *arena, int background) {
+
+	struct smallsh_job_spec spec;
+	struct smallsh_fd_action *actions;
+	struct smallsh_job *job;
+	struct smallsh_pstat pstat;
+	char resolved[4096];
+	char command[256];
+	int *opened;
+	int numOpened = 0;
+	int numRedirects = count_redirects(node->redirects);
+	int counting = 0;
+	int i;
+
+	if(background) {
+		throttle_launch(sh);
+	}
+	if(check_fork_limit(sh) == -1) {
+
+		sh->status = 1;
+		return 1;
+	}
+
+	memset(&spec, 0, sizeof(spec));
+	spec.argv = argv;
+
+	/* Assignments before the command only reach its environment */
+	spec.env = assignments[0] != NULL ? assignments : NULL;
+
+	for(i = 0; assignments[i] != NULL && strncmp(assignments[i], "PATH=", 5); i++) {
+		;
+	}
+	if(assignments[i] == NULL) {
+
+		smallsh_path_refresh(&sh->paths, getenv("PATH"));
+		spec.path = smallsh_path_lookup(&sh->paths, argv[0], resolved, sizeof(resolved));
+	}
+
+	actions = smallsh_arena_alloc(arena, (numRedirects + 2) * sizeof(struct smallsh_fd_action));
+	opened = smallsh_arena_alloc(arena, (numRedirects + 1) * sizeof(int));
+	spec.actions = actions;
+
+	/*
+	 * A background process keeps ignoring
+	 * SIGINT, and its input and output go to
+	 * /dev/null unless redirected. Foreground
+	 * processes get the default action back.
+	 */
+	if(background) {
+
+		actions[0].type = SMALLSH_FD_OPEN;
+		actions[0].fd = 0;
+		actions[0].path = "/dev/null";
+		actions[0].flags = O_RDONLY;
+		actions[1] = actions[0];
+		actions[1].fd = 1;
+		actions[1].flags = O_WRONLY;
+		spec.numActions = 2;
+		spec.flags = SMALLSH_SPAWN_NEW_GROUP;
+		spec.onComplete = background_done;
+		spec.data = sh;
+	}
+	else {
+
+		spec.flags = SMALLSH_SPAWN_DEFAULT_SIGINT | (sh->jobControl ? SMALLSH_SPAWN_NEW_GROUP : 0);
+	}
+
+	if(redirect_actions(sh, node->redirects, arena, actions, &spec.numActions, opened, &numOpened) == -1) {
+
+		job = NULL;
+		errno = 0;
+	}
+	else {
+
+		/* Only a foreground job can be counted; nothing else starts while it runs */
+		counting = !background && pstat_log(sh) != NULL && smallsh_pstat_open(&pstat, 1) == 0;
+
+		fflush(stdout);
+		job = smallsh_spawn(sh->ctx, &spec);
+		if(job == NULL) {
+
+			fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+			errno = 0;
+		}
+	}
+
+	for(i = 0; i < numOpened; i++) {
+		close(opened[i]);
+	}
+
+	if(job == NULL) {
+
+		if(counting) {
+			smallsh_pstat_read(&pstat);
+		}
+		sh->status = 1;
+		return 1;
+	}
+
+	finish_launch(sh, job, node, background);
+
+	if(counting) {
+
+		smallsh_pstat_read(&pstat);
+		smallsh_node_text(node, command, sizeof(command));
+		smallsh_pstat_log(&pstat, sh->pstatLog, exit_code(sh), command);
+	}
+	return sh->status;
+}
+
+
+/*
+ * Runs node in a forked copy of the shell,
+ * for ( ) and for builtins, functions and
+ * compound commands sent to the background.
+ */
+static int run_subshell (struct smallsh_shell *sh, struct smallsh_node *node, int background) {
+
+	struct smallsh_job *job;
+	pid_t forkedPID = shell_fork(sh, background, &job);
+
+	if(forkedPID == -1) {
+
+		sh->status = 1;
+		return 1;
+	}
+
+	if(forkedPID == 0) {
+
+		setup_child(sh, background);
+		sh->isSubshell = 1;
+
+		exec_node(sh, node);
+		fflush(stdout);
+		exit(exit_code(sh));
+	}
+
+	return finish_launch(sh, job, node, background);
+}
+
+
+static int call_function (struct smallsh_shell *sh, struct smallsh_function *function, int argc, char *argv[]) {
+
+	int savedNumParams = sh->numParams;
+	char **savedParams = sh->params;
+	int savedLoopDepth = sh->loopDepth;
+
+	if(sh->callDepth >= MAX_CALL_DEPTH) {
+
+		fprintf(stderr, "%s: maximum function nesting exceeded\n", argv[0]);
+		sh->status = 1;
+		return 1;
+	}
+
+	sh->numParams = argc - 1;
+	sh->params = argv + 1;
+	sh->loopDepth = 0;
+	sh->callDepth++;
+
+	exec_node(sh, function->body);
+
+	sh->callDepth--;
+	sh->returning = 0;
+	sh->loopDepth = savedLoopDepth;
+	sh->numParams = savedNumParams;
+	sh->params = savedParams;
+	return sh->status;
+}
+
+
+/*
+ * Starts argv without waiting for it: an
+ * external command through the job launcher,
+ * or a builtin or function in a forked copy
+ * of the shell. actions and flags are as in
+ * smallsh_job_spec, with only SMALLSH_FD_DUP
+ * actions allowed. A background job is
+ * reaped by background_done.
+ */
+static struct smallsh_job *start_command (struct smallsh_shell *sh, char *argv[],
+		const struct smallsh_fd_action *actions, int numActions, int flags, int background) {
+
+	struct smallsh_job_spec spec;
+	struct smallsh_function *function = find_function(sh, argv[0]);
+	const struct smallsh_builtin *builtin = find_builtin(argv[0]);
+	struct smallsh_job *job = NULL;
+	struct sigaction handling;
+	char resolved[4096];
+	sigset_t signals;
+	int argc;
+
+	for(argc = 0; argv[argc] != NULL; argc++) {
+		;
+	}
+
+	if(function == NULL && builtin == NULL) {
+
+		if(background) {
+			throttle_launch(sh);
+		}
+		if(check_fork_limit(sh) == -1) {
+			return NULL;
+		}
+
+		memset(&spec, 0, sizeof(spec));
+		spec.argv = argv;
+		spec.actions = actions;
+		spec.numActions = numActions;
+		spec.flags = flags;
+		if(background) {
+
+			spec.flags |= SMALLSH_SPAWN_NEW_GROUP;
+			spec.onComplete = background_done;
+			spec.data = sh;
+		}
+		smallsh_path_refresh(&sh->paths, getenv("PATH"));
+		spec.path = smallsh_path_lookup(&sh->paths, argv[0], resolved, sizeof(resolved));
+
+		fflush(stdout);
+		job = smallsh_spawn(sh->ctx, &spec);
+		if(job == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		}
+		return job;
+	}
+
+	if(shell_fork(sh, background, &job) == 0) {
+
+		if(background || (flags & SMALLSH_SPAWN_NEW_GROUP)) {
+			setpgid(0, 0);
+		}
+		sh->jobControl = 0;
+		sigemptyset(&signals);
+		sigprocmask(SIG_SETMASK, &signals, NULL);
+		if(flags & SMALLSH_SPAWN_DEFAULT_SIGINT) {
+
+			sigemptyset(&(handling.sa_mask));
+			handling.sa_flags = 0;
+			handling.sa_handler = SIG_DFL;
+			sigaction(SIGINT, &handling, NULL);
+		}
+		if(apply_actions(actions, numActions, NULL, NULL) == -1) {
+			exit(1);
+		}
+		sh->isSubshell = 1;
+
+		if(function != NULL) {
+			call_function(sh, function, argc, argv);
+		}
+		else {
+			sh->status = builtin->run(sh, argc, argv);
+		}
+		fflush(stdout);
+		exit(exit_code(sh));
+	}
+	return job;
+}
+
+
+/*
+ * Command substitution. A lone external
+ * command is started with its output on a
+ * pipe, read into a buffer that grows as
+ * needed. Anything else runs in the shell
+ * itself, with standard output moved to a
+ * memfd, so builtins and functions write
+ * straight into the capture and only what
+ * they start forks; the memfd is then
+ * mapped rather than copied.
+ */
+
+/*
+ * True if node is a simple command whose
+ * name, as written, is not a function or
+ * builtin, so it can go to a pipe without
+ * expanding it twice.
+ */
+static int is_plain_external (struct smallsh_shell *sh, struct smallsh_node *node) {
+
+	const char *name;
+
+	if(node->type != NODE_COMMAND || node->words == NULL || node->assignments != NULL) {
+		return 0;
+	}
+
+	name = node->words->text;
+	return strpbrk(name, "$`'\"\\*?[~=") == NULL && find_function(sh, name) == NULL && find_builtin(name) == NULL;
+}
+
+
+static void capture_pipe (struct smallsh_shell *sh, struct smallsh_node *node, struct smallsh_arena *arena,
+		struct capture *output) {
+
+	struct smallsh_fd_action *actions;
+	struct smallsh_job *job = NULL;
+	char **argv;
+	int *opened;
+	int numActions = 1;
+	int numOpened = 0;
+	int argc;
+	int fds[2];
+	ssize_t got;
+	int i;
+
+	argv = expand_words(sh, node->words, arena, &argc);
+	if(bad_substitution(sh) == -1) {
+
+		sh->status = 1;
+		return;
+	}
+
+	if(pipe2(fds, O_CLOEXEC) == -1) {
+
+		perror("pipe");
+		sh->status = 1;
+		return;
+	}
+
+	actions = smallsh_arena_alloc(arena, (count_redirects(node->redirects) + 1) * sizeof(struct smallsh_fd_action));
+	opened = smallsh_arena_alloc(arena, (count_redirects(node->redirects) + 1) * sizeof(int));
+	actions[0].type = SMALLSH_FD_DUP;
+	actions[0].fd = 1;
+	actions[0].source = fds[1];
+
+	if(argc > 0 && redirect_actions(sh, node->redirects, arena, actions, &numActions, opened, &numOpened) == 0) {
+		job = start_command(sh, argv, actions, numActions, SMALLSH_SPAWN_DEFAULT_SIGINT, 0);
+	}
+
+	close(fds[1]);
+	for(i = 0; i < numOpened; i++) {
+		close(opened[i]);
+	}
+
+	for(;;) {
+
+		if(output->length == output->capacity) {
+
+			output->capacity = output->capacity ? output->capacity * 2 : 4096;
+			output->data = realloc(output->data, output->capacity);
+		}
+
+		got = read(fds[0], output->data + output->length, output->capacity - output->length);
+		if(got == -1 && errno == EINTR) {
+			continue;
+		}
+		if(got <= 0) {
+			break;
+		}
+		output->length += got;
+	}
+	close(fds[0]);
+
+	if(job != NULL) {
+
+		record_child_status(sh, smallsh_job_wait(job));
+		smallsh_job_release(job);
+	}
+	else {
+
+		sh->status = argc > 0 ? 127 : 1;
+	}
+}
+
+
+static void capture_in_process (struct smallsh_shell *sh, struct smallsh_node *program, struct smallsh_arena *arena,
+		struct capture *output) {
+
+	struct stat info;
+	int keepArena = sh->keepArena;
+	int breakCount = sh->breakCount;
+	int continueCount = sh->continueCount;
+	int returning = sh->returning;
+	int file;
+	int saved;
+	int cwd;
+
+	file = memfd_create("substitution", MFD_CLOEXEC);
+	if(file == -1) {
+
+		perror("memfd_create");
+		smallsh_arena_free(arena);
+		free(arena);
+		sh->status = 1;
+		return;
+	}
+
+	/* A cd in the body must not move the shell */
+	cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	fflush(stdout);
+	saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+	dup2(file, STDOUT_FILENO);
+
+	sh->substitutionDepth++;
+	smallsh_shell_exec(sh, program, arena);
+	sh->substitutionDepth--;
+
+	/*
+	 * break, continue, return and exit end at
+	 * the substitution. A function it defines
+	 * may point into the word's own arena, so
+	 * that is kept as well.
+	 */
+	sh->keepArena |= keepArena;
+	sh->breakCount = breakCount;
+	sh->continueCount = continueCount;
+	sh->returning = returning;
+	sh->exiting = 0;
+
+	if(cwd != -1) {
+
+		if(fchdir(cwd) == -1) {
+			perror("smallsh: cannot return to the working directory");
+		}
+		close(cwd);
+	}
+
+	fflush(stdout);
+	if(saved == -1) {
+		close(STDOUT_FILENO);
+	}
+	else {
+
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+
+	if(fstat(file, &info) == 0 && info.st_size > 0) {
+
+		output->data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if(output->data == MAP_FAILED) {
+			output->data = NULL;
+		}
+		else {
+
+			output->length = info.st_size;
+			output->capacity = info.st_size;
+			output->mapped = 1;
+		}
+	}
+	close(file);
+}
+
+
+/*
+ * Runs a substitution parsed with its word,
+ * or else parses body, in which case the
+ * error is reported. The arena holds what
+ * the run allocates, and a tree parsed here.
+ */
+static void run_substitution (struct smallsh_shell *sh, struct smallsh_node *program, const char *body,
+		struct capture *output) {
+
+	struct smallsh_arena *arena = malloc(sizeof(struct smallsh_arena));
+	struct smallsh_parse_error error;
+	struct smallsh_node *node;
+
+	memset(output, 0, sizeof(*output));
+	sh->numSubstitutions++;
+	smallsh_arena_init(arena);
+
+	if(program == NULL) {
+		program = smallsh_parse(arena, body, &error);
+	}
+	if(program == NULL) {
+
+		fprintf(stderr, "smallsh: command substitution: %s\n", error.message);
+		fflush(stderr);
+		smallsh_arena_free(arena);
+		free(arena);
+		sh->status = 2;
+		return;
+	}
+
+	node = program;
+	if(node->type == NODE_LIST && node->left != NULL && node->left->next == NULL) {
+		node = node->left;
+	}
+
+	if(is_plain_external(sh, node)) {
+
+		capture_pipe(sh, node, arena, output);
+		smallsh_arena_free(arena);
+		free(arena);
+	}
+	else {
+
+		capture_in_process(sh, program, arena, output);
+	}
+}
+
+
+/*
+ * Builtins that need the shell's state.
+ * Each gets argv with the command name
+ * first, like main(), and returns the
+ * status.
+ */
+
+/*
+ * Unwinds out of the run like return does;
+ * the program embedding the shell, or a
+ * forked subshell, then ends the process.
+ */
+static int builtin_exit (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	int exitStatus = argc > 1 ? atoi(argv[1]) : 0;
+	pid_t *background;
+	int i;
+
+	sh->exiting = 1;
+
+	/*
+	 * A subshell, or a substitution run in
+	 * the shell, just ends, leaving the
+	 * background processes of the shell
+	 * alone.
+	 */
+	if(sh->isSubshell || sh->substitutionDepth > 0) {
+		return exitStatus;
+	}
+
+	stop_coprocs(sh);
+	background = calloc(sh->numBGProcesses + 1, sizeof(pid_t));
+
+	for(i = 0; i < sh->numBGProcesses; i++) {
+		background[i] = smallsh_job_pid(sh->backgroundJobs[i].job);
+	}
+
+	/*
+	 * Kill all processes started by
+	 * the shell
+	 */
+	smallsh_stop_jobs(sh->numBGProcesses, background);
+	free(background);
+	return exitStatus;
+}
+
+
+static int builtin_status (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	smallsh_status(sh->status, sh->signalNum);
+
+	/*
+	 * Successfully executing status means
+	 * the last command was successfully
+	 * executed. This is the same behavior
+	 * as echo $? in bash.
+	 */
+	return 0;
+}
+
+
+static int builtin_cd (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	return smallsh_cd(argc - 1, argv + 1);
+}
+
+
+static int builtin_echo (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	return smallsh_echo(argc - 1, argv + 1);
+}
+
+
+static int builtin_test (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	/* [ needs a closing ] that is not part of the expression */
+	if(!strcmp(argv[0], "[")) {
+
+		if(strcmp(argv[argc - 1], "]")) {
+
+			fprintf(stderr, "[: missing ]\n");
+			return 2;
+		}
+		argc--;
+	}
+	return smallsh_test(argc - 1, argv + 1);
+}
+
+
+static int builtin_true (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	return 0;
+}
+
+
+static int builtin_false (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	return 1;
+}
+
+
+static int builtin_export (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_var *var;
+	char *equals;
+	const char *value;
+	int i;
+
+	for(i = 1; i < argc; i++) {
+
+		equals = strchr(argv[i], '=');
+		if(equals != NULL) {
+			*equals = '\0';
+		}
+
+		if(!smallsh_is_name(argv[i], strlen(argv[i]))) {
+
+			fprintf(stderr, "export: %s: not a valid name\n", argv[i]);
+			return 1;
+		}
+
+		value = equals != NULL ? equals + 1 : get_var(sh, argv[i]);
+		setenv(argv[i], value != NULL ? value : "", 1);
+
+		var = find_var(sh, argv[i]);
+		if(var != NULL) {
+
+			var->exported = 1;
+			free(var->value);
+			var->value = strdup(getenv(argv[i]));
+		}
+	}
+	return 0;
+}
+
+
+static int builtin_unset (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	int i;
+
+	for(i = 1; i < argc; i++) {
+		unset_var(sh, argv[i]);
+	}
+	return 0;
+}
+
+
+static int builtin_shift (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	int count = argc > 1 ? atoi(argv[1]) : 1;
+
+	if(count < 0 || count > sh->numParams) {
+		return 1;
+	}
+	sh->params += count;
+	sh->numParams -= count;
+	return 0;
+}
+
+
+static int builtin_return (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	if(sh->callDepth == 0 && sh->sourceDepth == 0) {
+
+		fprintf(stderr, "return: can only return from a function or sourced file\n");
+		return 1;
+	}
+	sh->returning = 1;
+	return argc > 1 ? atoi(argv[1]) : exit_code(sh);
+}
+
+
+/*
+ * Maps a file of length bytes with a NUL
+ * after it, for the parser. The file is
+ * mapped over a zeroed reservation one byte
+ * longer, so the NUL is there even when the
+ * length is a multiple of the page size.
+ */
+static char *map_source (int fd, size_t length) {
+
+	char *text = mmap(NULL, length + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(text == MAP_FAILED) {
+		return NULL;
+	}
+	if(length > 0 && mmap(text, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+
+		munmap(text, length + 1);
+		return NULL;
+	}
+	return text;
+}
+
+
+/*
+ * Returns the parsed tree of the file at
+ * path, parsing it only if it is new to the
+ * shell or has changed since. NULL after
+ * reporting an error.
+ */
+static struct smallsh_sourced *load_sourced (struct smallsh_shell *sh, const char *path) {
+
+	struct smallsh_sourced *entry;
+	struct smallsh_parse_error error;
+	struct smallsh_arena *arena;
+	struct smallsh_node *program;
+	struct stat info;
+	char *text;
+	int fd;
+
+	if(stat(path, &info) == -1) {
+
+		perror(path);
+		return NULL;
+	}
+
+	for(entry = sh->sourced; entry != NULL; entry = entry->next) {
+
+		if(entry->device == info.st_dev && entry->inode == info.st_ino) {
+			break;
+		}
+	}
+	if(entry != NULL && entry->size == info.st_size && entry->mtime.tv_sec == info.st_mtim.tv_sec &&
+			entry->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+		return entry;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1 || fstat(fd, &info) == -1) {
+
+		perror(path);
+		if(fd != -1) {
+			close(fd);
+		}
+		return NULL;
+	}
+	if(!S_ISREG(info.st_mode)) {
+
+		fprintf(stderr, "%s: not a regular file\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	text = map_source(fd, info.st_size);
+	close(fd);
+	if(text == NULL) {
+
+		perror(path);
+		return NULL;
+	}
+	if(memchr(text, '\0', info.st_size) != NULL) {
+
+		fprintf(stderr, "%s: not a text file\n", path);
+		munmap(text, info.st_size + 1);
+		return NULL;
+	}
+
+	arena = malloc(sizeof(struct smallsh_arena));
+	smallsh_arena_init(arena);
+	program = smallsh_parse(arena, text, &error);
+	munmap(text, info.st_size + 1);
+
+	if(program == NULL) {
+
+		fprintf(stderr, "smallsh: %s: line %d: %s\n", path, error.line, error.message);
+		smallsh_arena_free(arena);
+		free(arena);
+		return NULL;
+	}
+
+	if(entry == NULL) {
+
+		entry = calloc(1, sizeof(struct smallsh_sourced));
+		entry->next = sh->sourced;
+		sh->sourced = entry;
+	}
+	else {
+
+		/* Functions from the old version may still point into its arena */
+		sh->keptArenas = realloc(sh->keptArenas, (sh->numKeptArenas + 1) * sizeof(struct smallsh_arena *));
+		sh->keptArenas[sh->numKeptArenas++] = entry->arena;
+	}
+
+	entry->device = info.st_dev;
+	entry->inode = info.st_ino;
+	entry->size = info.st_size;
+	entry->mtime = info.st_mtim;
+	entry->arena = arena;
+	entry->program = program;
+	return entry;
+}
+
+
+/*
+ * source file [args]
+ * . file [args]
+ *
+ * Runs file in this shell, so variables,
+ * functions and the directory it sets stay
+ * set. Arguments replace $1, $2... while it
+ * runs, and return ends it early. A file is
+ * parsed the first time and again only after
+ * it changes, so sourcing it in a loop costs
+ * a stat.
+ */
+static int builtin_source (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_sourced *entry;
+	int savedNumParams = sh->numParams;
+	char **savedParams = sh->params;
+	int savedLoopDepth = sh->loopDepth;
+	int keepArena = sh->keepArena;
+
+	if(argc < 2) {
+
+		fprintf(stderr, "Usage: %s file [args]\n", argv[0]);
+		return 2;
+	}
+	if(sh->sourceDepth >= MAX_SOURCE_DEPTH) {
+
+		fprintf(stderr, "%s: maximum source nesting exceeded\n", argv[0]);
+		return 1;
+	}
+
+	entry = load_sourced(sh, argv[1]);
+	if(entry == NULL) {
+		return 1;
+	}
+
+	if(argc > 2) {
+
+		sh->numParams = argc - 2;
+		sh->params = argv + 2;
+	}
+	sh->loopDepth = 0;
+	sh->sourceDepth++;
+	sh->status = 0;
+
+	exec_node(sh, entry->program);
+
+	/* The tree stays cached, so its arena is not handed to the caller */
+	sh->sourceDepth--;
+	sh->returning = 0;
+	sh->keepArena = keepArena;
+	sh->loopDepth = savedLoopDepth;
+	sh->numParams = savedNumParams;
+	sh->params = savedParams;
+	return sh->status;
+}
+
+
+/*
+ * break and continue take an optional
+ * count of loops to leave.
+ */
+static int loop_count (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	int count = argc > 1 ? atoi(argv[1]) : 1;
+
+	if(sh->loopDepth == 0) {
+
+		fprintf(stderr, "%s: only meaningful in a loop\n", argv[0]);
+		return 0;
+	}
+	if(count < 1) {
+		count = 1;
+	}
+	return count > sh->loopDepth ? sh->loopDepth : count;
+}
+
+
+static int builtin_break (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	sh->breakCount = loop_count(sh, argc, argv);
+	return 0;
+}
+
+
+static int builtin_continue (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	sh->continueCount = loop_count(sh, argc, argv);
+	return 0;
+}
+
+
+/*
+ * Lists the background jobs still running
+ * or stopped, after reporting any that have
+ * finished, then the time the launch
+ * throttle has held launches back.
+ * jobs -w shows them live, as jtop.
+ */
+static int builtin_jobs (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	int i;
+
+	if(argc > 1 && !strcmp(argv[1], "-w")) {
+		return builtin_jtop(sh, argc - 1, argv + 1);
+	}
+
+	smallsh_ctx_dispatch(sh->ctx, 0);
+
+	for(i = 0; i < sh->numBGProcesses; i++) {
+
+		printf("[%d] %ld %s %s\n", sh->backgroundJobs[i].id, (long)smallsh_job_pid(sh->backgroundJobs[i].job),
+				sh->backgroundJobs[i].stopped ? "Stopped" : "Running", sh->backgroundJobs[i].command);
+	}
+
+	if(sh->psi.setting != NULL) {
+
+		printf("Throttle %s: %d launch%s held back for %.3fs\n", sh->psi.setting, sh->psi.numThrottled,
+				sh->psi.numThrottled == 1 ? "" : "es", sh->psi.throttledMs / 1000.0);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+/*
+ * Finds the background job a job control
+ * builtin names: %n, a PID, or the newest
+ * job for none or %%. Returns its index, or
+ * -1 after reporting that there is none.
+ */
+static int job_operand (struct smallsh_shell *sh, const char *name, const char *operand) {
+
+	pid_t pid;
+	int i;
+
+	smallsh_ctx_dispatch(sh->ctx, 0);
+
+	if(operand == NULL || !strcmp(operand, "%%") || !strcmp(operand, "%+")) {
+
+		if(sh->numBGProcesses == 0) {
+
+			fprintf(stderr, "%s: no current job\n", name);
+			return -1;
+		}
+		return sh->numBGProcesses - 1;
+	}
+
+	for(i = 0; i < sh->numBGProcesses; i++) {
+
+		pid = smallsh_job_pid(sh->backgroundJobs[i].job);
+		if(operand[0] == '%' ? sh->backgroundJobs[i].id == atoi(operand + 1) : pid == (pid_t)atol(operand)) {
+			return i;
+		}
+	}
+	fprintf(stderr, "%s: %s: no such job\n", name, operand);
+	return -1;
+}
+
+
+/*
+ * fg [%n]
+ *
+ * Continues a background job in the
+ * foreground, giving it the terminal, and
+ * waits for it as if it had been started
+ * there. It can be stopped again.
+ */
+static int builtin_fg (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_background entry;
+	struct termios modes;
+	int childStatus;
+	int i = job_operand(sh, argv[0], argc > 1 ? argv[1] : NULL);
+
+	if(i == -1) {
+		return 1;
+	}
+
+	/* The job leaves the table while it is in the foreground */
+	entry = sh->backgroundJobs[i];
+	sh->numBGProcesses--;
+	memmove(&sh->backgroundJobs[i], &sh->backgroundJobs[i + 1], (sh->numBGProcesses - i) * sizeof(struct smallsh_background));
+	smallsh_job_set_callback(entry.job, NULL, NULL);
+
+	printf("%s\n", entry.command);
+	fflush(stdout);
+
+	if(!sh->jobControl) {
+		killpg(smallsh_job_pid(entry.job), SIGCONT);
+	}
+	childStatus = wait_foreground(sh, entry.job, &entry, &modes);
+
+	if(WIFSTOPPED(childStatus)) {
+		stop_foreground(sh, entry.job, entry.command, childStatus, &modes);
+	}
+	else {
+
+		record_child_status(sh, childStatus);
+		smallsh_job_release(entry.job);
+		if(sh->status == SIGNAL_KILLED) {
+
+			printf("Terminated by signal %d\n", sh->signalNum);
+			fflush(stdout);
+		}
+	}
+	free(entry.command);
+	return sh->status;
+}
+
+
+/*
+ * bg [%n]
+ *
+ * Continues a stopped job in the
+ * background.
+ */
+static int builtin_bg (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_background *entry;
+	int i = job_operand(sh, argv[0], argc > 1 ? argv[1] : NULL);
+
+	if(i == -1) {
+		return 1;
+	}
+
+	entry = &sh->backgroundJobs[i];
+	if(killpg(smallsh_job_pid(entry->job), SIGCONT) == -1) {
+
+		perror("bg");
+		return 1;
+	}
+	entry->stopped = 0;
+	printf("[%d] %s &\n", entry->id, entry->command);
+	fflush(stdout);
+	return 0;
+}
+
+
+/*
+ * Turns a signal name or number, with or
+ * without SIG, into its number. -1 if it
+ * is neither.
+ */
+static int signal_number (const char *name) {
+
+	const char *abbreviation;
+	char *end;
+	long number;
+	int i;
+
+	number = strtol(name, &end, 10);
+	if(*name != '\0' && *end == '\0') {
+		return number > 0 && number < NSIG ? (int)number : -1;
+	}
+
+	if(!strncasecmp(name, "SIG", 3)) {
+		name += 3;
+	}
+	for(i = 1; i < NSIG; i++) {
+
+		abbreviation = sigabbrev_np(i);
+		if(abbreviation != NULL && !strcasecmp(abbreviation, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * kill [-s signal | -signal] %n|pid...
+ * kill -l
+ *
+ * Sends a signal (SIGTERM by default). A
+ * job named by %n gets it across its whole
+ * process group in one killpg, and a stopped
+ * job is continued so it can act on it.
+ */
+static int builtin_kill (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_background *entry;
+	pid_t pid;
+	int signalNum = SIGTERM;
+	int status = 0;
+	int opt = 1;
+	int i;
+
+	if(argc == 2 && !strcmp(argv[1], "-l")) {
+
+		for(i = 1; i < NSIG; i++) {
+
+			if(sigabbrev_np(i) != NULL) {
+				printf("%d) SIG%s\n", i, sigabbrev_np(i));
+			}
+		}
+		fflush(stdout);
+		return 0;
+	}
+
+	if(opt + 1 < argc && !strcmp(argv[opt], "-s")) {
+
+		signalNum = signal_number(argv[opt + 1]);
+		opt += 2;
+	}
+	else if(opt < argc && argv[opt][0] == '-' && strcmp(argv[opt], "--")) {
+		signalNum = signal_number(argv[opt++] + 1);
+	}
+	if(opt < argc && !strcmp(argv[opt], "--")) {
+		opt++;
+	}
+
+	if(signalNum == -1 || opt == argc) {
+
+		fprintf(stderr, "Usage: kill [-s signal | -signal] %%n|pid...\n");
+		return 2;
+	}
+
+	for(; opt < argc; opt++) {
+
+		if(argv[opt][0] != '%') {
+
+			pid = (pid_t)atol(argv[opt]);
+			if(pid == 0 || kill(pid, signalNum) == -1) {
+
+				fprintf(stderr, "kill: %s: %s\n", argv[opt], pid == 0 ? "bad process id" : strerror(errno));
+				status = 1;
+			}
+			continue;
+		}
+
+		i = job_operand(sh, argv[0], argv[opt]);
+		if(i == -1) {
+
+			status = 1;
+			continue;
+		}
+
+		entry = &sh->backgroundJobs[i];
+		pid = smallsh_job_pid(entry->job);
+		if(killpg(pid, signalNum) == -1) {
+
+			fprintf(stderr, "kill: %s: %s\n", argv[opt], strerror(errno));
+			status = 1;
+		}
+		else if(entry->stopped && signalNum != SIGKILL && signalNum != SIGCONT && signalNum != SIGSTOP &&
+				signalNum != SIGTSTP && signalNum != SIGTTIN && signalNum != SIGTTOU) {
+
+			killpg(pid, SIGCONT);
+			entry->stopped = 0;
+		}
+		else if(signalNum == SIGCONT) {
+			entry->stopped = 0;
+		}
+		else if(signalNum == SIGSTOP || signalNum == SIGTSTP || signalNum == SIGTTIN || signalNum == SIGTTOU) {
+			entry->stopped = 1;
+		}
+	}
+	return status;
+}
+
+
+/*
+ * Blocks until a job of the shell's context
+ * finishes and reaps it, or until SIGINT
+ * arrives on signalFd. Returns -1 if
+ * interrupted.
+ */
+static int wait_event (struct smallsh_shell *sh, int signalFd) {
+
+	struct pollfd fds[2];
+	struct signalfd_siginfo caught;
+
+	fds[0].fd = smallsh_ctx_fd(sh->ctx);
+	fds[0].events = POLLIN;
+	fds[1].fd = signalFd;
+	fds[1].events = POLLIN;
+
+	while(poll(fds, signalFd == -1 ? 1 : 2, -1) == -1) {
+
+		if(errno != EINTR) {
+			return -1;
+		}
+	}
+
+	if(signalFd != -1 && (fds[1].revents & POLLIN)) {
+
+		read(signalFd, &caught, sizeof(caught));
+		return -1;
+	}
+
+	smallsh_ctx_dispatch(sh->ctx, 0);
+	return 0;
+}
+
+
+/*
+ * Finds a finished job by PID, or the
+ * oldest one for 0, and removes it.
+ * Returns its status, or -1 if there is
+ * none.
+ */
+static int take_finished (struct smallsh_shell *sh, pid_t pid) {
+
+	int status;
+	int i;
+
+	for(i = 0; i < sh->numFinished; i++) {
+
+		if(pid == 0 || sh->finishedJobs[i].pid == pid) {
+
+			status = sh->finishedJobs[i].status;
+			sh->numFinished--;
+			memmove(&sh->finishedJobs[i], &sh->finishedJobs[i + 1], (sh->numFinished - i) * sizeof(struct smallsh_finished));
+			return status;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Turns a wait operand, a PID or %n for
+ * job n, into a PID. Returns 0 if no job
+ * running or finished matches.
+ */
+static pid_t wait_operand (struct smallsh_shell *sh, const char *operand) {
+
+	int i;
+
+	if(operand[0] != '%') {
+		return (pid_t)atol(operand);
+	}
+
+	for(i = 0; i < sh->numBGProcesses; i++) {
+
+		if(sh->backgroundJobs[i].id == atoi(operand + 1)) {
+			return smallsh_job_pid(sh->backgroundJobs[i].job);
+		}
+	}
+	for(i = 0; i < sh->numFinished; i++) {
+
+		if(sh->finishedJobs[i].id == atoi(operand + 1)) {
+			return sh->finishedJobs[i].pid;
+		}
+	}
+	return 0;
+}
+
+
+static int is_running (struct smallsh_shell *sh, pid_t pid) {
+
+	int i;
+
+	for(i = 0; i < sh->numBGProcesses; i++) {
+
+		if(smallsh_job_pid(sh->backgroundJobs[i].job) == pid) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * wait [-n] [pid|%n...]
+ *
+ * With no operands, waits for every
+ * background job and returns 0. Otherwise
+ * waits for each job named and returns the
+ * status of the last. With -n, returns as
+ * soon as any job (or any job named)
+ * finishes, with its status; a job that
+ * finished earlier and was not waited for
+ * counts straight away. 127 if there is
+ * nothing to wait for.
+ *
+ * Waiting blocks on the context's job
+ * descriptor, so a job is collected the
+ * moment it exits. SIGINT ends the wait
+ * with 130.
+ */
+static int builtin_wait (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct held_sigint interrupt;
+	pid_t pid;
+	int anyOne = 0;
+	int status = 0;
+	int first = 1;
+	int i;
+
+	if(argc > 1 && !strcmp(argv[1], "-n")) {
+
+		anyOne = 1;
+		first = 2;
+	}
+
+	/* As in on-change, SIGINT comes through a signalfd while blocked here */
+	take_sigint(sh, &interrupt, 0);
+
+	smallsh_ctx_dispatch(sh->ctx, 0);
+
+	if(anyOne) {
+
+		status = -1;
+		while(status == -1) {
+
+			if(first == argc) {
+				status = take_finished(sh, 0);
+			}
+			for(i = first; i < argc && status == -1; i++) {
+
+				pid = wait_operand(sh, argv[i]);
+				status = pid > 0 ? take_finished(sh, pid) : -1;
+			}
+
+			if(status == -1 && sh->numBGProcesses == 0) {
+				status = 127;
+			}
+			else if(status == -1 && wait_event(sh, interrupt.fd) == -1) {
+				status = 130;
+			}
+		}
+	}
+	else if(first == argc) {
+
+		while(sh->numBGProcesses > 0 && status == 0) {
+
+			if(wait_event(sh, interrupt.fd) == -1) {
+				status = 130;
+			}
+		}
+		if(status == 0) {
+			sh->numFinished = 0;
+		}
+	}
+	else {
+
+		for(i = first; i < argc && status != 130; i++) {
+
+			pid = wait_operand(sh, argv[i]);
+			while(pid > 0 && is_running(sh, pid) && status != 130) {
+
+				if(wait_event(sh, interrupt.fd) == -1) {
+					status = 130;
+				}
+			}
+			if(status == 130) {
+				break;
+			}
+
+			status = pid > 0 ? take_finished(sh, pid) : -1;
+			if(status == -1) {
+
+				fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+				status = 127;
+			}
+		}
+	}
+
+	release_sigint(&interrupt);
+	return status;
+}
+
+
+/*
+ * fanout [-j workers] [-r] [-k] command [args]
+ *
+ * Splits standard input into line-aligned
+ * chunks and feeds them to long-lived copies
+ * of command over pipes. By default each chunk
+ * goes to whichever worker is ready for more;
+ * -r deals them out round-robin instead.
+ *
+ * Worker output is relayed through the shell
+ * a line at a time so lines from different
+ * workers never interleave mid-line.
+ *
+ * -k keeps the output in input order: each
+ * worker gets one contiguous share of the
+ * input, its output is captured, and the
+ * captures are written out in worker order.
+ *
+ * Regular input files are mmapped rather
+ * than read.
+ */
+
+struct fanout_worker {
+
+	struct smallsh_job *job;
+	int input;					//Write end of the worker's stdin pipe
+	int output;					//Read end of its stdout pipe, or -k capture file
+	int capture;
+	const char *pending;		//Data not yet written to the worker
+	size_t pendingLength;
+	char *chunk;				//Heap chunk backing pending, if any
+
+	/* Output read from the worker, up to an unfinished line */
+	char *relay;
+	size_t relayLength;
+	size_t relayCapacity;
+};
+
+struct fanout_input {
+
+	int fd;
+	char *data;					//Mapped or fully read input
+	size_t size;
+	size_t offset;
+	int mapped;
+
+	/* Unterminated line carried over between reads */
+	char *carry;
+	size_t carryLength;
+	int atEnd;
+};
+
+
+/*
+ * Length of the shortest prefix of data that
+ * is at least limit long and ends in a
+ * newline, or all of data if there is none.
+ */
+static size_t line_aligned (const char *data, size_t length, size_t limit) {
+
+	const char *newline;
+
+	if(length <= limit) {
+		return length;
+	}
+
+	newline = memchr(data + limit, '\n', length - limit);
+	return newline == NULL ? length : (size_t)(newline - data) + 1;
+}
+
+
+/*
+ * Maps a regular input file, or reads
+ * anything else to the end when all of it
+ * is needed at once.
+ */
+static int fanout_load (struct fanout_input *in, int readAll) {
+
+	struct stat info;
+	size_t capacity = 0;
+	ssize_t bytesRead;
+
+	if(fstat(in->fd, &info) == 0 && S_ISREG(info.st_mode)) {
+
+		in->size = info.st_size;
+		in->offset = lseek(in->fd, 0, SEEK_CUR);
+		if(in->offset == (size_t)-1 || in->offset > in->size) {
+			in->offset = 0;
+		}
+
+		if(in->size == 0) {
+
+			in->mapped = 1;
+			return 0;
+		}
+
+		in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if(in->data == MAP_FAILED) {
+
+			perror("fanout: mmap");
+			return -1;
+		}
+		madvise(in->data, in->size, MADV_SEQUENTIAL);
+		in->mapped = 1;
+		return 0;
+	}
+
+	if(!readAll) {
+		return 0;
+	}
+
+	for(;;) {
+
+		if(capacity - in->size < FANOUT_CHUNK_SIZE) {
+
+			capacity = capacity ? capacity * 2 : 4 * FANOUT_CHUNK_SIZE;
+			in->data = realloc(in->data, capacity);
+		}
+
+		bytesRead = read(in->fd, in->data + in->size, capacity - in->size);
+		if(bytesRead == -1 && errno == EINTR) {
+			continue;
+		}
+		if(bytesRead == -1) {
+
+			perror("fanout: read");
+			return -1;
+		}
+		if(bytesRead == 0) {
+			break;
+		}
+		in->size += bytesRead;
+	}
+	return 0;
+}
+
+
+/*
+ * Produces the next chunk. Mapped input is
+ * sliced in place; streamed input is read
+ * into a new heap chunk that the caller
+ * frees. Returns 0 at the end of input.
+ */
+static int fanout_next_chunk (struct fanout_input *in, const char **chunk, size_t *length, char **owned) {
+
+	char *buffer;
+	size_t capacity;
+	size_t filled;
+	size_t cut;
+	ssize_t bytesRead;
+
+	*owned = NULL;
+
+	if(in->mapped || in->data != NULL) {
+
+		if(in->offset >= in->size) {
+			return 0;
+		}
+		*chunk = in->data + in->offset;
+		*length = line_aligned(*chunk, in->size - in->offset, FANOUT_CHUNK_SIZE);
+		in->offset += *length;
+		return 1;
+	}
+
+	if(in->atEnd && in->carryLength == 0) {
+		return 0;
+	}
+
+	capacity = in->carryLength + FANOUT_CHUNK_SIZE;
+	buffer = malloc(capacity);
+	memcpy(buffer, in->carry, in->carryLength);
+	filled = in->carryLength;
+
+	while(!in->atEnd && filled < capacity) {
+
+		bytesRead = read(in->fd, buffer + filled, capacity - filled);
+		if(bytesRead == -1 && errno == EINTR) {
+			continue;
+		}
+		if(bytesRead <= 0) {
+
+			if(bytesRead == -1) {
+				perror("fanout: read");
+			}
+			in->atEnd = 1;
+			break;
+		}
+		filled += bytesRead;
+	}
+
+	/* Hand over everything up to the last newline */
+	cut = filled;
+	if(!in->atEnd) {
+
+		while(cut > 0 && buffer[cut - 1] != '\n') {
+			cut--;
+		}
+	}
+
+	/*
+	 * Keep the rest for next time. A line longer
+	 * than the whole buffer is carried over in
+	 * full and the next call reads further.
+	 */
+	free(in->carry);
+	in->carry = buffer;
+	in->carryLength = filled;
+
+	if(cut == 0) {
+		return in->atEnd ? 0 : fanout_next_chunk(in, chunk, length, owned);
+	}
+
+	in->carryLength = filled - cut;
+	in->carry = malloc(in->carryLength + 1);
+	memcpy(in->carry, buffer + cut, in->carryLength);
+
+	*chunk = buffer;
+	*length = cut;
+	*owned = buffer;
+	return 1;
+}
+
+
+/*
+ * Starts a worker reading from a new pipe.
+ * Its output goes to the capture file if
+ * it has one, or to another pipe back to
+ * the shell.
+ */
+static int fanout_start (struct smallsh_shell *sh, struct fanout_worker *worker, char *argv[]) {
+
+	struct smallsh_job_spec spec;
+	struct smallsh_fd_action actions[2];
+	int inputPipe[2];
+	int outputPipe[2] = { -1, -1 };
+
+	if(check_fork_limit(sh) == -1) {
+		return -1;
+	}
+	if(pipe2(inputPipe, O_CLOEXEC) == -1 || (!worker->capture && pipe2(outputPipe, O_CLOEXEC) == -1)) {
+
+		perror("fanout: pipe");
+		return -1;
+	}
+	if(!worker->capture) {
+		worker->output = outputPipe[0];
+	}
+
+	memset(&spec, 0, sizeof(spec));
+	memset(actions, 0, sizeof(actions));
+	actions[0].type = SMALLSH_FD_DUP;
+	actions[0].fd = 0;
+	actions[0].source = inputPipe[0];
+	actions[1].type = SMALLSH_FD_DUP;
+	actions[1].fd = 1;
+	actions[1].source = worker->capture ? worker->output : outputPipe[1];
+	spec.argv = argv;
+	spec.actions = actions;
+	spec.numActions = 2;
+	spec.flags = SMALLSH_SPAWN_DEFAULT_SIGINT;
+
+	worker->job = smallsh_spawn(sh->ctx, &spec);
+	if(worker->job == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+	}
+
+	close(inputPipe[0]);
+	if(outputPipe[1] != -1) {
+		close(outputPipe[1]);
+	}
+
+	if(worker->job == NULL) {
+
+		close(inputPipe[1]);
+		return -1;
+	}
+
+	worker->input = inputPipe[1];
+	fcntl(worker->input, F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+
+/* Returns -1 if the data could not all be written */
+static int write_all (int fd, const char *data, size_t length) {
+
+	ssize_t written;
+
+	while(length > 0) {
+
+		written = write(fd, data, length);
+		if(written == -1 && errno == EINTR) {
+			continue;
+		}
+		if(written <= 0) {
+			return -1;
+		}
+		data += written;
+		length -= written;
+	}
+	return 0;
+}
+
+
+/*
+ * Reads what the worker has written and
+ * passes on every complete line. At the
+ * end of its output the rest goes too.
+ */
+static void fanout_relay (struct fanout_worker *worker) {
+
+	ssize_t bytesRead;
+	char *newline;
+	size_t complete;
+
+	if(worker->relayCapacity - worker->relayLength < FANOUT_CHUNK_SIZE) {
+
+		worker->relayCapacity = worker->relayLength + FANOUT_CHUNK_SIZE;
+		worker->relay = realloc(worker->relay, worker->relayCapacity);
+	}
+
+	bytesRead = read(worker->output, worker->relay + worker->relayLength, worker->relayCapacity - worker->relayLength);
+	if(bytesRead == -1 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+
+	if(bytesRead <= 0) {
+
+		write_all(STDOUT_FILENO, worker->relay, worker->relayLength);
+		worker->relayLength = 0;
+		close(worker->output);
+		worker->output = -1;
+		return;
+	}
+
+	worker->relayLength += bytesRead;
+	newline = memrchr(worker->relay, '\n', worker->relayLength);
+	if(newline == NULL) {
+		return;
+	}
+
+	complete = newline - worker->relay + 1;
+	write_all(STDOUT_FILENO, worker->relay, complete);
+	memmove(worker->relay, worker->relay + complete, worker->relayLength - complete);
+	worker->relayLength -= complete;
+}
+
+
+static void fanout_drop_pending (struct fanout_worker *worker) {
+
+	free(worker->chunk);
+	worker->chunk = NULL;
+	worker->pending = NULL;
+	worker->pendingLength = 0;
+}
+
+
+/*
+ * Writes pending data to every worker that
+ * can take it and relays output from every
+ * worker that has some, blocking in poll
+ * until at least one is ready. Returns 0
+ * when there is nothing left to wait for,
+ * and -1 if a worker went away with data
+ * still owed to it.
+ */
+static int fanout_pump (struct fanout_worker *workers, int numWorkers) {
+
+	struct pollfd *fds = calloc(2 * numWorkers, sizeof(struct pollfd));
+	ssize_t written;
+	int result = 1;
+	int numFds = 0;
+	int i;
+
+	for(i = 0; i < numWorkers; i++) {
+
+		fds[2 * i].fd = workers[i].pendingLength ? workers[i].input : -1;
+		fds[2 * i].events = POLLOUT;
+		fds[2 * i + 1].fd = workers[i].capture ? -1 : workers[i].output;
+		fds[2 * i + 1].events = POLLIN;
+		numFds += (fds[2 * i].fd != -1) + (fds[2 * i + 1].fd != -1);
+	}
+
+	if(numFds == 0 || poll(fds, 2 * numWorkers, -1) == -1) {
+
+		free(fds);
+		return numFds == 0 ? 0 : 1;
+	}
+
+	for(i = 0; i < numWorkers; i++) {
+
+		if(fds[2 * i + 1].revents != 0) {
+			fanout_relay(&workers[i]);
+		}
+
+		if(fds[2 * i].revents == 0) {
+			continue;
+		}
+
+		written = write(workers[i].input, workers[i].pending, workers[i].pendingLength);
+
+		if(written > 0) {
+
+			workers[i].pending += written;
+			workers[i].pendingLength -= written;
+			if(workers[i].pendingLength == 0) {
+				fanout_drop_pending(&workers[i]);
+			}
+		}
+		else if(written == -1 && errno != EAGAIN && errno != EINTR) {
+
+			fprintf(stderr, "fanout: worker %ld: %s\n", (long)smallsh_job_pid(workers[i].job), strerror(errno));
+			fanout_drop_pending(&workers[i]);
+			close(workers[i].input);
+			workers[i].input = -1;
+			result = -1;
+		}
+	}
+
+	free(fds);
+	return result;
+}
+
+
+static int builtin_fanout (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct fanout_worker *workers;
+	struct fanout_input in;
+	struct sigaction ignore;
+	struct sigaction savedPipe;
+	long numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	int keepOrder = 0;
+	int roundRobin = 0;
+	int nextWorker = 0;
+	int moreInput = 1;
+	int status = 0;
+	int childStatus;
+	int busy;
+	int result;
+	struct stat info;
+	const char *chunk;
+	size_t length;
+	size_t share;
+	char *owned;
+	int i;
+	int opt = 1;
+
+	for(; opt < argc && argv[opt][0] == '-'; opt++) {
+
+		if(!strcmp(argv[opt], "--")) {
+
+			opt++;
+			break;
+		}
+		else if(!strcmp(argv[opt], "-k")) {
+			keepOrder = 1;
+		}
+		else if(!strcmp(argv[opt], "-r")) {
+			roundRobin = 1;
+		}
+		else if(!strcmp(argv[opt], "-j") && opt + 1 < argc) {
+			numWorkers = atol(argv[++opt]);
+		}
+		else {
+			break;
+		}
+	}
+
+	if(opt >= argc || numWorkers < 1 || numWorkers >= MAX_FORKS - smallsh_ctx_running(sh->ctx)) {
+
+		fprintf(stderr, "Usage: fanout [-j workers] [-r] [-k] command [args]\n");
+		return 2;
+	}
+
+	memset(&in, 0, sizeof(in));
+	in.fd = STDIN_FILENO;
+	if(fanout_load(&in, keepOrder) == -1) {
+		return 1;
+	}
+
+	workers = calloc(numWorkers, sizeof(struct fanout_worker));
+
+	/*
+	 * A worker that exits early must not take
+	 * the shell down with SIGPIPE.
+	 */
+	sigemptyset(&ignore.sa_mask);
+	ignore.sa_flags = 0;
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, &savedPipe);
+
+	for(i = 0; i < numWorkers; i++) {
+
+		workers[i].capture = keepOrder;
+		workers[i].output = keepOrder ? memfd_create("fanout", MFD_CLOEXEC) : -1;
+		workers[i].input = -1;
+
+		if(fanout_start(sh, &workers[i], argv + opt) == -1) {
+
+			numWorkers = i;
+			status = 1;
+			moreInput = 0;
+			break;
+		}
+	}
+
+	/*
+	 * With -k each worker gets one contiguous,
+	 * line-aligned share up front.
+	 */
+	if(keepOrder && moreInput) {
+
+		for(i = 0; i < numWorkers; i++) {
+
+			share = (in.size - in.offset) / (numWorkers - i);
+			workers[i].pending = in.data + in.offset;
+			workers[i].pendingLength = line_aligned(workers[i].pending, in.size - in.offset, share);
+			in.offset += workers[i].pendingLength;
+		}
+		moreInput = 0;
+	}
+
+	for(;;) {
+
+		/* Give chunks to idle workers */
+		for(i = 0; moreInput && i < numWorkers; i++) {
+
+			if(roundRobin) {
+				i = nextWorker;
+			}
+
+			if(workers[i].pendingLength == 0 && workers[i].input != -1) {
+
+				moreInput = fanout_next_chunk(&in, &chunk, &length, &owned);
+				if(moreInput) {
+
+					workers[i].pending = chunk;
+					workers[i].pendingLength = length;
+					workers[i].chunk = owned;
+					nextWorker = (nextWorker + 1) % numWorkers;
+				}
+			}
+
+			if(roundRobin) {
+				break;
+			}
+		}
+
+		busy = 0;
+		for(i = 0; i < numWorkers; i++) {
+			busy |= workers[i].pendingLength != 0;
+		}
+
+		/* Closing the pipes is the workers' end of input */
+		if(!busy && !moreInput) {
+
+			for(i = 0; i < numWorkers; i++) {
+
+				if(workers[i].input != -1) {
+
+					close(workers[i].input);
+					workers[i].input = -1;
+				}
+			}
+		}
+
+		result = fanout_pump(workers, numWorkers);
+		if(result == 0) {
+			break;
+		}
+		if(result == -1) {
+			status = 1;
+		}
+
+		/* Round-robin has no one left to deal to if its next worker died */
+		if(roundRobin && workers[nextWorker].input == -1) {
+			nextWorker = (nextWorker + 1) % numWorkers;
+		}
+	}
+
+	for(i = 0; i < numWorkers; i++) {
+
+		childStatus = smallsh_job_wait(workers[i].job);
+		smallsh_job_release(workers[i].job);
+
+		if(!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) {
+			status = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 128 + WTERMSIG(childStatus);
+		}
+	}
+
+	/* Merge captured output in input order */
+	fflush(stdout);
+	for(i = 0; i < numWorkers; i++) {
+
+		free(workers[i].relay);
+		if(!workers[i].capture) {
+			continue;
+		}
+
+		if(fstat(workers[i].output, &info) == 0 && copy_range(workers[i].output, 0, info.st_size, STDOUT_FILENO) == -1) {
+
+			perror("fanout: write");
+			status = 1;
+		}
+		close(workers[i].output);
+	}
+
+	sigaction(SIGPIPE, &savedPipe, NULL);
+
+	if(in.mapped && in.data != NULL) {
+		munmap(in.data, in.size);
+	}
+	else {
+		free(in.data);
+	}
+	free(in.carry);
+	free(workers);
+	return status;
+}
+
+
+/*
+ * on-change [-d ms] [-p restart|queue|ignore] path... -- command [args]
+ *
+ * Runs command, then runs it again whenever
+ * something under the paths changes. Paths
+ * are watched with inotify, directories
+ * recursively; dot files and directories
+ * are skipped. Events are coalesced, so a
+ * run starts only once no change has come
+ * in for the debounce time.
+ *
+ * The policy decides what a change during a
+ * run does: restart cancels the run and
+ * starts over, queue lets it finish and then
+ * runs once more, ignore drops the change.
+ *
+ * It runs until interrupted or, sent to the
+ * background, until the shell exits; either
+ * way the current run is stopped first.
+ */
+
+enum {
+
+	ON_CHANGE_RESTART,
+	ON_CHANGE_QUEUE,
+	ON_CHANGE_IGNORE
+};
+
+const int ON_CHANGE_EVENTS = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB;
+const int ON_CHANGE_DEBOUNCE_MS = 100;
+
+/* Time a cancelled run gets to exit before it is killed */
+const int ON_CHANGE_STOP_MS = 2000;
+
+/* How long coprocesses get to finish after their input closes on exit */
+const int COPROC_STOP_MS = 1000;
+
+struct on_change_watch {
+
+	int wd;
+	char *path;					//Directory being watched
+	char *name;					//The one entry watched in it, or NULL for all
+};
+
+struct on_change {
+
+	int fd;
+	struct on_change_watch *watches;
+	int numWatches;
+};
+
+
+static long long now_ms (void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+static int add_watch (struct on_change *w, const char *path, const char *name) {
+
+	int wd = inotify_add_watch(w->fd, path, ON_CHANGE_EVENTS);
+
+	if(wd == -1) {
+		return -1;
+	}
+
+	w->watches = realloc(w->watches, (w->numWatches + 1) * sizeof(struct on_change_watch));
+	w->watches[w->numWatches].wd = wd;
+	w->watches[w->numWatches].path = strdup(path);
+	w->watches[w->numWatches].name = name != NULL ? strdup(name) : NULL;
+	w->numWatches++;
+	return 0;
+}
+
+
+/*
+ * Watches a directory and everything below
+ * it. A file is watched through its directory
+ * so editors that replace it by renaming are
+ * still seen.
+ */
+static int watch_tree (struct on_change *w, const char *path) {
+
+	struct dirent *entry;
+	struct stat info;
+	char *directory;
+	char *child;
+	char *slash;
+	DIR *listing;
+	int result;
+
+	if(stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+
+		if(add_watch(w, path, NULL) == -1) {
+			return -1;
+		}
+
+		listing = opendir(path);
+		if(listing == NULL) {
+			return 0;
+		}
+
+		while((entry = readdir(listing)) != NULL) {
+
+			if(entry->d_name[0] == '.' || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+				continue;
+			}
+
+			child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+			sprintf(child, "%s/%s", path, entry->d_name);
+			if(stat(child, &info) == 0 && S_ISDIR(info.st_mode)) {
+				watch_tree(w, child);
+			}
+			free(child);
+		}
+		closedir(listing);
+		return 0;
+	}
+
+	slash = strrchr(path, '/');
+	if(slash == NULL) {
+		return add_watch(w, ".", path);
+	}
+
+	directory = slash == path ? strdup("/") : strndup(path, slash - path);
+	result = add_watch(w, directory, slash + 1);
+	free(directory);
+	return result;
+}
+
+
+/*
+ * Reads the queued events. Returns 1 if any
+ * of them is a change worth a run. New
+ * directories are watched as they appear.
+ */
+static int read_changes (struct on_change *w) {
+
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	char *position;
+	char *child;
+	ssize_t length;
+	int changed = 0;
+	int numWatches;
+	int i;
+
+	while((length = read(w->fd, buffer, sizeof(buffer))) > 0) {
+
+		for(position = buffer; position < buffer + length; position += sizeof(struct inotify_event) + event->len) {
+
+			event = (struct inotify_event *)position;
+
+			if(event->mask & IN_Q_OVERFLOW) {
+
+				changed = 1;
+				continue;
+			}
+			if(event->len == 0) {
+				continue;
+			}
+
+			/* watch_tree may add to the array while this looks through it */
+			numWatches = w->numWatches;
+			for(i = 0; i < numWatches; i++) {
+
+				if(w->watches[i].wd != event->wd) {
+					continue;
+				}
+
+				if(w->watches[i].name != NULL) {
+
+					changed |= !strcmp(w->watches[i].name, event->name);
+				}
+				else if(event->name[0] != '.') {
+
+					changed = 1;
+					if((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+
+						child = malloc(strlen(w->watches[i].path) + event->len + 2);
+						sprintf(child, "%s/%s", w->watches[i].path, event->name);
+						watch_tree(w, child);
+						free(child);
+					}
+				}
+			}
+		}
+	}
+	return changed;
+}
+
+
+/*
+ * Cancels a run: SIGTERM to its process
+ * group, then SIGKILL if it has not exited
+ * in time.
+ */
+static void stop_command (struct smallsh_shell *sh, struct smallsh_job *job) {
+
+	long long deadline = now_ms() + ON_CHANGE_STOP_MS;
+
+	kill(-smallsh_job_pid(job), SIGTERM);
+
+	while(!smallsh_job_status(job, NULL, NULL) && now_ms() < deadline) {
+		smallsh_ctx_dispatch(sh->ctx, 10);
+	}
+
+	if(!smallsh_job_status(job, NULL, NULL)) {
+		kill(-smallsh_job_pid(job), SIGKILL);
+	}
+	smallsh_job_wait(job);
+	smallsh_job_release(job);
+}
+
+
+static int builtin_on_change (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct on_change w;
+	struct smallsh_job *job;
+	struct pollfd fds[3];
+	struct signalfd_siginfo caught;
+	struct held_sigint interrupt;
+	long long deadline = 0;
+	int debounce = ON_CHANGE_DEBOUNCE_MS;
+	int policy = ON_CHANGE_RESTART;
+	int pending = 0;
+	int queued = 0;
+	int runFlags;
+	int childStatus;
+	int timeout;
+	int status = 0;
+	int firstPath;
+	int command;
+	int i;
+	int opt = 1;
+
+	for(; opt < argc && argv[opt][0] == '-' && strcmp(argv[opt], "--"); opt++) {
+
+		if(!strcmp(argv[opt], "-d") && opt + 1 < argc) {
+			debounce = atoi(argv[++opt]);
+		}
+		else if(!strcmp(argv[opt], "-p") && opt + 1 < argc) {
+
+			opt++;
+			policy = !strcmp(argv[opt], "restart") ? ON_CHANGE_RESTART
+					: !strcmp(argv[opt], "queue") ? ON_CHANGE_QUEUE
+					: !strcmp(argv[opt], "ignore") ? ON_CHANGE_IGNORE : -1;
+		}
+		else {
+			break;
+		}
+	}
+
+	firstPath = opt;
+	for(command = opt; command < argc && strcmp(argv[command], "--"); command++) {
+		;
+	}
+	command++;
+
+	if(firstPath == command - 1 || command >= argc || debounce < 0 || policy == -1) {
+
+		fprintf(stderr, "Usage: on-change [-d ms] [-p restart|queue|ignore] path... -- command [args]\n");
+		return 2;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(w.fd == -1) {
+
+		perror("on-change");
+		return 1;
+	}
+
+	for(i = firstPath; i < command - 1; i++) {
+
+		if(watch_tree(&w, argv[i]) == -1) {
+
+			fprintf(stderr, "on-change: %s: %s\n", argv[i], strerror(errno));
+			status = 1;
+			break;
+		}
+	}
+
+	/* SIGTERM and SIGHUP stop the watch too */
+	take_sigint(sh, &interrupt, 1);
+
+	/*
+	 * Each run leads a process group of its
+	 * own, so stopping it also stops whatever
+	 * it started.
+	 */
+	runFlags = SMALLSH_SPAWN_NEW_GROUP | (interrupt.taken ? SMALLSH_SPAWN_DEFAULT_SIGINT : 0);
+
+	job = status == 0 ? start_command(sh, argv + command, NULL, 0, runFlags, 0) : NULL;
+
+	while(status == 0) {
+
+		timeout = -1;
+		if(pending) {
+
+			timeout = deadline - now_ms();
+			if(timeout < 0) {
+				timeout = 0;
+			}
+		}
+
+		/* Without a pidfd, check on the run every 10 ms */
+		if(job != NULL && smallsh_job_fd(job) == -1 && (timeout == -1 || timeout > 10)) {
+			timeout = 10;
+		}
+
+		fds[0].fd = w.fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = interrupt.fd;
+		fds[1].events = POLLIN;
+		fds[2].fd = job != NULL ? smallsh_job_fd(job) : -1;
+		fds[2].events = POLLIN;
+
+		if(poll(fds, 3, timeout) == -1 && errno != EINTR) {
+
+			perror("on-change");
+			status = 1;
+			break;
+		}
+
+		if(read(interrupt.fd, &caught, sizeof(caught)) == sizeof(caught)) {
+
+			status = 128 + caught.ssi_signo;
+			break;
+		}
+
+		if((fds[0].revents & POLLIN) && read_changes(&w)) {
+
+			pending = 1;
+			deadline = now_ms() + debounce;
+		}
+
+		if(job != NULL) {
+
+			smallsh_ctx_dispatch(sh->ctx, 0);
+			if(smallsh_job_status(job, &childStatus, NULL)) {
+
+				record_child_status(sh, childStatus);
+				smallsh_job_release(job);
+				job = NULL;
+
+				if(queued) {
+
+					queued = 0;
+					job = start_command(sh, argv + command, NULL, 0, runFlags, 0);
+				}
+			}
+		}
+
+		if(pending && now_ms() >= deadline) {
+
+			pending = 0;
+
+			if(job == NULL) {
+				job = start_command(sh, argv + command, NULL, 0, runFlags, 0);
+			}
+			else if(policy == ON_CHANGE_RESTART) {
+
+				stop_command(sh, job);
+				job = start_command(sh, argv + command, NULL, 0, runFlags, 0);
+			}
+			else if(policy == ON_CHANGE_QUEUE) {
+				queued = 1;
+			}
+		}
+	}
+
+	if(job != NULL) {
+		stop_command(sh, job);
+	}
+
+	release_sigint(&interrupt);
+
+	close(w.fd);
+	for(i = 0; i < w.numWatches; i++) {
+
+		free(w.watches[i].path);
+		free(w.watches[i].name);
+	}
+	free(w.watches);
+	return status;
+}
+
+
+/*
+ * dag [-j jobs] [-k] [file]
+ *
+ * Runs a graph of commands read from file,
+ * or standard input, one node per line:
+ *
+ *   name [after=a,b] [in=file,...] [out=file,...] -- command
+ *
+ * The command is shell source and runs in a
+ * forked copy of the shell once every node
+ * named by after has succeeded, up to jobs
+ * at a time (default one per online CPU).
+ * A node whose outputs all exist and are
+ * newer than all its inputs is up to date
+ * and skipped. The first failure stops the
+ * run, cancelling nodes still running; with
+ * -k the nodes that do not depend on it go
+ * on. The status is 0 if every node is ok or
+ * up to date, 1 if one failed, 2 for a bad
+ * spec and 130 if interrupted. At the end a report of each node and
+ * the critical path goes to standard error.
+ */
+
+enum dag_state {
+
+	DAG_WAITING,
+	DAG_RUNNING,
+	DAG_DONE,
+	DAG_UP_TO_DATE,
+	DAG_FAILED,
+	DAG_CANCELLED,
+	DAG_NOT_RUN
+};
+
+static const char *const DAG_STATE_NAMES[] = {"waiting", "running", "ok", "up to date", "failed", "cancelled", "not run"};
+
+struct dag_node {
+
+	char *name;
+	char **after;
+	int numAfter;
+	char **inputs;
+	int numInputs;
+	char **outputs;
+	int numOutputs;
+	struct smallsh_node *program;
+	int line;
+
+	int *deps;						//Indexes of the after nodes
+	int state;
+	int status;
+	struct smallsh_job *job;
+	long long started;
+	long long finished;
+	int critical;					//Dependency that finished last, or -1
+};
+
+/* Node times are kept in microseconds, since builtins finish within a millisecond */
+static long long dag_clock (void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+
+struct dag {
+
+	struct smallsh_arena arena;
+	struct dag_node *nodes;
+	int numNodes;
+	int capacity;
+};
+
+
+/*
+ * Splits a comma-separated list into arena
+ * strings. Returns the number of items.
+ */
+static int dag_list (struct dag *d, const char *list, char ***items) {
+
+	const char *comma;
+	int count = 1;
+	int i;
+
+	for(comma = list; (comma = strchr(comma, ',')) != NULL; comma++) {
+		count++;
+	}
+
+	*items = smallsh_arena_alloc(&d->arena, count * sizeof(char *));
+	for(i = 0; i < count; i++) {
+
+		comma = strchr(list, ',');
+		if(comma == NULL) {
+			comma = list + strlen(list);
+		}
+		(*items)[i] = smallsh_arena_strndup(&d->arena, list, comma - list);
+		list = comma + 1;
+	}
+	return count;
+}
+
+
+static int dag_find (struct dag *d, const char *name) {
+
+	int i;
+
+	for(i = 0; i < d->numNodes; i++) {
+
+		if(!strcmp(d->nodes[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Parses one line of the spec into a new
+ * node. Returns -1 after reporting an error.
+ */
+static int dag_parse_line (struct dag *d, char *line, int lineNumber, const char *specName) {
+
+	struct smallsh_parse_error error;
+	struct dag_node *node;
+	char *command = strstr(line, " -- ");
+	char *word;
+	char *save;
+
+	if(command == NULL) {
+
+		fprintf(stderr, "dag: %s: line %d: expected name ... -- command\n", specName, lineNumber);
+		return -1;
+	}
+	*command = '\0';
+	command += 4;
+
+	if(d->numNodes == d->capacity) {
+
+		d->capacity = d->capacity ? d->capacity * 2 : 16;
+		d->nodes = realloc(d->nodes, d->capacity * sizeof(struct dag_node));
+	}
+	node = &d->nodes[d->numNodes];
+	memset(node, 0, sizeof(*node));
+	node->line = lineNumber;
+	node->critical = -1;
+
+	for(word = strtok_r(line, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+
+		if(node->name == NULL) {
+			node->name = smallsh_arena_strndup(&d->arena, word, strlen(word));
+		}
+		else if(!strncmp(word, "after=", 6)) {
+			node->numAfter = dag_list(d, word + 6, &node->after);
+		}
+		else if(!strncmp(word, "in=", 3)) {
+			node->numInputs = dag_list(d, word + 3, &node->inputs);
+		}
+		else if(!strncmp(word, "out=", 4)) {
+			node->numOutputs = dag_list(d, word + 4, &node->outputs);
+		}
+		else {
+
+			fprintf(stderr, "dag: %s: line %d: unknown attribute %s\n", specName, lineNumber, word);
+			return -1;
+		}
+	}
+
+	if(node->name == NULL || dag_find(d, node->name) != -1) {
+
+		fprintf(stderr, "dag: %s: line %d: %s\n", specName, lineNumber, node->name == NULL ? "missing node name" : "duplicate node name");
+		return -1;
+	}
+
+	node->program = smallsh_parse(&d->arena, command, &error);
+	if(node->program == NULL) {
+
+		fprintf(stderr, "dag: %s: line %d: %s\n", specName, lineNumber, error.message);
+		return -1;
+	}
+
+	d->numNodes++;
+	return 0;
+}
+
+
+/*
+ * Resolves after names to indexes and
+ * checks that the graph has no cycle.
+ * Returns -1 after reporting an error.
+ */
+static int dag_link (struct dag *d) {
+
+	int *remaining = calloc(d->numNodes + 1, sizeof(int));
+	int *order = calloc(d->numNodes + 1, sizeof(int));
+	int numOrdered = 0;
+	int i;
+	int j;
+	int k;
+
+	for(i = 0; i < d->numNodes; i++) {
+
+		d->nodes[i].deps = smallsh_arena_alloc(&d->arena, (d->nodes[i].numAfter + 1) * sizeof(int));
+		for(j = 0; j < d->nodes[i].numAfter; j++) {
+
+			d->nodes[i].deps[j] = dag_find(d, d->nodes[i].after[j]);
+			if(d->nodes[i].deps[j] == -1) {
+
+				fprintf(stderr, "dag: line %d: %s: no node named %s\n", d->nodes[i].line, d->nodes[i].name, d->nodes[i].after[j]);
+				free(remaining);
+				free(order);
+				return -1;
+			}
+		}
+		remaining[i] = d->nodes[i].numAfter;
+		if(remaining[i] == 0) {
+			order[numOrdered++] = i;
+		}
+	}
+
+	/* Kahn's algorithm: anything never freed of its dependencies is on a cycle */
+	for(k = 0; k < numOrdered; k++) {
+
+		for(i = 0; i < d->numNodes; i++) {
+
+			for(j = 0; j < d->nodes[i].numAfter; j++) {
+
+				if(d->nodes[i].deps[j] == order[k] && --remaining[i] == 0) {
+					order[numOrdered++] = i;
+				}
+			}
+		}
+	}
+
+	free(remaining);
+	free(order);
+
+	if(numOrdered < d->numNodes) {
+
+		fprintf(stderr, "dag: the dependencies form a cycle\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * True if every output exists and is newer
+ * than every input.
+ */
+static int dag_up_to_date (const struct dag_node *node) {
+
+	struct stat info;
+	struct timespec oldestOutput;
+	int i;
+
+	if(node->numOutputs == 0 || stat(node->outputs[0], &info) == -1) {
+		return 0;
+	}
+	oldestOutput = info.st_mtim;
+
+	for(i = 1; i < node->numOutputs; i++) {
+
+		if(stat(node->outputs[i], &info) == -1) {
+			return 0;
+		}
+		if(info.st_mtim.tv_sec < oldestOutput.tv_sec
+				|| (info.st_mtim.tv_sec == oldestOutput.tv_sec && info.st_mtim.tv_nsec < oldestOutput.tv_nsec)) {
+			oldestOutput = info.st_mtim;
+		}
+	}
+
+	for(i = 0; i < node->numInputs; i++) {
+
+		if(stat(node->inputs[i], &info) == -1) {
+			return 0;
+		}
+		if(info.st_mtim.tv_sec > oldestOutput.tv_sec
+				|| (info.st_mtim.tv_sec == oldestOutput.tv_sec && info.st_mtim.tv_nsec >= oldestOutput.tv_nsec)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Starts node in a forked shell leading a
+ * process group of its own, so a cancelled
+ * node takes whatever it started with it.
+ */
+static int dag_start (struct smallsh_shell *sh, struct dag_node *node, int takeInt) {
+
+	struct sigaction handling;
+	sigset_t signals;
+	pid_t pid = shell_fork(sh, 0, &node->job);
+
+	if(pid == -1) {
+		return -1;
+	}
+
+	if(pid == 0) {
+
+		setpgid(0, 0);
+		sh->jobControl = 0;
+		sigemptyset(&signals);
+		sigprocmask(SIG_SETMASK, &signals, NULL);
+		if(takeInt) {
+
+			sigemptyset(&(handling.sa_mask));
+			handling.sa_flags = 0;
+			handling.sa_handler = SIG_DFL;
+			sigaction(SIGINT, &handling, NULL);
+		}
+		sh->isSubshell = 1;
+		exec_node(sh, node->program);
+		fflush(stdout);
+		exit(exit_code(sh));
+	}
+
+	setpgid(pid, pid);
+	node->state = DAG_RUNNING;
+	node->started = dag_clock();
+	return 0;
+}
+
+
+/*
+ * Marks node finished and notes which of
+ * its dependencies held it up longest.
+ */
+static void dag_finish (struct dag *d, struct dag_node *node, int state) {
+
+	int j;
+
+	node->state = state;
+	node->finished = dag_clock();
+	if(state == DAG_UP_TO_DATE) {
+		node->started = node->finished;
+	}
+
+	for(j = 0; j < node->numAfter; j++) {
+
+		if(node->critical == -1 || d->nodes[node->deps[j]].finished > d->nodes[node->critical].finished) {
+			node->critical = node->deps[j];
+		}
+	}
+}
+
+
+static void dag_report (struct dag *d, long long started) {
+
+	struct dag_node *node;
+	int counts[DAG_NOT_RUN + 1] = { 0 };
+	int *path;
+	int length = 0;
+	int last = -1;
+	int i;
+
+	for(i = 0; i < d->numNodes; i++) {
+
+		node = &d->nodes[i];
+		counts[node->state]++;
+		if(node->state == DAG_DONE || node->state == DAG_UP_TO_DATE) {
+
+			if(last == -1 || node->finished > d->nodes[last].finished) {
+				last = i;
+			}
+		}
+	}
+
+	fprintf(stderr, "dag: %d nodes in %.1f ms: %d ok, %d up to date, %d failed, %d cancelled, %d not run\n", d->numNodes,
+			(dag_clock() - started) / 1000.0, counts[DAG_DONE], counts[DAG_UP_TO_DATE], counts[DAG_FAILED], counts[DAG_CANCELLED], counts[DAG_NOT_RUN]);
+
+	for(i = 0; i < d->numNodes; i++) {
+
+		node = &d->nodes[i];
+		fprintf(stderr, "  %-20s ", node->name);
+		if(node->state == DAG_DONE || node->state == DAG_FAILED || node->state == DAG_CANCELLED) {
+			fprintf(stderr, "%-10s %10.1f ms", DAG_STATE_NAMES[node->state], (node->finished - node->started) / 1000.0);
+		}
+		else {
+			fprintf(stderr, "%s", DAG_STATE_NAMES[node->state]);
+		}
+		if(node->state == DAG_FAILED) {
+			fprintf(stderr, "  status %d", node->status);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	/* Walk back from the last node to finish through whatever held each one up */
+	if(last != -1) {
+
+		path = calloc(d->numNodes, sizeof(int));
+		for(i = last; i != -1; i = d->nodes[i].critical) {
+			path[length++] = i;
+		}
+
+		fprintf(stderr, "critical path:");
+		for(i = length - 1; i >= 0; i--) {
+
+			node = &d->nodes[path[i]];
+			fprintf(stderr, " %s (%.1f ms)%s", node->name, (node->finished - node->started) / 1000.0, i > 0 ? " ->" : "");
+		}
+		fprintf(stderr, ", finished at %.1f ms\n", (d->nodes[last].finished - started) / 1000.0);
+		free(path);
+	}
+	fflush(stderr);
+}
+
+
+static int builtin_dag (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct dag d;
+	struct dag_node *node;
+	struct held_sigint interrupt;
+	FILE *spec = stdin;
+	const char *specName = "stdin";
+	char *line = NULL;
+	size_t lineSize = 0;
+	ssize_t lineLength;
+	long long started;
+	long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int keepGoing = 0;
+	int numRunning = 0;
+	int stopping = 0;
+	int progress;
+	int ready;
+	int lineNumber = 0;
+	int childStatus;
+	int status = 0;
+	int i;
+	int j;
+	int opt = 1;
+
+	for(; opt < argc && argv[opt][0] == '-' && argv[opt][1] != '\0'; opt++) {
+
+		if(!strcmp(argv[opt], "-j") && opt + 1 < argc) {
+			maxJobs = atol(argv[++opt]);
+		}
+		else if(!strcmp(argv[opt], "-k")) {
+			keepGoing = 1;
+		}
+		else {
+			break;
+		}
+	}
+
+	if(opt + 1 < argc || (opt < argc && argv[opt][0] == '-' && argv[opt][1] != '\0') || maxJobs < 1) {
+
+		fprintf(stderr, "Usage: dag [-j jobs] [-k] [file]\n");
+		return 2;
+	}
+
+	if(opt < argc && strcmp(argv[opt], "-")) {
+
+		specName = argv[opt];
+		spec = fopen(specName, "re");
+		if(spec == NULL) {
+
+			fprintf(stderr, "dag: %s: %s\n", specName, strerror(errno));
+			return 1;
+		}
+	}
+
+	memset(&d, 0, sizeof(d));
+	smallsh_arena_init(&d.arena);
+
+	while(status == 0 && (lineLength = getline(&line, &lineSize, spec)) != -1) {
+
+		lineNumber++;
+		if(lineLength > 0 && line[lineLength - 1] == '\n') {
+			line[--lineLength] = '\0';
+		}
+		for(i = 0; line[i] == ' ' || line[i] == '\t'; i++) {
+			;
+		}
+		if(line[i] != '\0' && line[i] != '#' && dag_parse_line(&d, line + i, lineNumber, specName) == -1) {
+			status = 2;
+		}
+	}
+	free(line);
+	if(spec != stdin) {
+		fclose(spec);
+	}
+
+	if(status == 0 && dag_link(&d) == -1) {
+		status = 2;
+	}
+
+	/* SIGINT comes through a signalfd while blocked here, as in wait */
+	take_sigint(sh, &interrupt, 0);
+
+	started = dag_clock();
+	progress = status == 0;
+
+	while(progress) {
+
+		/*
+		 * Settle every waiting node that can be
+		 * decided now, and start what is ready
+		 * while there is room.
+		 */
+		for(i = 0; i < d.numNodes; i++) {
+
+			node = &d.nodes[i];
+			if(node->state != DAG_WAITING) {
+				continue;
+			}
+
+			ready = !stopping;
+			for(j = 0; j < node->numAfter; j++) {
+
+				switch(d.nodes[node->deps[j]].state) {
+
+					case DAG_DONE:
+					case DAG_UP_TO_DATE:
+						break;
+
+					case DAG_FAILED:
+					case DAG_CANCELLED:
+					case DAG_NOT_RUN:
+						node->state = DAG_NOT_RUN;
+						ready = 0;
+						break;
+
+					default:
+						ready = 0;
+						break;
+				}
+			}
+
+			if(stopping) {
+				node->state = DAG_NOT_RUN;
+			}
+			if(!ready || node->state != DAG_WAITING) {
+				continue;
+			}
+
+			if(dag_up_to_date(node)) {
+
+				dag_finish(&d, node, DAG_UP_TO_DATE);
+				i = -1;						//Its dependents may be ready now
+			}
+			else if(numRunning < maxJobs) {
+
+				if(dag_start(sh, node, interrupt.taken) == -1) {
+
+					node->status = 126;
+					dag_finish(&d, node, DAG_FAILED);
+					status = 1;
+					stopping = !keepGoing;
+				}
+				else {
+					numRunning++;
+				}
+			}
+		}
+
+		if(numRunning == 0) {
+			break;
+		}
+
+		if(wait_event(sh, interrupt.fd) == -1) {
+
+			status = 130;
+			stopping = 1;
+		}
+
+		for(i = 0; i < d.numNodes; i++) {
+
+			node = &d.nodes[i];
+			if(node->state != DAG_RUNNING) {
+				continue;
+			}
+
+			if(status == 130) {
+
+				stop_command(sh, node->job);
+				node->status = 130;
+				dag_finish(&d, node, DAG_CANCELLED);
+				numRunning--;
+			}
+			else if(smallsh_job_status(node->job, &childStatus, NULL)) {
+
+				smallsh_job_release(node->job);
+				node->status = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 128 + WTERMSIG(childStatus);
+				dag_finish(&d, node, node->status == 0 ? DAG_DONE : DAG_FAILED);
+				numRunning--;
+
+				if(node->status != 0 && !keepGoing && !stopping) {
+
+					/* Fail fast: cancel the rest and start nothing new */
+					stopping = 1;
+					for(j = 0; j < d.numNodes; j++) {
+
+						if(d.nodes[j].state == DAG_RUNNING) {
+
+							stop_command(sh, d.nodes[j].job);
+							dag_finish(&d, &d.nodes[j], DAG_CANCELLED);
+							numRunning--;
+						}
+					}
+				}
+				if(node->status != 0 && status == 0) {
+					status = 1;
+				}
+			}
+		}
+	}
+
+	release_sigint(&interrupt);
+
+	if(d.numNodes > 0 && progress) {
+		dag_report(&d, started);
+	}
+
+	free(d.nodes);
+	smallsh_arena_free(&d.arena);
+	return status;
+}
+
+
+/*
+ * Writes length bytes of in, from offset,
+ * to out. copy_file_range lets the kernel
+ * copy, or share extents on filesystems
+ * that reflink, when out is a regular file
+ * not opened for appending; otherwise
+ * sendfile, then read and write. Returns
+ * the number of bytes copied, short if in
+ * ends first, or -1 on error.
+ */
+static off_t copy_range (int in, off_t offset, off_t length, int out) {
+
+	struct stat info;
+	char buffer[65536];
+	ssize_t copied;
+	off_t total = 0;
+	int useCopyRange = fstat(out, &info) == 0 && S_ISREG(info.st_mode) && !(fcntl(out, F_GETFL) & O_APPEND);
+	int useSendfile = 1;
+
+	while(length > 0) {
+
+		if(useCopyRange) {
+
+			copied = copy_file_range(in, &offset, out, NULL, length, 0);
+
+			/* Some filesystems, such as /proc, report 0 rather than an error */
+			if((copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) ||
+					copied == 0) {
+
+				useCopyRange = 0;
+				continue;
+			}
+		}
+		else if(useSendfile) {
+
+			copied = sendfile(out, in, &offset, length);
+			if(copied == -1 && (errno == EINVAL || errno == ENOSYS)) {
+
+				useSendfile = 0;
+				continue;
+			}
+		}
+		else {
+
+			copied = pread(in, buffer, length < (off_t)sizeof(buffer) ? length : (off_t)sizeof(buffer), offset);
+			if(copied > 0) {
+
+				if(write_all(out, buffer, copied) == -1) {
+					return -1;
+				}
+				offset += copied;
+			}
+		}
+
+		if(copied == -1 && errno == EINTR) {
+			continue;
+		}
+		if(copied == -1) {
+			return -1;
+		}
+		if(copied == 0) {
+			break;
+		}
+		length -= copied;
+		total += copied;
+	}
+	return total;
+}
+
+
+/*
+ * memo [-d file]... [-e name]... command [args]
+ * memo stats
+ *
+ * Runs command, or replays its cached result
+ * without running it. The cache key is the
+ * SHA-256 of the arguments, the working
+ * directory, PATH and any variables named with
+ * -e, the command itself (the executable's
+ * identity and times, or a function's text),
+ * the contents of a file on standard input and
+ * of each -d dependency file. A command reading
+ * a pipe is not cached.
+ *
+ * A hit writes the cached output to standard
+ * output and returns the cached status. On a
+ * miss the output is captured into the cache
+ * and then written out. Only commands that
+ * exit, rather than being killed, are cached.
+ */
+
+/* Adds a string and its terminating NUL */
+static void hash_string (struct smallsh_hash *hash, const char *text) {
+
+	smallsh_hash_update(hash, text, strlen(text) + 1);
+}
+
+
+/*
+ * Hashes standard input if it is a file.
+ * Terminals and devices are left to the
+ * command. Returns 1 for a pipe or socket,
+ * which cannot be hashed without taking the
+ * input away from the command.
+ */
+static int hash_input (struct smallsh_hash *hash) {
+
+	struct stat info;
+	off_t position;
+
+	if(fstat(STDIN_FILENO, &info) == -1 || S_ISCHR(info.st_mode)) {
+
+		hash_string(hash, "stdin: none");
+		return 0;
+	}
+	if(!S_ISREG(info.st_mode)) {
+		return 1;
+	}
+
+	hash_string(hash, "stdin:");
+	position = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	if(smallsh_hash_fd(hash, STDIN_FILENO) == -1) {
+		return -1;
+	}
+	lseek(STDIN_FILENO, position, SEEK_SET);
+	return 0;
+}
+
+
+/*
+ * Hashes what decides which command runs.
+ */
+static void hash_command (struct smallsh_shell *sh, struct smallsh_hash *hash, const char *name) {
+
+	struct smallsh_function *function = find_function(sh, name);
+	struct stat info;
+	char resolved[4096];
+	char text[4096];
+	const char *path;
+
+	if(function != NULL) {
+
+		smallsh_node_text(function->body, text, sizeof(text));
+		hash_string(hash, "function:");
+		hash_string(hash, text);
+		return;
+	}
+
+	if(find_builtin(name) != NULL) {
+
+		hash_string(hash, "builtin:");
+		return;
+	}
+
+	smallsh_path_refresh(&sh->paths, getenv("PATH"));
+	path = smallsh_path_lookup(&sh->paths, name, resolved, sizeof(resolved));
+	if(path == NULL) {
+		path = name;
+	}
+
+	if(stat(path, &info) == 0) {
+
+		snprintf(text, sizeof(text), "command: %s %lu %lu %lld %ld.%09ld", path, (unsigned long)info.st_dev,
+				(unsigned long)info.st_ino, (long long)info.st_size, (long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+		hash_string(hash, text);
+	}
+}
+
+
+static int builtin_memo (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_hash hash;
+	struct smallsh_fd_action action;
+	struct smallsh_job *job;
+	char key[65];
+	char cwd[4096];
+	char *dir;
+	char *tempPath = NULL;
+	const char *value;
+	off_t offset;
+	off_t length;
+	off_t start;
+	int cacheable;
+	int entry;
+	int file;
+	int childStatus;
+	int status = 0;
+	int i;
+	int opt = 1;
+
+	if(argc == 2 && !strcmp(argv[1], "stats")) {
+
+		dir = smallsh_memo_dir();
+		if(dir == NULL) {
+
+			fprintf(stderr, "memo: no cache directory\n");
+			return 1;
+		}
+		smallsh_memo_stats(dir);
+		free(dir);
+		return 0;
+	}
+
+	for(; opt + 1 < argc && argv[opt][0] == '-'; opt += 2) {
+
+		if(strcmp(argv[opt], "-d") && strcmp(argv[opt], "-e")) {
+			break;
+		}
+	}
+	if(opt < argc && !strcmp(argv[opt], "--")) {
+		opt++;
+	}
+
+	if(opt >= argc) {
+
+		fprintf(stderr, "Usage: memo [-d file]... [-e name]... command [args]\n       memo stats\n");
+		return 2;
+	}
+
+	smallsh_hash_init(&hash);
+	hash_string(&hash, "smallsh memo 1");
+
+	for(i = opt; i < argc; i++) {
+		hash_string(&hash, argv[i]);
+	}
+
+	hash_string(&hash, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+	value = getenv("PATH");
+	hash_string(&hash, value != NULL ? value : "");
+	hash_command(sh, &hash, argv[opt]);
+
+	for(i = 1; i < opt - 1; i += 2) {
+
+		hash_string(&hash, argv[i]);
+		hash_string(&hash, argv[i + 1]);
+
+		if(!strcmp(argv[i], "-e")) {
+
+			value = get_var(sh, argv[i + 1]);
+			hash_string(&hash, value != NULL ? value : "unset");
+			continue;
+		}
+
+		file = open(argv[i + 1], O_RDONLY | O_CLOEXEC);
+		if(file == -1 || smallsh_hash_fd(&hash, file) == -1) {
+			hash_string(&hash, "missing");
+		}
+		if(file != -1) {
+			close(file);
+		}
+	}
+
+	cacheable = hash_input(&hash);
+	if(cacheable == -1) {
+
+		perror("memo: stdin");
+		return 1;
+	}
+	smallsh_hash_final(&hash, key);
+
+	dir = cacheable == 0 ? smallsh_memo_dir() : NULL;
+
+	/* Hit: replay it without forking */
+	if(dir != NULL && (entry = smallsh_memo_open(dir, key, &status, &offset, &length)) != -1) {
+
+		smallsh_memo_count(dir, 1);
+		fflush(stdout);
+		copy_range(entry, offset, length, STDOUT_FILENO);
+		close(entry);
+		free(dir);
+		return status;
+	}
+
+	/*
+	 * Miss: run it with its output going into
+	 * a new entry. Input that cannot be hashed
+	 * means it just runs.
+	 */
+	entry = -1;
+	if(dir != NULL) {
+
+		smallsh_memo_count(dir, 0);
+		entry = smallsh_memo_create(dir, &tempPath, &start);
+	}
+	if(entry != -1) {
+
+		action.type = SMALLSH_FD_DUP;
+		action.fd = STDOUT_FILENO;
+		action.source = entry;
+	}
+
+	job = start_command(sh, argv + opt, &action, entry != -1, SMALLSH_SPAWN_DEFAULT_SIGINT, 0);
+	if(job == NULL) {
+		status = 1;
+	}
+	else {
+
+		childStatus = smallsh_job_wait(job);
+		smallsh_job_release(job);
+		record_child_status(sh, childStatus);
+		status = exit_code(sh);
+	}
+
+	if(entry != -1) {
+
+		fflush(stdout);
+		copy_range(entry, start, lseek(entry, 0, SEEK_END) - start, STDOUT_FILENO);
+
+		if(job != NULL && WIFEXITED(childStatus)) {
+			smallsh_memo_commit(dir, key, entry, tempPath, status);
+		}
+		else {
+			unlink(tempPath);
+		}
+		close(entry);
+	}
+
+	free(tempPath);
+	free(dir);
+	return status;
+}
+
+
+/*
+ * pstat command [args]
+ *
+ * Runs command with performance counters
+ * and prints them to standard error with
+ * IPC and miss rates. External commands are
+ * counted from their exec; builtins and
+ * functions from the fork of the shell that
+ * runs them.
+ */
+static int builtin_pstat (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_pstat pstat;
+	struct smallsh_job *job;
+	char command[256];
+	size_t length = 0;
+	int external;
+	int counting;
+	int status;
+	int i;
+
+	if(argc < 2) {
+
+		fprintf(stderr, "Usage: pstat command [args]\n");
+		return 2;
+	}
+
+	external = find_function(sh, argv[1]) == NULL && find_builtin(argv[1]) == NULL;
+	counting = smallsh_pstat_open(&pstat, external) == 0;
+	if(!counting) {
+		fprintf(stderr, "pstat: %s\n", strerror(errno));
+	}
+
+	job = start_command(sh, argv + 1, NULL, 0, SMALLSH_SPAWN_DEFAULT_SIGINT, 0);
+	if(job == NULL) {
+		status = 1;
+	}
+	else {
+
+		record_child_status(sh, smallsh_job_wait(job));
+		smallsh_job_release(job);
+		status = exit_code(sh);
+	}
+
+	if(counting) {
+
+		smallsh_pstat_read(&pstat);
+
+		command[0] = '\0';
+		for(i = 1; i < argc && length < sizeof(command); i++) {
+			length += snprintf(command + length, sizeof(command) - length, i > 1 ? " %s" : "%s", argv[i]);
+		}
+		if(job != NULL) {
+			smallsh_pstat_print(&pstat, stderr, command);
+		}
+		if(pstat_log(sh) != NULL) {
+			smallsh_pstat_log(&pstat, sh->pstatLog, status, command);
+		}
+	}
+	return status;
+}
+
+
+/*
+ * One line of jtop: a background job and
+ * what its process tree did over the last
+ * interval.
+ */
+struct jtop_row {
+
+	int id;
+	pid_t pid;
+	const char *command;
+	struct smallsh_proc_totals totals;
+	double cpu;
+	double readRate;
+	double writeRate;
+};
+
+/* Sort orders for -s, and the keys that pick them while running */
+static const char *const JTOP_SORT_NAMES[] = { "cpu", "rss", "read", "write", "pid", "job", NULL };
+static const char JTOP_SORT_KEYS[] = "cmrwpj";
+
+
+static int jtop_compare (const void *a, const void *b, void *order) {
+
+	const struct jtop_row *x = a;
+	const struct jtop_row *y = b;
+	double difference;
+
+	switch(JTOP_SORT_KEYS[*(int *)order]) {
+
+		case 'c':
+			difference = y->cpu - x->cpu;
+			break;
+
+		case 'm':
+			difference = (double)y->totals.rssBytes - (double)x->totals.rssBytes;
+			break;
+
+		case 'r':
+			difference = y->readRate - x->readRate;
+			break;
+
+		case 'w':
+			difference = y->writeRate - x->writeRate;
+			break;
+
+		case 'p':
+			difference = x->pid - y->pid;
+			break;
+
+		default:
+			difference = 0;
+			break;
+	}
+	if(difference == 0) {
+		return x->id - y->id;
+	}
+	return difference < 0 ? -1 : 1;
+}
+
+
+/*
+ * Formats a byte count with a binary
+ * suffix, in at most six columns.
+ */
+static const char *jtop_size (char *text, size_t size, double bytes) {
+
+	static const char suffixes[] = "BKMGTP";
+	int i;
+
+	for(i = 0; bytes >= 1024 && suffixes[i + 1] != '\0'; i++) {
+		bytes /= 1024;
+	}
+	snprintf(text, size, i == 0 ? "%.0f%c" : "%.1f%c", bytes, suffixes[i]);
+	return text;
+}
+
+
+static void jtop_print (struct jtop_row *rows, int numRows, int order, long intervalMs, int screen) {
+
+	char rss[16];
+	char readRate[16];
+	char writeRate[16];
+	int i;
+
+	if(screen) {
+		printf("\033[H\033[J");
+	}
+	printf("%d job%s, sorted by %s, every %.1fs%s\n", numRows, numRows == 1 ? "" : "s",
+			JTOP_SORT_NAMES[order], intervalMs / 1000.0, screen ? "  (q quits; c m r w p j sort)" : "");
+	printf("%-5s %-8s %-5s %5s %6s %7s %8s %8s  %s\n",
+			"JOB", "PID", "STATE", "PROCS", "CPU%", "RSS", "READ/s", "WRITE/s", "COMMAND");
+
+	for(i = 0; i < numRows; i++) {
+
+		printf("[%d]%*s %-8ld %-5c %5d %6.1f %7s %8s %8s  %s\n", rows[i].id,
+				rows[i].id < 10 ? 2 : rows[i].id < 100 ? 1 : 0, "", (long)rows[i].pid,
+				rows[i].totals.state, rows[i].totals.numProcs, rows[i].cpu,
+				jtop_size(rss, sizeof(rss), rows[i].totals.rssBytes),
+				jtop_size(readRate, sizeof(readRate), rows[i].readRate),
+				jtop_size(writeRate, sizeof(writeRate), rows[i].writeRate), rows[i].command);
+	}
+	fflush(stdout);
+}
+
+
+/*
+ * jtop [-d ms] [-s cpu|rss|read|write|pid|job] [-n count]
+ * jobs -w [...]
+ *
+ * Shows the background jobs' process trees
+ * like top: CPU use, resident memory, I/O
+ * rates and state, refreshed every interval
+ * (1 second by default). On a terminal it
+ * redraws until q or interrupted, and keys
+ * change the sort; otherwise it prints
+ * count frames (1 by default) and returns.
+ */
+static int builtin_jtop (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_proc_table table;
+	struct smallsh_proc_totals ignored;
+	struct jtop_row *rows;
+	struct pollfd fds[3];
+	struct signalfd_siginfo caught;
+	struct held_sigint interrupt;
+	struct termios savedTerm;
+	struct termios raw;
+	long long lastSample;
+	long long now;
+	long long left;
+	long intervalMs = 1000;
+	long ticksPerSecond = sysconf(_SC_CLK_TCK);
+	long count = -1;
+	double seconds;
+	const char *picked;
+	char key;
+	int order = 0;
+	int screen = isatty(STDOUT_FILENO);
+	int keys;
+	int numFds;
+	int numRows = 0;
+	int frames = 0;
+	int status = 0;
+	int i;
+	int opt;
+
+	for(opt = 1; opt < argc; opt++) {
+
+		if(!strcmp(argv[opt], "-d") && opt + 1 < argc) {
+			intervalMs = atol(argv[++opt]);
+		}
+		else if(!strcmp(argv[opt], "-n") && opt + 1 < argc) {
+			count = atol(argv[++opt]);
+		}
+		else if(!strcmp(argv[opt], "-s") && opt + 1 < argc) {
+
+			opt++;
+			for(order = 0; JTOP_SORT_NAMES[order] != NULL && strcmp(JTOP_SORT_NAMES[order], argv[opt]); order++) {
+				;
+			}
+			if(JTOP_SORT_NAMES[order] == NULL) {
+				break;
+			}
+		}
+		else {
+			break;
+		}
+	}
+
+	if(opt < argc || intervalMs < 10 || count == 0 || count < -1) {
+
+		fprintf(stderr, "Usage: jtop [-d ms] [-s cpu|rss|read|write|pid|job] [-n count]\n");
+		return 2;
+	}
+	if(count == -1) {
+		count = screen ? 0 : 1;
+	}
+
+	/* Keys are read a byte at a time without echo */
+	keys = screen && isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &savedTerm) == 0;
+	if(keys) {
+
+		raw = savedTerm;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+	}
+
+	take_sigint(sh, &interrupt, 0);
+
+	/*
+	 * The first sample only opens each
+	 * process's files and records where its
+	 * counters start.
+	 */
+	rows = calloc(MAX_FORKS, sizeof(struct jtop_row));
+	smallsh_proc_init(&table);
+	smallsh_ctx_dispatch(sh->ctx, 0);
+	smallsh_proc_begin_sample(&table);
+	for(i = 0; i < sh->numBGProcesses; i++) {
+		smallsh_proc_sample_tree(&table, smallsh_job_pid(sh->backgroundJobs[i].job), &ignored);
+	}
+	smallsh_proc_end_sample(&table);
+	lastSample = now_ms();
+
+	while(count == 0 || frames < count) {
+
+		numFds = 0;
+		fds[numFds].fd = smallsh_ctx_fd(sh->ctx);
+		fds[numFds++].events = POLLIN;
+		if(interrupt.fd != -1) {
+
+			fds[numFds].fd = interrupt.fd;
+			fds[numFds++].events = POLLIN;
+		}
+		if(keys) {
+
+			fds[numFds].fd = STDIN_FILENO;
+			fds[numFds++].events = POLLIN;
+		}
+
+		left = lastSample + intervalMs - now_ms();
+		if(left > 0) {
+
+			if(poll(fds, numFds, left) == -1) {
+
+				if(errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			if(fds[0].revents & POLLIN) {
+				smallsh_ctx_dispatch(sh->ctx, 0);
+			}
+			if(interrupt.fd != -1 && (fds[1].revents & POLLIN)) {
+
+				read(interrupt.fd, &caught, sizeof(caught));
+				status = 130;
+				break;
+			}
+			if(keys && (fds[numFds - 1].revents & POLLIN) && read(STDIN_FILENO, &key, 1) == 1) {
+
+				if(key == 'q') {
+					break;
+				}
+				if(key != '\0' && (picked = strchr(JTOP_SORT_KEYS, key)) != NULL) {
+
+					/* Redraw the last frame in the new order */
+					order = picked - JTOP_SORT_KEYS;
+					qsort_r(rows, numRows, sizeof(rows[0]), jtop_compare, &order);
+					if(frames > 0) {
+						jtop_print(rows, numRows, order, intervalMs, screen);
+					}
+				}
+			}
+			continue;
+		}
+
+		smallsh_ctx_dispatch(sh->ctx, 0);
+		now = now_ms();
+		seconds = (now - lastSample) / 1000.0;
+		lastSample = now;
+
+		smallsh_proc_begin_sample(&table);
+		for(numRows = 0; numRows < sh->numBGProcesses; numRows++) {
+
+			rows[numRows].id = sh->backgroundJobs[numRows].id;
+			rows[numRows].pid = smallsh_job_pid(sh->backgroundJobs[numRows].job);
+			rows[numRows].command = sh->backgroundJobs[numRows].command;
+			smallsh_proc_sample_tree(&table, rows[numRows].pid, &rows[numRows].totals);
+			rows[numRows].cpu = rows[numRows].totals.cpuTicks * 100.0 / ticksPerSecond / seconds;
+			rows[numRows].readRate = rows[numRows].totals.readBytes / seconds;
+			rows[numRows].writeRate = rows[numRows].totals.writtenBytes / seconds;
+		}
+		smallsh_proc_end_sample(&table);
+
+		qsort_r(rows, numRows, sizeof(rows[0]), jtop_compare, &order);
+		if(frames > 0 && !screen) {
+			printf("\n");
+		}
+		jtop_print(rows, numRows, order, intervalMs, screen);
+		frames++;
+	}
+
+	smallsh_proc_free(&table);
+	free(rows);
+
+	release_sigint(&interrupt);
+	if(keys) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &savedTerm);
+	}
+	return status;
+}
+
+
+/*
+ * Copies the rest of in to standard output.
+ * Regular files go through copy_range from
+ * the current offset, so file to file copies
+ * stay in the kernel.
+ */
+static int cat_fd (int in) {
+
+	struct stat info;
+	char buffer[65536];
+	ssize_t got;
+	off_t offset;
+	off_t copied;
+
+	/*
+	 * Files in /proc and /sys have a size of 0,
+	 * or one that is only an upper bound, so
+	 * whatever the copy leaves is read.
+	 */
+	if(fstat(in, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && (offset = lseek(in, 0, SEEK_CUR)) != -1) {
+
+		if(offset >= info.st_size) {
+			return 0;
+		}
+		copied = copy_range(in, offset, info.st_size - offset, STDOUT_FILENO);
+		if(copied == -1) {
+			return -1;
+		}
+		lseek(in, offset + copied, SEEK_SET);
+		if(copied == info.st_size - offset) {
+			return 0;
+		}
+	}
+
+	while((got = read(in, buffer, sizeof(buffer))) != 0) {
+
+		if(got == -1) {
+
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if(write_all(STDOUT_FILENO, buffer, got) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * True if cat could wait indefinitely: on
+ * input that is not a regular file, or on
+ * output to a pipe, socket or terminal.
+ */
+static int cat_may_block (int argc, char *argv[]) {
+
+	struct stat info;
+	int i;
+
+	if(fstat(STDOUT_FILENO, &info) == -1 || S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode) || isatty(STDOUT_FILENO)) {
+		return 1;
+	}
+	if(argc == 1) {
+		return fstat(STDIN_FILENO, &info) == -1 || !S_ISREG(info.st_mode);
+	}
+	for(i = 1; i < argc; i++) {
+
+		if(!strcmp(argv[i], "-") ? fstat(STDIN_FILENO, &info) == 0 && !S_ISREG(info.st_mode) :
+				stat(argv[i], &info) == 0 && !S_ISREG(info.st_mode)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static int cat_files (int argc, char *argv[]) {
+
+	int status = 0;
+	int in;
+	int i;
+
+	if(argc == 1) {
+
+		if(cat_fd(STDIN_FILENO) == -1) {
+
+			perror("cat");
+			status = 1;
+		}
+		return status;
+	}
+
+	for(i = 1; i < argc; i++) {
+
+		in = strcmp(argv[i], "-") ? open(argv[i], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+		if(in == -1 || cat_fd(in) == -1) {
+
+			fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+			status = 1;
+		}
+		if(in != -1 && in != STDIN_FILENO) {
+			close(in);
+		}
+	}
+	return status;
+}
+
+
+/*
+ * cat [file...]
+ *
+ * Writes each file, or standard input for -
+ * or no files, to standard output. Copies
+ * that could block, such as from a terminal
+ * or /dev/zero, run in a forked copy of the
+ * shell, so Ctrl-C and Ctrl-Z reach them.
+ */
+static int builtin_cat (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_job *job;
+	struct termios modes;
+	char command[256];
+	size_t length = 0;
+	int childStatus;
+	pid_t forkedPID;
+	int i;
+
+	fflush(stdout);
+
+	if(sh->isSubshell || !cat_may_block(argc, argv)) {
+		return cat_files(argc, argv);
+	}
+
+	forkedPID = shell_fork(sh, 0, &job);
+	if(forkedPID == -1) {
+		return 1;
+	}
+	if(forkedPID == 0) {
+
+		setup_child(sh, 0);
+		sh->isSubshell = 1;
+		exit(cat_files(argc, argv));
+	}
+
+	childStatus = wait_foreground(sh, job, NULL, &modes);
+	if(WIFSTOPPED(childStatus)) {
+
+		for(i = 0; i < argc && length < sizeof(command); i++) {
+			length += snprintf(command + length, sizeof(command) - length, i > 0 ? " %s" : "%s", argv[i]);
+		}
+		stop_foreground(sh, job, command, childStatus, &modes);
+		return sh->status;
+	}
+	record_child_status(sh, childStatus);
+	smallsh_job_release(job);
+
+	if(sh->status == SIGNAL_KILLED) {
+
+		printf("Terminated by signal %d\n", sh->signalNum);
+		fflush(stdout);
+	}
+	return exit_code(sh);
+}
+
+
+/*
+ * coproc NAME command [args...] starts command
+ * in the background with its standard input
+ * and output on pipes kept by the shell, and
+ * sets NAME_PID. query talks to it.
+ */
+static int builtin_coproc (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_fd_action actions[2];
+	struct smallsh_coproc *coproc;
+	struct smallsh_job *job;
+	char command[256];
+	char value[32];
+	char *variable;
+	size_t length;
+	int toChild[2];
+	int fromChild[2];
+	int i;
+
+	if(argc < 3) {
+
+		fprintf(stderr, "Usage: coproc NAME command [args...]\n");
+		return 2;
+	}
+	if(!smallsh_is_name(argv[1], strlen(argv[1]))) {
+
+		fprintf(stderr, "coproc: %s: not a valid name\n", argv[1]);
+		return 1;
+	}
+
+	smallsh_ctx_dispatch(sh->ctx, 0);
+	if(find_coproc(sh, argv[1]) != NULL) {
+
+		fprintf(stderr, "coproc: %s is already running\n", argv[1]);
+		return 1;
+	}
+
+	if(pipe2(toChild, O_CLOEXEC) == -1) {
+
+		perror("pipe");
+		return 1;
+	}
+	if(pipe2(fromChild, O_CLOEXEC) == -1) {
+
+		perror("pipe");
+		close(toChild[0]);
+		close(toChild[1]);
+		return 1;
+	}
+
+	actions[0].type = SMALLSH_FD_DUP;
+	actions[0].fd = STDIN_FILENO;
+	actions[0].source = toChild[0];
+	actions[1].type = SMALLSH_FD_DUP;
+	actions[1].fd = STDOUT_FILENO;
+	actions[1].source = fromChild[1];
+
+	/* Listed before it starts, so a forked builtin or function drops the shell's ends */
+	coproc = calloc(1, sizeof(struct smallsh_coproc));
+	coproc->name = strdup(argv[1]);
+	coproc->input = toChild[1];
+	coproc->output = fromChild[0];
+	coproc->next = sh->coprocs;
+	sh->coprocs = coproc;
+
+	job = start_command(sh, argv + 2, actions, 2, 0, 1);
+	close(toChild[0]);
+	close(fromChild[1]);
+
+	if(job == NULL) {
+
+		drop_coproc(sh, coproc);
+		return 1;
+	}
+	coproc->job = job;
+
+	length = 0;
+	command[0] = '\0';
+	for(i = 0; i < argc && length < sizeof(command); i++) {
+		length += snprintf(command + length, sizeof(command) - length, i > 0 ? " %s" : "%s", argv[i]);
+	}
+	add_background(sh, job, command);
+
+	variable = malloc(strlen(argv[1]) + 5);
+	sprintf(variable, "%s_PID", argv[1]);
+	snprintf(value, sizeof(value), "%ld", (long)smallsh_job_pid(job));
+	set_var(sh, variable, value);
+	free(variable);
+	return 0;
+}
+
+
+/*
+ * Writes all of data to the coprocess,
+ * with SIGPIPE ignored in case it has
+ * exited. Returns -1 on error.
+ */
+static int coproc_write (struct smallsh_coproc *coproc, const char *data, size_t length) {
+
+	struct sigaction ignore;
+	struct sigaction savedPipe;
+	ssize_t written = 0;
+
+	sigemptyset(&ignore.sa_mask);
+	ignore.sa_flags = 0;
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, &savedPipe);
+
+	while(length > 0) {
+
+		written = write(coproc->input, data, length);
+		if(written == -1 && errno == EINTR) {
+			continue;
+		}
+		if(written <= 0) {
+			break;
+		}
+		data += written;
+		length -= written;
+	}
+
+	sigaction(SIGPIPE, &savedPipe, NULL);
+	return length > 0 ? -1 : 0;
+}
+
+
+/*
+ * query NAME [words...] sends the words as
+ * one line to the coprocess NAME, reads one
+ * line back and writes it to standard output,
+ * so $(query NAME ...) asks a question
+ * without starting a process. With no words
+ * it only reads the next line. The status is
+ * 1 if the coprocess closed its output, and
+ * 130 if SIGINT ended the wait for a reply.
+ */
+static int builtin_query (struct smallsh_shell *sh, int argc, char *argv[]) {
+
+	struct smallsh_coproc *coproc;
+	struct pollfd fds[2];
+	struct signalfd_siginfo caught;
+	struct held_sigint interrupt;
+	char *request;
+	char *newline;
+	size_t length = 0;
+	ssize_t got;
+	int status = 0;
+	int i;
+
+	if(argc < 2) {
+
+		fprintf(stderr, "Usage: query NAME [words...]\n");
+		return 2;
+	}
+
+	coproc = find_coproc(sh, argv[1]);
+	if(coproc == NULL) {
+
+		fprintf(stderr, "query: %s: no such coprocess\n", argv[1]);
+		return 1;
+	}
+
+	if(argc > 2) {
+
+		for(i = 2; i < argc; i++) {
+			length += strlen(argv[i]) + 1;
+		}
+		request = malloc(length);
+		length = 0;
+		for(i = 2; i < argc; i++) {
+
+			strcpy(request + length, argv[i]);
+			length += strlen(argv[i]);
+			request[length++] = i + 1 < argc ? ' ' : '\n';
+		}
+
+		if(coproc->input == -1 || coproc_write(coproc, request, length) == -1) {
+
+			fprintf(stderr, "query: %s: %s\n", argv[1], strerror(coproc->input == -1 ? EPIPE : errno));
+			free(request);
+			return 1;
+		}
+		free(request);
+	}
+
+	/* A coprocess that never answers can be given up on with SIGINT, as in wait */
+	take_sigint(sh, &interrupt, 0);
+
+	fds[0].fd = coproc->output;
+	fds[0].events = POLLIN;
+	fds[1].fd = interrupt.fd;
+	fds[1].events = POLLIN;
+
+	/* Replies come a line at a time; anything read past one is kept */
+	while((newline = memchr(coproc->buffer, '\n', coproc->buffered)) == NULL) {
+
+		if(coproc->buffered == coproc->capacity) {
+
+			coproc->capacity = coproc->capacity ? coproc->capacity * 2 : 4096;
+			coproc->buffer = realloc(coproc->buffer, coproc->capacity);
+		}
+
+		if(poll(fds, interrupt.fd == -1 ? 1 : 2, -1) == -1 && errno != EINTR) {
+
+			perror("query: poll");
+			status = 1;
+			break;
+		}
+		if(interrupt.fd != -1 && (fds[1].revents & POLLIN)) {
+
+			read(interrupt.fd, &caught, sizeof(caught));
+			status = 130;
+			break;
+		}
+		if(!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+
+		got = read(coproc->output, coproc->buffer + coproc->buffered, coproc->capacity - coproc->buffered);
+		if(got == -1 && errno == EINTR) {
+			continue;
+		}
+		if(got <= 0) {
+
+			fwrite(coproc->buffer, 1, coproc->buffered, stdout);
+			fflush(stdout);
+			coproc->buffered = 0;
+			status = 1;
+			break;
+		}
+		coproc->buffered += got;
+	}
+
+	if(status == 0) {
+
+		length = newline - coproc->buffer + 1;
+		fwrite(coproc->buffer, 1, length, stdout);
+		fflush(stdout);
+		coproc->buffered -= length;
+		memmove(coproc->buffer, coproc->buffer + length, coproc->buffered);
+	}
+
+	release_sigint(&interrupt);
+	return status;
+}
+
+
+/*
+ * On exit, closes the input of every
+ * coprocess so it can finish on its own,
+ * and reaps those that do within
+ * COPROC_STOP_MS. Any left are killed with
+ * the other background jobs.
+ */
+static void stop_coprocs (struct smallsh_shell *sh) {
+
+	struct smallsh_coproc *coproc;
+	long long deadline = now_ms() + COPROC_STOP_MS;
+	long long left;
+
+	for(coproc = sh->coprocs; coproc != NULL; coproc = coproc->next) {
+
+		close(coproc->input);
+		coproc->input = -1;
+	}
+
+	while(sh->coprocs != NULL && (left = deadline - now_ms()) > 0) {
+		smallsh_ctx_dispatch(sh->ctx, left);
+	}
+}
+
+
+static const struct smallsh_builtin BUILTINS[] = {
+
+	{ "exit", builtin_exit },
+	{ "status", builtin_status },
+	{ "cd", builtin_cd },
+	{ "echo", builtin_echo },
+	{ "test", builtin_test },
+	{ "[", builtin_test },
+	{ "true", builtin_true },
+	{ ":", builtin_true },
+	{ "false", builtin_false },
+	{ "export", builtin_export },
+	{ "unset", builtin_unset },
+	{ "shift", builtin_shift },
+	{ "return", builtin_return },
+	{ "source", builtin_source },
+	{ ".", builtin_source },
+	{ "break", builtin_break },
+	{ "continue", builtin_continue },
+	{ "fanout", builtin_fanout },
+	{ "jobs", builtin_jobs },
+	{ "fg", builtin_fg },
+	{ "bg", builtin_bg },
+	{ "kill", builtin_kill },
+	{ "wait", builtin_wait },
+	{ "on-change", builtin_on_change },
+	{ "memo", builtin_memo },
+	{ "cat", builtin_cat },
+	{ "dag", builtin_dag },
+	{ "pstat", builtin_pstat },
+	{ "jtop", builtin_jtop },
+	{ "coproc", builtin_coproc },
+	{ "query", builtin_query },
+	{ NULL, NULL }
+};
+
+
+static const struct smallsh_builtin *find_builtin (const char *name) {
+
+	int i;
+
+	for(i = 0; BUILTINS[i].name != NULL; i++) {
+
+		if(!strcmp(BUILTINS[i].name, name)) {
+			return &BUILTINS[i];
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Runs a simple command. Assignments alone
+ * set shell variables. Otherwise the first
+ * word is looked up as a function, then a
+ * builtin, and only then launched as an
+ * external command.
+ */
+static int exec_command (struct smallsh_shell *sh, struct smallsh_node *node, int background) {
+
+	struct smallsh_arena scratch;
+	struct smallsh_word *word;
+	const struct smallsh_builtin *builtin = NULL;
+	struct smallsh_function *function = NULL;
+	struct saved_fd *saved;
+	char **argv;
+	char **assignments;
+	int argc;
+	int numAssignments = 0;
+	int numSaved = 0;
+	int substitutions;
+	int i;
+	struct timespec started;
+	struct timespec finished;
+
+	if(sh->timing != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &started);
+	}
+
+	smallsh_arena_init(&scratch);
+
+	/* With no command, the status is that of the last substitution */
+	substitutions = sh->numSubstitutions;
+	argv = expand_words(sh, node->words, &scratch, &argc);
+
+	for(word = node->assignments; word != NULL; word = word->next) {
+		numAssignments++;
+	}
+	assignments = smallsh_arena_alloc(&scratch, (numAssignments + 1) * sizeof(char *));
+	for(i = 0, word = node->assignments; word != NULL; i++, word = word->next) {
+		assignments[i] = expand_string(sh, word, &scratch);
+	}
+
+	if(bad_substitution(sh) == -1) {
+
+		sh->status = 1;
+		smallsh_arena_free(&scratch);
+		return sh->status;
+	}
+
+	if(argc > 0) {
+
+		function = find_function(sh, argv[0]);
+		if(function == NULL) {
+			builtin = find_builtin(argv[0]);
+		}
+	}
+
+	/*
+	 * External commands fork here. Everything
+	 * else runs in this process, unless it was
+	 * sent to the background.
+	 */
+	if(argc > 0 && function == NULL && builtin == NULL) {
+
+		launch_external(sh, node, argc, argv, assignments, &scratch, background);
+	}
+
+	else if(background) {
+
+		run_subshell(sh, node, 1);
+	}
+
+	else {
+
+		for(i = 0; i < numAssignments; i++) {
+			assign(sh, assignments[i]);
+		}
+
+		saved = smallsh_arena_alloc(&scratch, (count_redirects(node->redirects) + 1) * sizeof(struct saved_fd));
+
+		if(apply_redirects(sh, node->redirects, &scratch, saved, &numSaved) == -1) {
+			sh->status = 1;
+		}
+		else if(function != NULL) {
+			call_function(sh, function, argc, argv);
+		}
+		else if(builtin != NULL) {
+			sh->status = builtin->run(sh, argc, argv);
+		}
+		else if(sh->numSubstitutions == substitutions) {
+			sh->status = 0;
+		}
+
+		restore_redirects(saved, numSaved);
+	}
+
+	smallsh_arena_free(&scratch);
+
+	if(sh->timing != NULL) {
+
+		clock_gettime(CLOCK_MONOTONIC, &finished);
+		fprintf(sh->timing, "%lld\n", (finished.tv_sec - started.tv_sec) * 1000000000LL + finished.tv_nsec - started.tv_nsec);
+	}
+	return sh->status;
+}
+
+
+/*
+ * True while a break, continue or
+ * return is unwinding.
+ */
+static int unwinding (struct smallsh_shell *sh) {
+
+	return sh->breakCount || sh->continueCount || sh->returning || sh->exiting;
+}
+
+
+static int exec_loop (struct smallsh_shell *sh, struct smallsh_node *node) {
+
+	int bodyStatus = 0;
+
+	sh->loopDepth++;
+
+	for(;;) {
+
+		exec_node(sh, node->left);
+		if(unwinding(sh)) {
+
+			bodyStatus = sh->status;
+			break;
+		}
+
+		if((sh->status == 0) == (node->type == NODE_UNTIL)) {
+			break;
+		}
+
+		bodyStatus = exec_node(sh, node->right);
+
+		if(sh->breakCount) {
+
+			sh->breakCount--;
+			break;
+		}
+		if(sh->continueCount) {
+
+			/* continue 2 and up leave this loop too */
+			if(--sh->continueCount) {
+				break;
+			}
+		}
+		if(sh->returning || sh->exiting) {
+			break;
+		}
+	}
+
+	sh->loopDepth--;
+	sh->status = bodyStatus;
+	return bodyStatus;
+}
+
+
+static int exec_for (struct smallsh_shell *sh, struct smallsh_node *node) {
+
+	struct smallsh_arena scratch;
+	char **values;
+	int numValues;
+	int bodyStatus = 0;
+	int i;
+
+	smallsh_arena_init(&scratch);
+
+	/* With no "in" list the loop runs over the positional parameters */
+	if(node->hasList) {
+
+		values = expand_words(sh, node->words, &scratch, &numValues);
+		if(bad_substitution(sh) == -1) {
+
+			smallsh_arena_free(&scratch);
+			sh->status = 1;
+			return sh->status;
+		}
+	}
+	else {
+
+		values = sh->params;
+		numValues = sh->numParams;
+	}
+
+	sh->loopDepth++;
+
+	for(i = 0; i < numValues; i++) {
+
+		set_var(sh, node->name, values[i]);
+		bodyStatus = exec_node(sh, node->right);
+
+		if(sh->breakCount) {
+
+			sh->breakCount--;
+			break;
+		}
+		if(sh->continueCount && --sh->continueCount) {
+			break;
+		}
+		if(sh->returning || sh->exiting) {
+			break;
+		}
+	}
+
+	sh->loopDepth--;
+	smallsh_arena_free(&scratch);
+	sh->status = bodyStatus;
+	return bodyStatus;
+}
+
+
+static void define_function (struct smallsh_shell *sh, struct smallsh_node *node) {
+
+	struct smallsh_function *function = find_function(sh, node->name);
+
+	if(function == NULL) {
+
+		function = calloc(1, sizeof(struct smallsh_function));
+		function->name = strdup(node->name);
+		function->next = sh->functions;
+		sh->functions = function;
+		function->hashNext = sh->functionBuckets[name_bucket(node->name)];
+		sh->functionBuckets[name_bucket(node->name)] = function;
+	}
+	function->body = node->left;
+	sh->keepArena = 1;
+}
+
+
+/*
+ * Runs a compound command with its
+ * redirections applied around it.
+ */
+static int exec_redirected (struct smallsh_shell *sh, struct smallsh_node *node) {
+
+	struct smallsh_arena scratch;
+	struct saved_fd *saved;
+	int numSaved = 0;
+
+	if(node->redirects == NULL) {
+
+		switch(node->type) {
+
+			case NODE_IF:
+				exec_node(sh, node->left);
+				if(unwinding(sh)) {
+					return sh->status;
+				}
+				if(sh->status == 0) {
+					return exec_node(sh, node->right);
+				}
+				if(node->third != NULL) {
+					return exec_node(sh, node->third);
+				}
+				sh->status = 0;
+				return 0;
+
+			case NODE_WHILE:
+			case NODE_UNTIL:
+				return exec_loop(sh, node);
+
+			case NODE_FOR:
+				return exec_for(sh, node);
+
+			case NODE_GROUP:
+				return exec_node(sh, node->left);
+
+			default:
+				return run_subshell(sh, node->left, 0);
+		}
+	}
+
+	smallsh_arena_init(&scratch);
+	saved = smallsh_arena_alloc(&scratch, (count_redirects(node->redirects) + 1) * sizeof(struct saved_fd));
+
+	if(apply_redirects(sh, node->redirects, &scratch, saved, &numSaved) == -1) {
+
+		sh->status = 1;
+	}
+	else {
+
+		/* Run the same node again without its redirections */
+		struct smallsh_node bare = *node;
+
+		bare.redirects = NULL;
+		exec_redirected(sh, &bare);
+	}
+
+	restore_redirects(saved, numSaved);
+	smallsh_arena_free(&scratch);
+	return sh->status;
+}
+
+
+static int exec_node (struct smallsh_shell *sh, struct smallsh_node *node) {
+
+	struct smallsh_node *item;
+
+	switch(node->type) {
+
+		case NODE_LIST:
+			for(item = node->left; item != NULL && !unwinding(sh); item = item->next) {
+				exec_node(sh, item);
+			}
+			break;
+
+		case NODE_AND:
+			if(exec_node(sh, node->left) == 0 && !unwinding(sh)) {
+				exec_node(sh, node->right);
+			}
+			break;
+
+		case NODE_OR:
+			if(exec_node(sh, node->left) != 0 && !unwinding(sh)) {
+				exec_node(sh, node->right);
+			}
+			break;
+
+		case NODE_NOT:
+			exec_node(sh, node->left);
+			if(!sh->exiting) {
+				sh->status = sh->status == 0 ? 1 : 0;
+			}
+			break;
+
+		case NODE_BACKGROUND:
+			if(node->left->type == NODE_COMMAND) {
+				exec_command(sh, node->left, 1);
+			}
+			else {
+				run_subshell(sh, node->left, 1);
+			}
+			break;
+
+		case NODE_FUNCTION:
+			define_function(sh, node);
+			sh->status = 0;
+			break;
+
+		case NODE_COMMAND:
+			exec_command(sh, node, 0);
+			break;
+
+		default:
+			exec_redirected(sh, node);
+			break;
+	}
+	return sh->status;
+}
+
+
+/*
+ * Commands that only set up the shell's own
+ * state, which a resumed script needs again
+ * before the commands after them can run.
+ */
+static const char *const REPLAYED_BUILTINS[] = { "cd", "export", "unset", "shift", "coproc", "source", ".", NULL };
+
+/*
+ * Background commands are run again too: they
+ * return once started, not once finished, so
+ * the journal cannot say they completed.
+ */
+static int journal_replays (struct smallsh_node *node) {
+
+	int i;
+
+	if(node->type == NODE_FUNCTION || node->type == NODE_BACKGROUND) {
+		return 1;
+	}
+	if(node->type != NODE_COMMAND) {
+		return 0;
+	}
+	if(node->words == NULL) {
+		return 1;
+	}
+	for(i = 0; REPLAYED_BUILTINS[i] != NULL; i++) {
+
+		if(!strcmp(node->words->text, REPLAYED_BUILTINS[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static int has_substitution (struct smallsh_word *word) {
+
+	for(; word != NULL; word = word->next) {
+
+		if(strstr(word->text, "$(") != NULL || strchr(word->text, '`') != NULL) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Hashes a top-level command for the journal.
+ * A simple command is hashed as expanded, so
+ * it no longer matches once the variables it
+ * uses change. Anything else, or a command
+ * with a substitution that would have to run
+ * to be expanded, is hashed as source text.
+ */
+static uint64_t journal_key (struct smallsh_shell *sh, struct smallsh_node *node) {
+
+	struct smallsh_arena scratch;
+	struct smallsh_redirect *redirect;
+	struct smallsh_word *word;
+	uint64_t hash = JOURNAL_HASH_START;
+	char text[4096];
+	char *longText;
+	char **fields;
+	char *value;
+	size_t length;
+	int substituted = 0;
+	int count;
+	int i;
+
+	if(node->type == NODE_COMMAND) {
+
+		substituted = has_substitution(node->words) || has_substitution(node->assignments);
+		for(redirect = node->redirects; redirect != NULL; redirect = redirect->next) {
+			substituted |= has_substitution(redirect->target);
+		}
+	}
+
+	if(node->type != NODE_COMMAND || substituted) {
+
+		length = smallsh_node_text(node, text, sizeof(text));
+		if(length < sizeof(text)) {
+			return smallsh_journal_hash(hash, text, length);
+		}
+		longText = malloc(length + 1);
+		smallsh_node_text(node, longText, length + 1);
+		hash = smallsh_journal_hash(hash, longText, length);
+		free(longText);
+		return hash;
+	}
+
+	smallsh_arena_init(&scratch);
+	for(word = node->assignments; word != NULL; word = word->next) {
+
+		value = expand_string(sh, word, &scratch);
+		hash = smallsh_journal_hash(hash, value, strlen(value) + 1);
+	}
+	fields = expand_words(sh, node->words, &scratch, &count);
+	for(i = 0; i < count; i++) {
+		hash = smallsh_journal_hash(hash, fields[i], strlen(fields[i]) + 1);
+	}
+	for(redirect = node->redirects; redirect != NULL; redirect = redirect->next) {
+
+		hash = smallsh_journal_hash(hash, &redirect->type, sizeof(redirect->type));
+		hash = smallsh_journal_hash(hash, &redirect->fd, sizeof(redirect->fd));
+		value = expand_string(sh, redirect->target, &scratch);
+		hash = smallsh_journal_hash(hash, value, strlen(value) + 1);
+	}
+	smallsh_arena_free(&scratch);
+
+	/* Reported when the command runs */
+	free(sh->badSubstitution);
+	sh->badSubstitution = NULL;
+	return hash;
+}
+
+
+/*
+ * Runs a program's top-level commands,
+ * skipping the ones the journal says have
+ * already finished and recording the rest.
+ */
+static void exec_journaled (struct smallsh_shell *sh, struct smallsh_node *list) {
+
+	struct smallsh_node *item;
+	long long started;
+	uint64_t hash;
+	int status;
+
+	for(item = list->left; item != NULL && !unwinding(sh); item = item->next) {
+
+		if(journal_replays(item)) {
+
+			exec_node(sh, item);
+			continue;
+		}
+
+		hash = journal_key(sh, item);
+		if(smallsh_journal_match(sh->journal, item->line, hash, &status)) {
+
+			sh->status = status;
+			sh->signalNum = 0;
+			continue;
+		}
+
+		started = now_ms();
+		exec_node(sh, item);
+
+		/* exit is not journaled, so a resumed run stops at it too */
+		if(!sh->exiting) {
+			smallsh_journal_add(sh->journal, item->line, hash, exit_code(sh), now_ms() - started);
+		}
+	}
+}
+
+
+struct smallsh_shell *smallsh_shell_new (struct smallsh_ctx *ctx) {
+
+	struct smallsh_shell *sh = calloc(1, sizeof(struct smallsh_shell));
+	const char *timingPath;
+
+	if(sh == NULL) {
+		return NULL;
+	}
+
+	sh->ctx = ctx;
+	if(ctx == NULL) {
+
+		sh->ctx = smallsh_ctx_new();
+		sh->ownsCtx = 1;
+	}
+	sh->backgroundJobs = calloc(MAX_FORKS, sizeof(struct smallsh_background));
+	sh->finishedJobs = calloc(MAX_FORKS, sizeof(struct smallsh_finished));
+	sh->varBuckets = calloc(NAME_BUCKETS, sizeof(struct smallsh_var *));
+	sh->functionBuckets = calloc(NAME_BUCKETS, sizeof(struct smallsh_function *));
+	sh->arg0 = "smallsh";
+	smallsh_path_init(&sh->paths);
+	smallsh_psi_init(&sh->psi);
+
+	timingPath = getenv("SMALLSH_TIMING");
+	if(timingPath != NULL && timingPath[0] != '\0') {
+		sh->timing = fopen(timingPath, "we");
+	}
+	pstat_log(sh);
+	return sh;
+}
+
+
+void smallsh_shell_free (struct smallsh_shell *sh) {
+
+	struct smallsh_var *var;
+	struct smallsh_function *function;
+	struct smallsh_sourced *sourced;
+	int i;
+
+	while((var = sh->vars) != NULL) {
+
+		sh->vars = var->next;
+		free(var->name);
+		free(var->value);
+		free(var);
+	}
+
+	while(sh->coprocs != NULL) {
+		drop_coproc(sh, sh->coprocs);
+	}
+
+	while((function = sh->functions) != NULL) {
+
+		sh->functions = function->next;
+		free(function->name);
+		free(function);
+	}
+
+	while(sh->sourced != NULL) {
+
+		sourced = sh->sourced;
+		sh->sourced = sourced->next;
+		smallsh_arena_free(sourced->arena);
+		free(sourced->arena);
+		free(sourced);
+	}
+
+	for(i = 0; i < sh->numKeptArenas; i++) {
+
+		smallsh_arena_free(sh->keptArenas[i]);
+		free(sh->keptArenas[i]);
+	}
+	free(sh->keptArenas);
+
+	for(i = 0; i < sh->numBGProcesses; i++) {
+
+		smallsh_job_release(sh->backgroundJobs[i].job);
+		free(sh->backgroundJobs[i].command);
+	}
+	free(sh->backgroundJobs);
+	free(sh->finishedJobs);
+	free(sh->varBuckets);
+	free(sh->functionBuckets);
+	smallsh_path_free(&sh->paths);
+	smallsh_psi_free(&sh->psi);
+	free(sh->badSubstitution);
+	if(sh->timing != NULL) {
+		fclose(sh->timing);
+	}
+	if(sh->pstatLog != NULL) {
+		fclose(sh->pstatLog);
+	}
+	free(sh->pstatPath);
+
+	if(sh->ownsCtx) {
+		smallsh_ctx_free(sh->ctx);
+	}
+	free(sh);
+}
+
+
+void smallsh_shell_set_args (struct smallsh_shell *sh, char *arg0, int numParams, char *params[]) {
+
+	sh->arg0 = arg0;
+	sh->numParams = numParams;
+	sh->params = params;
+}
+
+
+int smallsh_shell_exec (struct smallsh_shell *sh, struct smallsh_node *program, struct smallsh_arena *arena) {
+
+	sh->keepArena = 0;
+	sh->exiting = 0;
+
+	/* Only top-level commands are journaled, not $(...) bodies */
+	if(sh->journal != NULL && sh->substitutionDepth == 0 && program->type == NODE_LIST) {
+		exec_journaled(sh, program);
+	}
+	else {
+		exec_node(sh, program);
+	}
+
+	/* Function bodies point into the arena */
+	if(sh->keepArena) {
+
+		sh->keptArenas = realloc(sh->keptArenas, (sh->numKeptArenas + 1) * sizeof(struct smallsh_arena *));
+		sh->keptArenas[sh->numKeptArenas++] = arena;
+	}
+	else {
+
+		smallsh_arena_free(arena);
+		free(arena);
+	}
+	return exit_code(sh);
+}
+
+
+int smallsh_shell_run (struct smallsh_shell *sh, const char *name, const char *source) {
+
+	struct smallsh_arena *arena = malloc(sizeof(struct smallsh_arena));
+	struct smallsh_parse_error error;
+	struct smallsh_node *program;
+
+	smallsh_arena_init(arena);
+
+	program = smallsh_parse(arena, source, &error);
+	if(program == NULL) {
+
+		fprintf(stderr, "smallsh: %s: line %d: %s\n", name, error.line, error.message);
+		fflush(stderr);
+		smallsh_arena_free(arena);
+		free(arena);
+		sh->status = 2;
+		return 2;
+	}
+
+	return smallsh_shell_exec(sh, program, arena);
+}
+
+
+int smallsh_shell_exiting (struct smallsh_shell *sh) {
+
+	return sh->exiting;
+}
+
+
+void smallsh_shell_set_journal (struct smallsh_shell *sh, struct smallsh_journal *journal) {
+
+	sh->journal = journal;
+}
+
+
+int smallsh_shell_job_control (struct smallsh_shell *sh, int terminal) {
+
+	struct sigaction handling;
+	pid_t foreground;
+	pid_t group;
+
+	if(!isatty(terminal)) {
+		return -1;
+	}
+
+	/*
+	 * Started in the background: wait to be
+	 * brought to the foreground. A terminal
+	 * that is not the controlling one, as
+	 * under setsid, has no foreground group.
+	 */
+	while((foreground = tcgetpgrp(terminal)) != (group = getpgrp())) {
+
+		if(foreground == -1) {
+			return -1;
+		}
+		kill(-group, SIGTTIN);
+	}
+
+	sigemptyset(&(handling.sa_mask));
+	handling.sa_flags = 0;
+	handling.sa_handler = SIG_IGN;
+	sigaction(SIGTSTP, &handling, NULL);
+	sigaction(SIGTTIN, &handling, NULL);
+	sigaction(SIGTTOU, &handling, NULL);
+
+	if(group != getpid() && setpgid(0, 0) == -1) {
+
+		perror("setpgid");
+		return -1;
+	}
+	sh->shellGroup = getpid();
+	tcsetpgrp(terminal, sh->shellGroup);
+	tcgetattr(terminal, &sh->shellModes);
+
+	sh->terminal = terminal;
+	sh->jobControl = 1;
+	return 0;
+}
+
+
+void smallsh_shell_notify (struct smallsh_shell *sh) {
+
+	smallsh_ctx_dispatch(sh->ctx, 0);
+}
+
+
+struct completion {
+
+	char **matches;
+	int numMatches;
+	int capacity;
+	const char *lead;			//Typed text kept in front of each name, as typed
+	size_t leadLength;
+};
+
+
+/*
+ * Adds lead plus name, with characters the
+ * parser treats specially escaped.
+ */
+static void add_match (void *data, const char *name) {
+
+	struct completion *c = data;
+	size_t length = strlen(name);
+	char *match;
+	char *out;
+
+	if(c->numMatches == c->capacity) {
+
+		c->capacity = c->capacity ? c->capacity * 2 : 64;
+		c->matches = realloc(c->matches, c->capacity * sizeof(char *));
+	}
+
+	match = malloc(c->leadLength + 2 * length + 1);
+	memcpy(match, c->lead, c->leadLength);
+	out = match + c->leadLength;
+
+	for(; *name != '\0'; name++) {
+
+		if(strchr(" \t\n;&|<>()'\"\\$`*?[", *name) != NULL) {
+			*out++ = '\\';
+		}
+		*out++ = *name;
+	}
+	*out = '\0';
+
+	c->matches[c->numMatches++] = match;
+}
+
+
+static int compare_matches (const void *a, const void *b) {
+
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/*
+ * Merges the sorted runs matches[0..middle)
+ * and matches[middle..end).
+ */
+static void merge_matches (char **matches, int middle, int end) {
+
+	char **left = malloc(middle * sizeof(char *));
+	int i = 0;
+	int j = middle;
+	int k = 0;
+
+	memcpy(left, matches, middle * sizeof(char *));
+
+	while(i < middle) {
+
+		if(j < end && strcmp(matches[j], left[i]) < 0) {
+			matches[k++] = matches[j++];
+		}
+		else {
+			matches[k++] = left[i++];
+		}
+	}
+	free(left);
+}
+
+
+/*
+ * True if the word starting at position in
+ * line is a command name: first on the line,
+ * after an operator or after a reserved word
+ * that starts a command.
+ */
+static int command_position (const char *line, size_t position) {
+
+	static const char *const STARTERS[] = { "if", "then", "elif", "else", "while", "until", "do", "!", "{", NULL };
+	size_t end;
+	int i;
+
+	while(position > 0 && isblank((unsigned char)line[position - 1])) {
+		position--;
+	}
+	if(position == 0 || strchr(";&|()\n", line[position - 1]) != NULL) {
+		return 1;
+	}
+
+	end = position;
+	while(position > 0 && !isspace((unsigned char)line[position - 1]) && strchr(";&|()", line[position - 1]) == NULL) {
+		position--;
+	}
+
+	for(i = 0; STARTERS[i] != NULL; i++) {
+
+		if(strlen(STARTERS[i]) == end - position && !strncmp(line + position, STARTERS[i], end - position)) {
+			return command_position(line, position);
+		}
+	}
+	return 0;
+}
+
+
+int smallsh_shell_complete (struct smallsh_shell *sh, const char *line, size_t cursor, size_t *wordStart, char ***matches) {
+
+	struct completion c;
+	struct smallsh_function *function;
+	char *word;
+	char *out;
+	char *slash;
+	char *directory;
+	const char *home;
+	size_t start = cursor;
+	size_t length;
+	int numUnsorted = 0;
+	int i;
+	int j;
+
+	/* The word ends at the cursor and may contain escaped blanks */
+	while(start > 0 && (strchr(" \t\n;&|<>()", line[start - 1]) == NULL || (start > 1 && line[start - 2] == '\\'))) {
+		start--;
+	}
+	*wordStart = start;
+	*matches = NULL;
+
+	/* Match against the word with its quoting removed */
+	word = malloc(cursor - start + 1);
+	for(out = word, i = start; i < (int)cursor; i++) {
+
+		if(line[i] == '\\' && i + 1 < (int)cursor) {
+			*out++ = line[++i];
+		}
+		else if(line[i] != '\'' && line[i] != '"') {
+			*out++ = line[i];
+		}
+	}
+	*out = '\0';
+
+	memset(&c, 0, sizeof(c));
+
+	if(word[0] == '$') {
+
+		free(word);
+		return 0;
+	}
+
+	if(strchr(word, '/') == NULL && command_position(line, start)) {
+
+		length = strlen(word);
+
+		for(i = 0; BUILTINS[i].name != NULL; i++) {
+
+			if(!strncmp(BUILTINS[i].name, word, length)) {
+				add_match(&c, BUILTINS[i].name);
+			}
+		}
+		for(function = sh->functions; function != NULL; function = function->next) {
+
+			if(!strncmp(function->name, word, length)) {
+				add_match(&c, function->name);
+			}
+		}
+
+		numUnsorted = c.numMatches;
+		smallsh_path_refresh(&sh->paths, getenv("PATH"));
+		smallsh_path_each(&sh->paths, word, add_match, &c);
+	}
+	else {
+
+		/*
+		 * Complete the part after the last slash
+		 * from a listing of the part before it.
+		 */
+		slash = strrchr(word, '/');
+		c.lead = line + start;
+		c.leadLength = slash != NULL ? (size_t)((const char *)memrchr(c.lead, '/', cursor - start) - c.lead) + 1 : 0;
+
+		if(slash == NULL) {
+			directory = strdup(".");
+		}
+		else if(slash == word) {
+			directory = strdup("/");
+		}
+		else if(word[0] == '~' && word + 1 == slash && (home = getenv("HOME")) != NULL) {
+			directory = strdup(home);
+		}
+		else if(!strncmp(word, "~/", 2) && (home = getenv("HOME")) != NULL) {
+
+			directory = malloc(strlen(home) + (slash - word));
+			sprintf(directory, "%s%.*s", home, (int)(slash - word - 1), word + 1);
+		}
+		else {
+			directory = strndup(word, slash - word);
+		}
+
+		smallsh_dir_each(&sh->paths, directory, slash != NULL ? slash + 1 : word, add_match, &c);
+		free(directory);
+	}
+
+	/*
+	 * The table and listings come out sorted,
+	 * so only builtins and functions need
+	 * sorting before the two are merged.
+	 */
+	if(numUnsorted > 0) {
+
+		qsort(c.matches, numUnsorted, sizeof(char *), compare_matches);
+		merge_matches(c.matches, numUnsorted, c.numMatches);
+	}
+
+	if(c.numMatches > 1) {
+
+		for(i = 1, j = 1; i < c.numMatches; i++) {
+
+			if(!strcmp(c.matches[i], c.matches[j - 1])) {
+				free(c.matches[i]);
+			}
+			else {
+				c.matches[j++] = c.matches[i];
+			}
+		}
+		c.numMatches = j;
+	}
+
+	free(word);
+	*matches = c.matches;
+	return c.numMatches;
+}
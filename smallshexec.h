@@ -0,0 +1,251 @@
+/*
+ * Internal state of a libsmallsh shell,
+ * shared by the modules that implement
+ * the interpreter and its builtins.
+ * Programs using the library only need
+ * smallshlib.h.
+ */
+
+#ifndef SMALLSHEXEC_H
+#define SMALLSHEXEC_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+#include <termios.h>
+#include "smallshlib.h"
+#include "smallshparse.h"
+#include "smallshpath.h"
+#include "smallshjournal.h"
+#include "smallshpsi.h"
+
+extern const int MAX_FORKS;
+extern const int SIGNAL_KILLED;
+extern const int NAME_BUCKETS;
+
+
+struct smallsh_var {
+
+	char *name;
+	char *value;
+	int exported;
+	struct smallsh_var *next;
+	struct smallsh_var *hashNext;			//Next in the same bucket
+};
+
+/*
+ * A background job as listed by jobs.
+ */
+struct smallsh_background {
+
+	struct smallsh_job *job;
+	int id;									//Job number, [1], [2]...
+	char *command;
+	int stopped;
+	int hasModes;							//Terminal modes it stopped with, for fg
+	struct termios modes;
+};
+
+/*
+ * A coprocess started by coproc: a
+ * background job whose standard input and
+ * output are pipes held by the shell.
+ * Output read past a reply is kept in
+ * buffer for the next one.
+ */
+struct smallsh_coproc {
+
+	char *name;
+	struct smallsh_job *job;
+	int input;								//Write end of its standard input
+	int output;								//Read end of its standard output
+	char *buffer;
+	size_t buffered;
+	size_t capacity;
+	struct smallsh_coproc *next;
+};
+
+/*
+ * A file run by source, kept parsed while
+ * its size and modification time stay the
+ * same.
+ */
+struct smallsh_sourced {
+
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	struct timespec mtime;
+	struct smallsh_arena *arena;
+	struct smallsh_node *program;
+	struct smallsh_sourced *next;
+};
+
+/*
+ * A background job that finished and has
+ * not been collected by wait.
+ */
+struct smallsh_finished {
+
+	pid_t pid;
+	int id;
+	int status;								//As $? would show it
+};
+
+struct smallsh_function {
+
+	char *name;
+	struct smallsh_node *body;
+	struct smallsh_function *next;
+	struct smallsh_function *hashNext;
+};
+
+
+/*
+ * Everything the shell tracks between
+ * commands.
+ */
+struct smallsh_shell {
+
+	/*
+	 * Track exit status
+	 * and the signal number
+	 * of the signal that
+	 * killed the last foreground
+	 * process.
+	 */
+	int status;
+	int signalNum;
+
+	/*
+	 * Jobs are started through ctx, which
+	 * also counts the running children for
+	 * fork bomb prevention. Background jobs
+	 * are kept in backgroundJobs, oldest
+	 * first, until the context reaps them.
+	 * Then they move to finishedJobs until
+	 * wait collects them, keeping at most
+	 * MAX_FORKS.
+	 */
+	struct smallsh_ctx *ctx;
+	int ownsCtx;
+	struct smallsh_background *backgroundJobs;
+	int numBGProcesses;
+	pid_t lastBackgroundPID;
+	struct smallsh_finished *finishedJobs;
+	int numFinished;
+	struct smallsh_coproc *coprocs;
+
+	/*
+	 * Variables and functions are listed
+	 * for walking, and hashed by name into
+	 * NAME_BUCKETS chains for lookup, so an
+	 * rc file defining thousands of them
+	 * does not take quadratic time.
+	 */
+	struct smallsh_var *vars;
+	struct smallsh_function *functions;
+	struct smallsh_var **varBuckets;
+	struct smallsh_function **functionBuckets;
+
+	/* Commands in PATH, for exec and completion */
+	struct smallsh_path_table paths;
+
+	/* Positional parameters $0, $1... */
+	char *arg0;
+	int numParams;
+	char **params;
+
+	/*
+	 * Control flow requests. A nonzero count
+	 * unwinds that many enclosing loops;
+	 * returning unwinds to the function call,
+	 * and exiting all the way out of the run.
+	 */
+	int breakCount;
+	int continueCount;
+	int returning;
+	int exiting;
+	int loopDepth;
+	int callDepth;
+	int sourceDepth;
+
+	/*
+	 * Set when a function is defined so the
+	 * arena holding its body is kept.
+	 */
+	int keepArena;
+	struct smallsh_arena **keptArenas;
+	int numKeptArenas;
+
+	/* Files parsed by source */
+	struct smallsh_sourced *sourced;
+
+	/* Command substitutions run so far */
+	int numSubstitutions;
+
+	/*
+	 * The first ${...} of the last expansion
+	 * that is not a form smallsh supports, to
+	 * be reported and fail the command.
+	 */
+	char *badSubstitution;
+
+	/*
+	 * Set in forked subshells, which exit
+	 * instead of returning to a prompt.
+	 */
+	int isSubshell;
+
+	/*
+	 * Depth of $(...) bodies running in this
+	 * process, where exit ends only the
+	 * substitution.
+	 */
+	int substitutionDepth;
+
+	/*
+	 * Job control, on for an interactive shell
+	 * on a terminal: every job leads a process
+	 * group, and a foreground job is given the
+	 * terminal while it runs, so Ctrl-Z stops
+	 * it alone. Background jobs lead their own
+	 * groups either way.
+	 */
+	int jobControl;
+	int terminal;
+	pid_t shellGroup;
+	struct termios shellModes;
+
+	/*
+	 * With SMALLSH_TIMING set to a file name,
+	 * the time each simple command took, in
+	 * nanoseconds, one per line.
+	 */
+	FILE *timing;
+
+	/*
+	 * With SMALLSH_PSTAT set to a file name,
+	 * the performance counters of each
+	 * foreground external command, one line
+	 * of name=value fields per command. The
+	 * name it was opened for is kept so a
+	 * change to the variable is noticed.
+	 */
+	FILE *pstatLog;
+	char *pstatPath;
+
+	/*
+	 * With --journal, where finished top-level
+	 * commands are recorded.
+	 */
+	struct smallsh_journal *journal;
+
+	/*
+	 * With SMALLSH_PSI set, background launches
+	 * wait while the system is under pressure.
+	 */
+	struct smallsh_psi psi;
+};
+
+#endif
@@ -0,0 +1,646 @@
+/*
+ * Job launcher for libsmallsh. See
+ * smallshlib.h.
+ *
+ * Commands are started with posix_spawn,
+ * which is safe in threaded programs, and
+ * each job gets a pidfd that is registered
+ * with the context's epoll descriptor, so
+ * completion can be polled for without
+ * SIGCHLD. The job list is guarded by the
+ * context's mutex; children are reaped with
+ * wait4 to collect their resource usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include "smallshlib.h"
+
+extern char **environ;
+
+
+struct smallsh_job {
+
+	struct smallsh_ctx *ctx;
+	pid_t pid;
+	int pidfd;
+	int done;
+	int waitStatus;
+	struct rusage usage;
+
+	/*
+	 * One reference for the caller's handle
+	 * and one for the context until the job
+	 * is reaped.
+	 */
+	int refs;
+
+	smallsh_job_callback onComplete;
+	void *data;
+
+	struct smallsh_job *next;
+	struct smallsh_job *prev;
+};
+
+struct smallsh_ctx {
+
+	pthread_mutex_t lock;
+	int epollFd;
+	int numRunning;
+	struct smallsh_job *running;
+};
+
+
+static int open_pidfd (pid_t pid) {
+
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+struct smallsh_ctx *smallsh_ctx_new (void) {
+
+	struct smallsh_ctx *ctx = calloc(1, sizeof(struct smallsh_ctx));
+
+	if(ctx == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if(ctx->epollFd == -1) {
+
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+
+/*
+ * Drops a reference, freeing the job when
+ * the last one goes. Called with the lock
+ * held.
+ */
+static void unref_locked (struct smallsh_job *job) {
+
+	if(--job->refs == 0) {
+		free(job);
+	}
+}
+
+
+static void untrack_locked (struct smallsh_ctx *ctx, struct smallsh_job *job) {
+
+	if(job->pidfd != -1) {
+
+		epoll_ctl(ctx->epollFd, EPOLL_CTL_DEL, job->pidfd, NULL);
+		close(job->pidfd);
+		job->pidfd = -1;
+	}
+
+	if(job->prev != NULL) {
+		job->prev->next = job->next;
+	}
+	else {
+		ctx->running = job->next;
+	}
+	if(job->next != NULL) {
+		job->next->prev = job->prev;
+	}
+	job->next = NULL;
+	job->prev = NULL;
+	ctx->numRunning--;
+}
+
+
+void smallsh_ctx_free (struct smallsh_ctx *ctx) {
+
+	struct smallsh_job *job;
+
+	pthread_mutex_lock(&ctx->lock);
+	while((job = ctx->running) != NULL) {
+
+		untrack_locked(ctx, job);
+		unref_locked(job);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	close(ctx->epollFd);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+
+void smallsh_ctx_after_fork (struct smallsh_ctx *ctx) {
+
+	struct smallsh_job *job;
+	struct smallsh_job *next;
+
+	/*
+	 * The mutex may have been held by another
+	 * thread at the fork, so start over with a
+	 * new one rather than locking it.
+	 */
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	for(job = ctx->running; job != NULL; job = next) {
+
+		next = job->next;
+		if(job->pidfd != -1) {
+			close(job->pidfd);
+		}
+
+		/* The parent's handles to these jobs stay valid there */
+		job->pidfd = -1;
+		job->done = 1;
+		job->next = NULL;
+		job->prev = NULL;
+	}
+	ctx->running = NULL;
+	ctx->numRunning = 0;
+
+	close(ctx->epollFd);
+	ctx->epollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+
+int smallsh_ctx_fd (struct smallsh_ctx *ctx) {
+
+	return ctx->epollFd;
+}
+
+
+int smallsh_ctx_running (struct smallsh_ctx *ctx) {
+
+	int numRunning;
+
+	pthread_mutex_lock(&ctx->lock);
+	numRunning = ctx->numRunning;
+	pthread_mutex_unlock(&ctx->lock);
+	return numRunning;
+}
+
+
+static struct smallsh_job *track (struct smallsh_ctx *ctx, pid_t pid, smallsh_job_callback onComplete, void *data) {
+
+	struct smallsh_job *job = calloc(1, sizeof(struct smallsh_job));
+	struct epoll_event event;
+
+	if(job == NULL) {
+		return NULL;
+	}
+
+	job->ctx = ctx;
+	job->pid = pid;
+	job->refs = 2;
+	job->onComplete = onComplete;
+	job->data = data;
+	job->pidfd = open_pidfd(pid);
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if(job->pidfd != -1) {
+
+		/*
+		 * The event carries the PID rather than the
+		 * job, which another thread may free.
+		 */
+		event.events = EPOLLIN;
+		event.data.u64 = pid;
+		epoll_ctl(ctx->epollFd, EPOLL_CTL_ADD, job->pidfd, &event);
+	}
+
+	job->next = ctx->running;
+	if(ctx->running != NULL) {
+		ctx->running->prev = job;
+	}
+	ctx->running = job;
+	ctx->numRunning++;
+
+	pthread_mutex_unlock(&ctx->lock);
+	return job;
+}
+
+
+struct smallsh_job *smallsh_job_adopt (struct smallsh_ctx *ctx, pid_t pid, smallsh_job_callback onComplete, void *data) {
+
+	return track(ctx, pid, onComplete, data);
+}
+
+
+/*
+ * Copies the environment with the
+ * NAME=value overrides applied.
+ */
+static char **build_environment (char *const *overrides) {
+
+	char **envp;
+	size_t numEnv = 0;
+	size_t numOverrides = 0;
+	size_t nameLength;
+	size_t i;
+	size_t j;
+
+	while(environ[numEnv] != NULL) {
+		numEnv++;
+	}
+	while(overrides[numOverrides] != NULL) {
+		numOverrides++;
+	}
+
+	envp = malloc((numEnv + numOverrides + 1) * sizeof(char *));
+	if(envp == NULL) {
+		return NULL;
+	}
+	memcpy(envp, environ, numEnv * sizeof(char *));
+
+	for(i = 0; i < numOverrides; i++) {
+
+		nameLength = strcspn(overrides[i], "=") + 1;
+
+		for(j = 0; j < numEnv; j++) {
+
+			if(!strncmp(envp[j], overrides[i], nameLength)) {
+				break;
+			}
+		}
+		envp[j] = overrides[i];
+		if(j == numEnv) {
+			numEnv++;
+		}
+	}
+	envp[numEnv] = NULL;
+	return envp;
+}
+
+
+struct smallsh_job *smallsh_spawn (struct smallsh_ctx *ctx, const struct smallsh_job_spec *spec) {
+
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	const struct smallsh_fd_action *action;
+	struct smallsh_job *job;
+	sigset_t signals;
+	char **envp = environ;
+	pid_t pid;
+	int error = 0;
+	int i;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attributes);
+
+	if(spec->cwd != NULL) {
+		error = posix_spawn_file_actions_addchdir_np(&actions, spec->cwd);
+	}
+
+	for(i = 0; i < spec->numActions && !error; i++) {
+
+		action = &spec->actions[i];
+
+		switch(action->type) {
+
+			case SMALLSH_FD_OPEN:
+				error = posix_spawn_file_actions_addopen(&actions, action->fd, action->path, action->flags, action->mode);
+				break;
+
+			case SMALLSH_FD_DUP:
+				error = posix_spawn_file_actions_adddup2(&actions, action->source, action->fd);
+				break;
+
+			default:
+				error = posix_spawn_file_actions_addclose(&actions, action->fd);
+				break;
+		}
+	}
+
+	/*
+	 * The child starts with nothing blocked
+	 * and SIGPIPE and the job control stops at
+	 * their defaults, plus SIGINT if asked.
+	 */
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attributes, &signals);
+	sigaddset(&signals, SIGPIPE);
+	sigaddset(&signals, SIGTSTP);
+	sigaddset(&signals, SIGTTIN);
+	sigaddset(&signals, SIGTTOU);
+	if(spec->flags & SMALLSH_SPAWN_DEFAULT_SIGINT) {
+		sigaddset(&signals, SIGINT);
+	}
+	posix_spawnattr_setsigdefault(&attributes, &signals);
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF
+			| (spec->flags & SMALLSH_SPAWN_NEW_GROUP ? POSIX_SPAWN_SETPGROUP : 0));
+
+	if(spec->env != NULL && !error) {
+
+		envp = build_environment(spec->env);
+		if(envp == NULL) {
+			error = ENOMEM;
+		}
+	}
+
+	/*
+	 * A resolved path may be stale, so fall
+	 * back to searching PATH if it is gone.
+	 */
+	if(!error && spec->path != NULL) {
+
+		error = posix_spawn(&pid, spec->path, &actions, &attributes, spec->argv, envp);
+		if(error == ENOENT || error == EACCES || error == ENOTDIR) {
+			error = posix_spawnp(&pid, spec->argv[0], &actions, &attributes, spec->argv, envp);
+		}
+	}
+	else if(!error) {
+		error = posix_spawnp(&pid, spec->argv[0], &actions, &attributes, spec->argv, envp);
+	}
+
+	if(envp != environ) {
+		free(envp);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+
+	if(error) {
+
+		errno = error;
+		return NULL;
+	}
+
+	job = track(ctx, pid, spec->onComplete, spec->data);
+	if(job == NULL) {
+
+		/* Cannot track it, so do not leave it running */
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		errno = ENOMEM;
+	}
+	return job;
+}
+
+
+pid_t smallsh_job_pid (struct smallsh_job *job) {
+
+	return job->pid;
+}
+
+
+int smallsh_job_fd (struct smallsh_job *job) {
+
+	return job->pidfd;
+}
+
+
+/*
+ * Reaps the job if it has finished. Returns
+ * 1 if this call reaped it. Called with the
+ * lock held.
+ */
+static int reap_locked (struct smallsh_job *job) {
+
+	pid_t result;
+
+	if(job->done) {
+		return 0;
+	}
+
+	result = wait4(job->pid, &job->waitStatus, WNOHANG, &job->usage);
+
+	if(result == 0 || (result == -1 && errno == EINTR)) {
+		return 0;
+	}
+
+	/* Reaped elsewhere: report it as lost */
+	if(result == -1) {
+		job->waitStatus = 127 << 8;
+	}
+
+	job->done = 1;
+	untrack_locked(job->ctx, job);
+	return 1;
+}
+
+
+/*
+ * Runs the callback of a job this thread
+ * reaped, then drops the context's
+ * reference to it.
+ */
+static void complete (struct smallsh_job *job) {
+
+	struct smallsh_ctx *ctx = job->ctx;
+
+	if(job->onComplete != NULL) {
+		job->onComplete(job, job->data);
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	unref_locked(job);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+
+int smallsh_ctx_dispatch (struct smallsh_ctx *ctx, int timeoutMs) {
+
+	struct epoll_event events[64];
+	struct smallsh_job *job;
+	struct smallsh_job *next;
+	struct smallsh_job *reaped = NULL;
+	int numEvents;
+	int numReaped = 0;
+	int hasPlainJobs;
+	int waited = 0;
+	int i;
+
+	for(;;) {
+
+		/* Counted again each pass, as plain jobs are reaped */
+		hasPlainJobs = 0;
+		pthread_mutex_lock(&ctx->lock);
+		for(job = ctx->running; job != NULL; job = job->next) {
+			hasPlainJobs |= job->pidfd == -1;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		/*
+		 * Jobs without a pidfd cannot be waited for
+		 * through epoll, so with any of those around
+		 * fall back to checking every few ms.
+		 */
+		numEvents = epoll_wait(ctx->epollFd, events, 64, hasPlainJobs && timeoutMs != 0 ? 10 : timeoutMs);
+		if(numEvents == -1 && errno == EINTR) {
+			continue;
+		}
+
+		/*
+		 * Reap the jobs with events, and every job
+		 * without a pidfd. The reaped ones are
+		 * chained through prev, which untracking
+		 * leaves free.
+		 */
+		pthread_mutex_lock(&ctx->lock);
+		for(job = ctx->running; job != NULL; job = next) {
+
+			next = job->next;
+
+			for(i = 0; i < numEvents && job->pidfd != -1; i++) {
+
+				if(events[i].data.u64 == (uint64_t)job->pid) {
+					break;
+				}
+			}
+
+			if((job->pidfd == -1 || i < numEvents) && reap_locked(job)) {
+
+				job->prev = reaped;
+				reaped = job;
+			}
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		waited += 10;
+		if(reaped != NULL || !hasPlainJobs || timeoutMs == 0 || (timeoutMs > 0 && waited >= timeoutMs)) {
+			break;
+		}
+	}
+
+	while(reaped != NULL) {
+
+		job = reaped;
+		reaped = job->prev;
+		job->prev = NULL;
+		complete(job);
+		numReaped++;
+	}
+	return numReaped;
+}
+
+
+/*
+ * True once the job has been reaped, which
+ * may happen on another thread.
+ */
+static int is_done (struct smallsh_job *job) {
+
+	int done;
+
+	pthread_mutex_lock(&job->ctx->lock);
+	done = job->done;
+	pthread_mutex_unlock(&job->ctx->lock);
+	return done;
+}
+
+
+/*
+ * Blocks until the job exits, or with
+ * WSTOPPED in options until it stops.
+ * Returns the stop's wait status for a
+ * stop, which is taken so it is seen once.
+ */
+static int wait_job (struct smallsh_job *job, int options) {
+
+	siginfo_t info;
+	int waitStatus;
+	int reaped;
+
+	/*
+	 * Wait without reaping, so the reap itself
+	 * happens under the lock with the rusage.
+	 */
+	while(!is_done(job)) {
+
+		if(waitid(P_PID, job->pid, &info, WEXITED | WNOWAIT | options) == -1) {
+
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if(info.si_code == CLD_STOPPED) {
+
+			info.si_pid = 0;
+			waitid(P_PID, job->pid, &info, WSTOPPED | WNOHANG);
+			if(info.si_pid == job->pid) {
+				return W_STOPCODE(info.si_status);
+			}
+			continue;
+		}
+		break;
+	}
+
+	pthread_mutex_lock(&job->ctx->lock);
+	reaped = reap_locked(job);
+	waitStatus = job->waitStatus;
+	pthread_mutex_unlock(&job->ctx->lock);
+
+	if(reaped) {
+		complete(job);
+	}
+	return waitStatus;
+}
+
+
+int smallsh_job_wait (struct smallsh_job *job) {
+
+	return wait_job(job, 0);
+}
+
+
+int smallsh_job_wait_stop (struct smallsh_job *job) {
+
+	return wait_job(job, WSTOPPED);
+}
+
+
+void smallsh_job_set_callback (struct smallsh_job *job, smallsh_job_callback onComplete, void *data) {
+
+	pthread_mutex_lock(&job->ctx->lock);
+	job->onComplete = onComplete;
+	job->data = data;
+	pthread_mutex_unlock(&job->ctx->lock);
+}
+
+
+int smallsh_job_status (struct smallsh_job *job, int *waitStatus, struct rusage *usage) {
+
+	int done;
+
+	pthread_mutex_lock(&job->ctx->lock);
+	done = job->done;
+	if(done && waitStatus != NULL) {
+		*waitStatus = job->waitStatus;
+	}
+	if(done && usage != NULL) {
+		*usage = job->usage;
+	}
+	pthread_mutex_unlock(&job->ctx->lock);
+	return done;
+}
+
+
+void smallsh_job_release (struct smallsh_job *job) {
+
+	struct smallsh_ctx *ctx = job->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	unref_locked(job);
+	pthread_mutex_unlock(&ctx->lock);
+}
@@ -0,0 +1,201 @@
+/*
+ * Progress journal for smallsh scripts.
+ * See smallshjournal.h.
+ *
+ * The file is an 8 byte magic followed by
+ * records in native byte order. A record cut
+ * short by a crash is ignored on resume and
+ * overwritten.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "smallshjournal.h"
+
+const char JOURNAL_MAGIC[8] = "sjrnl01\n";
+const int JOURNAL_BATCH_MS = 200;
+const uint64_t JOURNAL_HASH_START = 14695981039346656037ULL;
+
+
+uint64_t smallsh_journal_hash (uint64_t hash, const void *data, size_t length) {
+
+	const unsigned char *bytes = data;
+	size_t i;
+
+	for(i = 0; i < length; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+static long long journal_clock (void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * Reads the records of an existing journal.
+ * Returns -1 if the file is not one.
+ */
+static int read_records (struct smallsh_journal *journal) {
+
+	struct stat info;
+	char magic[sizeof(JOURNAL_MAGIC)];
+	size_t length;
+
+	if(fstat(journal->fd, &info) == -1) {
+		return -1;
+	}
+	if(info.st_size == 0) {
+		return 0;
+	}
+	if(pread(journal->fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, JOURNAL_MAGIC, sizeof(magic))) {
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	journal->numDone = (info.st_size - sizeof(magic)) / sizeof(struct smallsh_journal_record);
+	length = journal->numDone * sizeof(struct smallsh_journal_record);
+	journal->done = malloc(length + 1);
+	if(pread(journal->fd, journal->done, length, sizeof(magic)) != (ssize_t)length) {
+		return -1;
+	}
+	return 0;
+}
+
+
+struct smallsh_journal *smallsh_journal_open (const char *path, int resume) {
+
+	struct smallsh_journal *journal = calloc(1, sizeof(struct smallsh_journal));
+	int saved;
+
+	journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0666);
+	if(journal->fd == -1 || (resume && read_records(journal) == -1)) {
+
+		saved = errno;
+		smallsh_journal_close(journal);
+		errno = saved;
+		return NULL;
+	}
+
+	journal->resuming = journal->numDone > 0;
+
+	/* Writes go after the whole records, over any torn one */
+	if(ftruncate(journal->fd, sizeof(JOURNAL_MAGIC) + journal->numDone * sizeof(struct smallsh_journal_record)) == -1 ||
+			pwrite(journal->fd, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC), 0) != sizeof(JOURNAL_MAGIC) ||
+			lseek(journal->fd, 0, SEEK_END) == -1) {
+
+		saved = errno;
+		smallsh_journal_close(journal);
+		errno = saved;
+		return NULL;
+	}
+	return journal;
+}
+
+
+int smallsh_journal_match (struct smallsh_journal *journal, int line, uint64_t hash, int *status) {
+
+	struct smallsh_journal_record *record;
+
+	if(!journal->resuming) {
+		return 0;
+	}
+
+	record = &journal->done[journal->numMatched];
+	if(record->line == (uint32_t)line && record->hash == hash) {
+
+		*status = record->status;
+		journal->numMatched++;
+		journal->resuming = journal->numMatched < journal->numDone;
+		return 1;
+	}
+
+	/* From here on the script runs again, and is journaled again */
+	journal->resuming = 0;
+	ftruncate(journal->fd, sizeof(JOURNAL_MAGIC) + journal->numMatched * sizeof(struct smallsh_journal_record));
+	lseek(journal->fd, 0, SEEK_END);
+	return 0;
+}
+
+
+void smallsh_journal_add (struct smallsh_journal *journal, int line, uint64_t hash, int status, long long elapsedMs) {
+
+	long long now = journal_clock();
+	struct smallsh_journal_record *record;
+
+	if(journal->numPending == journal->pendingCapacity) {
+
+		journal->pendingCapacity = journal->pendingCapacity ? journal->pendingCapacity * 2 : 64;
+		journal->pending = realloc(journal->pending, journal->pendingCapacity * sizeof(struct smallsh_journal_record));
+	}
+	if(journal->numPending == 0) {
+		journal->oldestPending = now;
+	}
+
+	record = &journal->pending[journal->numPending++];
+	memset(record, 0, sizeof(*record));
+	record->line = line;
+	record->hash = hash;
+	record->status = status;
+
+	if(elapsedMs >= JOURNAL_BATCH_MS || now - journal->oldestPending >= JOURNAL_BATCH_MS) {
+		smallsh_journal_sync(journal);
+	}
+}
+
+
+int smallsh_journal_sync (struct smallsh_journal *journal) {
+
+	const char *data = (const char *)journal->pending;
+	size_t left = journal->numPending * sizeof(struct smallsh_journal_record);
+	ssize_t written;
+
+	if(journal->numPending == 0) {
+		return 0;
+	}
+
+	while(left > 0) {
+
+		written = write(journal->fd, data, left);
+		if(written == -1) {
+
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("smallsh: journal");
+			return -1;
+		}
+		data += written;
+		left -= written;
+	}
+	journal->numPending = 0;
+	return fdatasync(journal->fd);
+}
+
+
+void smallsh_journal_close (struct smallsh_journal *journal) {
+
+	if(journal->fd != -1) {
+
+		smallsh_journal_sync(journal);
+		close(journal->fd);
+	}
+	free(journal->done);
+	free(journal->pending);
+	free(journal);
+}
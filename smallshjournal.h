@@ -0,0 +1,95 @@
+/*
+ * Progress journal for long scripts run
+ * with --journal. Each top-level command
+ * that finishes is recorded with its line,
+ * a hash of the command as it ran and its
+ * exit status. A rerun with --resume skips
+ * the commands that match the journal, in
+ * order, and carries on from the first that
+ * does not.
+ *
+ * Records are 16 bytes and are written and
+ * synced in batches: at once after a command
+ * that ran for JOURNAL_BATCH_MS or more, when
+ * a later command finishes and the oldest
+ * unsynced record is that old, and when the
+ * journal is closed. There is no timer, so a
+ * crash can lose the records of any number of
+ * quick commands since the last sync.
+ */
+
+#ifndef SMALLSHJOURNAL_H
+#define SMALLSHJOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern const int JOURNAL_BATCH_MS;
+
+
+struct smallsh_journal_record {
+
+	uint32_t line;
+	int32_t status;
+	uint64_t hash;
+};
+
+struct smallsh_journal {
+
+	int fd;
+
+	struct smallsh_journal_record *done;	//Read from the journal on resume
+	int numDone;
+	int numMatched;
+	int resuming;							//Cleared at the first mismatch
+
+	struct smallsh_journal_record *pending;	//Not yet written
+	int numPending;
+	int pendingCapacity;
+	long long oldestPending;				//CLOCK_MONOTONIC ms
+};
+
+
+/*
+ * FNV-1a, for building a command's hash
+ * a piece at a time from JOURNAL_HASH_START.
+ */
+extern const uint64_t JOURNAL_HASH_START;
+uint64_t smallsh_journal_hash (uint64_t hash, const void *data, size_t length);
+
+
+/*
+ * Opens the journal at path. Without
+ * resume it is started empty; with it the
+ * records already there are read so they
+ * can be matched. Returns NULL with errno
+ * set on error.
+ */
+struct smallsh_journal *smallsh_journal_open (const char *path, int resume);
+
+
+/*
+ * Returns 1 if the next journal record is
+ * for this command, setting its status, so
+ * it can be skipped. The first command that
+ * does not match ends resuming, and the
+ * records after the matched ones are cut off.
+ */
+int smallsh_journal_match (struct smallsh_journal *journal, int line, uint64_t hash, int *status);
+
+
+/*
+ * Records a command that finished after
+ * elapsedMs, syncing the batch if due.
+ */
+void smallsh_journal_add (struct smallsh_journal *journal, int line, uint64_t hash, int status, long long elapsedMs);
+
+
+/*
+ * Writes and syncs any pending records.
+ */
+int smallsh_journal_sync (struct smallsh_journal *journal);
+
+void smallsh_journal_close (struct smallsh_journal *journal);
+
+#endif
@@ -6,11 +6,12 @@
 #include <ctype.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include "smallshlib.h"
 
 
 const int KILLED_BY_SIGNAL = 500;
-const int MAX_PATH_LENGTH = 128;
+const int MAX_PATH_LENGTH = 4096;
 
 /*
  * Assign a different value to use
@@ -40,8 +41,7 @@ int smallsh_status (int status, int signalNum) {
 int smallsh_cd (int numArgs, char *userArgs[]) {
 
 	char *pathStep;
-	char *argTest;
-	char *previousDirectory;
+	char previousDirectory[MAX_PATH_LENGTH];
 	int status = 0;
 
 			/*
@@ -157,19 +157,19 @@ int smallsh_cd (int numArgs, char *userArgs[]) {
 	return status;
 }
 
-void smallsh_exit (int numProcesses, pid_t background[]) {
+void smallsh_stop_jobs (int numProcesses, pid_t background[]) {
 
 	int i;
 
-	/*
-	 * Kill all processes, then
-	 * the shell will exit.
-	 */
-
 	for(i = 0; i < numProcesses; i++) {
 
 		printf("Killing %ld\n", (long)background[i]);
-		kill(background[i], SIGTERM);
+
+		/* Each job leads a process group, which goes with it; stopped ones are woken to die */
+		if(killpg(background[i], SIGTERM) == -1) {
+			kill(background[i], SIGTERM);
+		}
+		killpg(background[i], SIGCONT);
 
 		/* Casting a pid_t as a long works according to
 		 *http://stackoverflow.com/questions/20533606/what-is-the-correct-printf-specifier-for-printing-pid-t
@@ -178,8 +178,176 @@ void smallsh_exit (int numProcesses, pid_t background[]) {
 		fflush(stdout);
 
 	}
-	exit(0);
 }
 
 
+void smallsh_exit (int numProcesses, pid_t background[], int exitStatus) {
+
+	/*
+	 * Kill all processes, then
+	 * the shell will exit.
+	 */
+	smallsh_stop_jobs(numProcesses, background);
+	exit(exitStatus);
+}
+
+
+
+
+
+int smallsh_echo (int numArgs, char *userArgs[]) {
+
+	int i = 0;
+	int newline = 1;
+
+	/* -n leaves off the trailing newline */
+	if(numArgs > 0 && !strcmp(userArgs[0], "-n")) {
+
+		newline = 0;
+		i++;
+	}
+
+	for(; i < numArgs; i++) {
+
+		fputs(userArgs[i], stdout);
+		if(i < numArgs - 1) {
+			putchar(' ');
+		}
+	}
+
+	if(newline) {
+		putchar('\n');
+	}
+	fflush(stdout);
+
+	return 0;
+}
+
+
+/*
+ * Evaluates a unary file or string
+ * test such as -f name or -z string.
+ */
+static int test_unary (const char *op, const char *operand) {
+
+	struct stat info;
+
+	if(!strcmp(op, "-z")) {
+		return operand[0] == '\0';
+	}
+	if(!strcmp(op, "-n")) {
+		return operand[0] != '\0';
+	}
+	if(!strcmp(op, "-L") || !strcmp(op, "-h")) {
+		return lstat(operand, &info) == 0 && S_ISLNK(info.st_mode);
+	}
+	if(!strcmp(op, "-r")) {
+		return access(operand, R_OK) == 0;
+	}
+	if(!strcmp(op, "-w")) {
+		return access(operand, W_OK) == 0;
+	}
+	if(!strcmp(op, "-x")) {
+		return access(operand, X_OK) == 0;
+	}
+
+	if(stat(operand, &info) != 0) {
+		return 0;
+	}
+	if(!strcmp(op, "-e")) {
+		return 1;
+	}
+	if(!strcmp(op, "-f")) {
+		return S_ISREG(info.st_mode);
+	}
+	if(!strcmp(op, "-d")) {
+		return S_ISDIR(info.st_mode);
+	}
+	if(!strcmp(op, "-s")) {
+		return info.st_size > 0;
+	}
+	return -1;
+}
+
+
+/*
+ * Evaluates a binary string or
+ * integer comparison.
+ */
+static int test_binary (const char *left, const char *op, const char *right) {
+
+	long leftNumber;
+	long rightNumber;
+
+	if(!strcmp(op, "=") || !strcmp(op, "==")) {
+		return !strcmp(left, right);
+	}
+	if(!strcmp(op, "!=")) {
+		return strcmp(left, right) != 0;
+	}
+
+	leftNumber = strtol(left, NULL, 10);
+	rightNumber = strtol(right, NULL, 10);
+
+	if(!strcmp(op, "-eq")) {
+		return leftNumber == rightNumber;
+	}
+	if(!strcmp(op, "-ne")) {
+		return leftNumber != rightNumber;
+	}
+	if(!strcmp(op, "-lt")) {
+		return leftNumber < rightNumber;
+	}
+	if(!strcmp(op, "-le")) {
+		return leftNumber <= rightNumber;
+	}
+	if(!strcmp(op, "-gt")) {
+		return leftNumber > rightNumber;
+	}
+	if(!strcmp(op, "-ge")) {
+		return leftNumber >= rightNumber;
+	}
+	return -1;
+}
+
+
+int smallsh_test (int numArgs, char *userArgs[]) {
+
+	int result;
+
+	/* ! negates the rest of the expression */
+	if(numArgs > 0 && !strcmp(userArgs[0], "!")) {
+
+		result = smallsh_test(numArgs - 1, userArgs + 1);
+		return result == 2 ? 2 : !result;
+	}
+
+	switch(numArgs) {
 
+		case 0:
+			return 1;
+
+		case 1:
+			return userArgs[0][0] == '\0';
+
+		case 2:
+			result = test_unary(userArgs[0], userArgs[1]);
+			break;
+
+		case 3:
+			result = test_binary(userArgs[0], userArgs[1], userArgs[2]);
+			break;
+
+		default:
+			result = -1;
+	}
+
+	if(result == -1) {
+
+		fprintf(stderr, "test: unsupported expression\n");
+		return 2;
+	}
+
+	/* true is status 0 */
+	return !result;
+}
@@ -1,14 +1,38 @@
 /*
- * Library for the built-in
- * functions of smallsh.c
+ * libsmallsh: the built-in functions,
+ * parser, job launcher and interpreter
+ * of smallsh, usable from other programs.
+ *
+ * The job functions (smallsh_ctx_* and
+ * smallsh_job_*, smallsh_spawn) are safe
+ * to call from several threads at once.
+ * A shell (smallsh_shell_*) changes process
+ * wide state such as the working directory
+ * and environment, so use each one from
+ * one thread at a time.
  */
 
+#ifndef SMALLSHLIB_H
+#define SMALLSHLIB_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "smallshparse.h"
+
 
 /*
- * Kills all background processes
- * before exiting.
+ * Kills all background jobs, each one's
+ * whole process group.
  */
-void smallsh_exit (int numProcesses, pid_t background[]);
+void smallsh_stop_jobs (int numProcesses, pid_t background[]);
+
+
+/*
+ * Kills all background jobs, as
+ * smallsh_stop_jobs, before exiting with
+ * exitStatus.
+ */
+void smallsh_exit (int numProcesses, pid_t background[], int exitStatus);
 
 
 /*
@@ -24,3 +48,280 @@ int smallsh_status(int status, int signalNum);
  */
 int smallsh_cd (int numArgs, char *userArgs[]);
 
+
+/*
+ * Prints the arguments separated by
+ * spaces. -n omits the newline.
+ */
+int smallsh_echo (int numArgs, char *userArgs[]);
+
+
+/*
+ * Evaluates a test expression, returning
+ * 0 for true, 1 for false and 2 for an
+ * unsupported expression.
+ */
+int smallsh_test (int numArgs, char *userArgs[]);
+
+
+/*
+ * Jobs. A context tracks the processes
+ * started through it. Each one is a job,
+ * which can be waited on directly, polled
+ * through the context's descriptor, or
+ * reported through a completion callback.
+ */
+
+struct smallsh_ctx;
+struct smallsh_job;
+
+typedef void (*smallsh_job_callback) (struct smallsh_job *job, void *data);
+
+
+/*
+ * One step of the descriptor table applied
+ * in the child before it executes.
+ */
+enum smallsh_fd_action_type {
+
+	SMALLSH_FD_OPEN,		//Open path with flags and mode onto fd
+	SMALLSH_FD_DUP,			//Copy source onto fd
+	SMALLSH_FD_CLOSE		//Close fd
+};
+
+struct smallsh_fd_action {
+
+	int type;
+	int fd;
+	int source;
+	const char *path;
+	int flags;
+	mode_t mode;
+};
+
+
+/*
+ * Flags for smallsh_job_spec.
+ */
+enum {
+
+	SMALLSH_SPAWN_DEFAULT_SIGINT = 1,	//Undo an ignored SIGINT in the child
+	SMALLSH_SPAWN_NEW_GROUP = 2			//Start the child in a process group of its own
+};
+
+struct smallsh_job_spec {
+
+	char *const *argv;						//Command and arguments, NULL terminated
+	const char *path;						//Resolved program, or NULL to search PATH
+	char *const *env;						//NAME=value overrides, or NULL
+	const char *cwd;						//Working directory, or NULL to inherit
+	const struct smallsh_fd_action *actions;
+	int numActions;
+	int flags;
+
+	/* Called once when the job is reaped, on the reaping thread */
+	smallsh_job_callback onComplete;
+	void *data;
+};
+
+
+struct smallsh_ctx *smallsh_ctx_new (void);
+
+
+/*
+ * Frees the context. Jobs still running
+ * are left running but no longer tracked.
+ */
+void smallsh_ctx_free (struct smallsh_ctx *ctx);
+
+
+/*
+ * A descriptor that polls readable while
+ * any job of the context has finished and
+ * not yet been reaped.
+ */
+int smallsh_ctx_fd (struct smallsh_ctx *ctx);
+
+
+/*
+ * Reaps every finished job and runs its
+ * callback. Waits up to timeoutMs for one
+ * to finish (-1 waits forever, 0 not at
+ * all). Returns the number reaped.
+ */
+int smallsh_ctx_dispatch (struct smallsh_ctx *ctx, int timeoutMs);
+
+
+/*
+ * Number of jobs not yet reaped.
+ */
+int smallsh_ctx_running (struct smallsh_ctx *ctx);
+
+
+/*
+ * In the child of a fork(), forgets the
+ * parent's jobs so the child can track
+ * its own.
+ */
+void smallsh_ctx_after_fork (struct smallsh_ctx *ctx);
+
+
+/*
+ * Starts a job without blocking on it.
+ * Returns NULL with errno set if the
+ * command could not be started.
+ */
+struct smallsh_job *smallsh_spawn (struct smallsh_ctx *ctx, const struct smallsh_job_spec *spec);
+
+
+/*
+ * Tracks a process the caller forked
+ * itself as a job.
+ */
+struct smallsh_job *smallsh_job_adopt (struct smallsh_ctx *ctx, pid_t pid, smallsh_job_callback onComplete, void *data);
+
+
+pid_t smallsh_job_pid (struct smallsh_job *job);
+
+
+/*
+ * A descriptor that polls readable once
+ * this job has finished, or -1 if the
+ * kernel has no pidfd support.
+ */
+int smallsh_job_fd (struct smallsh_job *job);
+
+
+/*
+ * Blocks until the job finishes and
+ * returns its wait status.
+ */
+int smallsh_job_wait (struct smallsh_job *job);
+
+
+/*
+ * Like smallsh_job_wait, but also returns
+ * when the job is stopped by a signal,
+ * with a WIFSTOPPED status. The job is
+ * still running then, and can be waited
+ * on again once it is continued.
+ */
+int smallsh_job_wait_stop (struct smallsh_job *job);
+
+
+/*
+ * Replaces the callback run when the job
+ * is reaped, as for a foreground job that
+ * stopped and is now a background one.
+ */
+void smallsh_job_set_callback (struct smallsh_job *job, smallsh_job_callback onComplete, void *data);
+
+
+/*
+ * Returns 1 and fills in the wait status
+ * and resource usage if the job has
+ * finished, 0 if it is still running.
+ * Either pointer may be NULL.
+ */
+int smallsh_job_status (struct smallsh_job *job, int *waitStatus, struct rusage *usage);
+
+
+/*
+ * Gives up the caller's handle. A running
+ * job is still reaped by its context.
+ */
+void smallsh_job_release (struct smallsh_job *job);
+
+
+/*
+ * Shells. A shell holds variables,
+ * functions, positional parameters and
+ * background jobs, and runs source text
+ * through the interpreter.
+ */
+
+struct smallsh_shell;
+
+
+/*
+ * Creates a shell that starts its jobs
+ * through ctx, or through a context of
+ * its own if ctx is NULL.
+ */
+struct smallsh_shell *smallsh_shell_new (struct smallsh_ctx *ctx);
+
+void smallsh_shell_free (struct smallsh_shell *sh);
+
+
+/*
+ * Sets $0 and the positional parameters.
+ * The strings must outlive the shell.
+ */
+void smallsh_shell_set_args (struct smallsh_shell *sh, char *arg0, int numParams, char *params[]);
+
+
+/*
+ * Compiles and runs source, returning the
+ * exit status. name is used in messages.
+ */
+int smallsh_shell_run (struct smallsh_shell *sh, const char *name, const char *source);
+
+
+/*
+ * Runs an already parsed program. The
+ * shell takes ownership of the malloc'd
+ * arena, keeping it while functions defined
+ * in it can still be called.
+ */
+int smallsh_shell_exec (struct smallsh_shell *sh, struct smallsh_node *program, struct smallsh_arena *arena);
+
+
+/*
+ * True if the last run ended in the exit
+ * builtin, whose status it returned. The
+ * shell's background jobs have been killed;
+ * the caller decides whether to end the
+ * process.
+ */
+int smallsh_shell_exiting (struct smallsh_shell *sh);
+
+
+/*
+ * Journals the top-level commands the shell
+ * runs from now on, skipping those already
+ * journaled while it is resuming (see
+ * smallshjournal.h). The caller closes it.
+ */
+struct smallsh_journal;
+void smallsh_shell_set_journal (struct smallsh_shell *sh, struct smallsh_journal *journal);
+
+
+/*
+ * Turns on job control with terminal as
+ * the controlling terminal: the shell leads
+ * its own process group, ignores the stop
+ * signals and hands the terminal to each
+ * foreground job. Returns -1 if terminal is
+ * not the shell's controlling terminal.
+ */
+int smallsh_shell_job_control (struct smallsh_shell *sh, int terminal);
+
+
+/*
+ * Reports background jobs that have
+ * finished since the last call.
+ */
+void smallsh_shell_notify (struct smallsh_shell *sh);
+
+
+/*
+ * Completes the word before cursor in line:
+ * command names in command position, file
+ * names elsewhere. Sets wordStart to where
+ * the word begins and matches to a malloc'd
+ * array of malloc'd replacements for it,
+ * sorted, and returns how many there are.
+ */
+int smallsh_shell_complete (struct smallsh_shell *sh, const char *line, size_t cursor, size_t *wordStart, char ***matches);
+
+#endif
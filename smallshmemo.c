@@ -0,0 +1,540 @@
+/*
+ * Result cache for the memo builtin.
+ * See smallshmemo.h.
+ *
+ * Each entry is one file: a small header
+ * with the exit status, then the output.
+ * Using an entry sets its mtime, so the
+ * oldest mtimes are the least recently
+ * used and go first when the cache is
+ * over its limit.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "smallshmemo.h"
+
+const char MEMO_MAGIC[8] = "smemo01\n";
+const long long MEMO_DEFAULT_LIMIT = 256LL * 1024 * 1024;
+
+struct memo_header {
+
+	char magic[8];
+	int32_t status;
+	int32_t reserved;
+};
+
+struct memo_entry {
+
+	char *name;
+	off_t size;
+	struct timespec used;
+};
+
+
+/*
+ * SHA-256, as in FIPS 180-4.
+ */
+
+static const uint32_t K[64] = {
+
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotate (uint32_t x, int n) {
+
+	return (x >> n) | (x << (32 - n));
+}
+
+
+static void hash_block (struct smallsh_hash *hash, const unsigned char *block) {
+
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t t1, t2;
+	int i;
+
+	for(i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+	for(i = 16; i < 64; i++) {
+
+		t1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	a = hash->state[0];
+	b = hash->state[1];
+	c = hash->state[2];
+	d = hash->state[3];
+	e = hash->state[4];
+	f = hash->state[5];
+	g = hash->state[6];
+	h = hash->state[7];
+
+	for(i = 0; i < 64; i++) {
+
+		t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+		t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	hash->state[0] += a;
+	hash->state[1] += b;
+	hash->state[2] += c;
+	hash->state[3] += d;
+	hash->state[4] += e;
+	hash->state[5] += f;
+	hash->state[6] += g;
+	hash->state[7] += h;
+}
+
+
+void smallsh_hash_init (struct smallsh_hash *hash) {
+
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(hash->state, initial, sizeof(initial));
+	hash->length = 0;
+	hash->used = 0;
+}
+
+
+void smallsh_hash_update (struct smallsh_hash *hash, const void *data, size_t length) {
+
+	const unsigned char *bytes = data;
+	size_t take;
+
+	hash->length += length;
+
+	if(hash->used > 0) {
+
+		take = 64 - hash->used < length ? 64 - hash->used : length;
+		memcpy(hash->block + hash->used, bytes, take);
+		hash->used += take;
+		bytes += take;
+		length -= take;
+
+		if(hash->used < 64) {
+			return;
+		}
+		hash_block(hash, hash->block);
+		hash->used = 0;
+	}
+
+	for(; length >= 64; bytes += 64, length -= 64) {
+		hash_block(hash, bytes);
+	}
+
+	memcpy(hash->block, bytes, length);
+	hash->used = length;
+}
+
+
+void smallsh_hash_final (struct smallsh_hash *hash, char hex[65]) {
+
+	uint64_t bits = hash->length * 8;
+	unsigned char pad[72];
+	size_t padLength = (hash->used < 56 ? 56 : 120) - hash->used;
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for(i = 0; i < 8; i++) {
+		pad[padLength + i] = bits >> (56 - 8 * i);
+	}
+	smallsh_hash_update(hash, pad, padLength + 8);
+
+	for(i = 0; i < 32; i++) {
+		sprintf(hex + 2 * i, "%02x", (hash->state[i / 4] >> (24 - 8 * (i % 4))) & 0xff);
+	}
+}
+
+
+int smallsh_hash_fd (struct smallsh_hash *hash, int fd) {
+
+	struct stat info;
+	char buffer[65536];
+	ssize_t bytesRead;
+	void *data;
+
+	if(fstat(fd, &info) == -1) {
+		return -1;
+	}
+
+	if(S_ISREG(info.st_mode) && info.st_size > 0) {
+
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data != MAP_FAILED) {
+
+			madvise(data, info.st_size, MADV_SEQUENTIAL);
+			smallsh_hash_update(hash, data, info.st_size);
+			munmap(data, info.st_size);
+			return 0;
+		}
+	}
+
+	if(lseek(fd, 0, SEEK_SET) == -1 && errno != ESPIPE) {
+		return -1;
+	}
+	while((bytesRead = read(fd, buffer, sizeof(buffer))) > 0) {
+		smallsh_hash_update(hash, buffer, bytesRead);
+	}
+	return bytesRead == -1 ? -1 : 0;
+}
+
+
+/*
+ * mkdir -p.
+ */
+static int make_directories (char *path) {
+
+	char *slash;
+
+	for(slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+
+		*slash = '\0';
+		if(mkdir(path, 0700) == -1 && errno != EEXIST) {
+
+			*slash = '/';
+			return -1;
+		}
+		*slash = '/';
+	}
+	return mkdir(path, 0700) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+
+char *smallsh_memo_dir (void) {
+
+	const char *base = getenv("SMALLSH_MEMO_DIR");
+	char *dir;
+
+	if(base != NULL && base[0] != '\0') {
+
+		dir = strdup(base);
+	}
+	else if((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] == '/') {
+
+		dir = malloc(strlen(base) + sizeof("/smallsh/memo"));
+		sprintf(dir, "%s/smallsh/memo", base);
+	}
+	else if((base = getenv("HOME")) != NULL) {
+
+		dir = malloc(strlen(base) + sizeof("/.cache/smallsh/memo"));
+		sprintf(dir, "%s/.cache/smallsh/memo", base);
+	}
+	else {
+		return NULL;
+	}
+
+	if(make_directories(dir) == -1) {
+
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+
+int smallsh_memo_open (const char *dir, const char *key, int *status, off_t *offset, off_t *length) {
+
+	struct memo_header header;
+	struct stat info;
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		return -1;
+	}
+
+	if(fstat(fd, &info) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+			|| memcmp(header.magic, MEMO_MAGIC, sizeof(header.magic))) {
+
+		close(fd);
+		return -1;
+	}
+
+	/* Mark it used for LRU */
+	futimens(fd, NULL);
+
+	*status = header.status;
+	*offset = sizeof(header);
+	*length = info.st_size - sizeof(header);
+	return fd;
+}
+
+
+int smallsh_memo_create (const char *dir, char **tempPath, off_t *start) {
+
+	struct memo_header header;
+	int fd;
+
+	*tempPath = malloc(strlen(dir) + sizeof("/.tmpXXXXXX"));
+	sprintf(*tempPath, "%s/.tmpXXXXXX", dir);
+
+	fd = mkostemp(*tempPath, O_CLOEXEC);
+	if(fd == -1) {
+
+		free(*tempPath);
+		*tempPath = NULL;
+		return -1;
+	}
+
+	/* The header is filled in by commit, once the status is known */
+	memset(&header, 0, sizeof(header));
+	if(write(fd, &header, sizeof(header)) != sizeof(header)) {
+
+		close(fd);
+		unlink(*tempPath);
+		free(*tempPath);
+		*tempPath = NULL;
+		return -1;
+	}
+
+	*start = sizeof(header);
+	return fd;
+}
+
+
+long long smallsh_parse_size (const char *text) {
+
+	char *end;
+	long long size;
+
+	if(text == NULL || text[0] == '\0') {
+		return 0;
+	}
+
+	size = strtoll(text, &end, 10);
+	switch(*end) {
+
+		case 'G':
+		case 'g':
+			size *= 1024;
+			/* fall through */
+		case 'M':
+		case 'm':
+			size *= 1024;
+			/* fall through */
+		case 'K':
+		case 'k':
+			size *= 1024;
+			break;
+	}
+	return size > 0 ? size : 0;
+}
+
+
+static long long size_limit (void) {
+
+	long long limit = smallsh_parse_size(getenv("SMALLSH_MEMO_SIZE"));
+
+	return limit > 0 ? limit : MEMO_DEFAULT_LIMIT;
+}
+
+
+static int is_entry_name (const char *name) {
+
+	return strlen(name) == 64 && strspn(name, "0123456789abcdef") == 64;
+}
+
+
+/*
+ * Lists the entries. Returns the count and
+ * sets total to their size.
+ */
+static int list_entries (const char *dir, struct memo_entry **entries, long long *total) {
+
+	struct dirent *entry;
+	struct stat info;
+	int numEntries = 0;
+	int capacity = 0;
+	DIR *listing = opendir(dir);
+
+	*entries = NULL;
+	*total = 0;
+
+	if(listing == NULL) {
+		return 0;
+	}
+
+	while((entry = readdir(listing)) != NULL) {
+
+		if(!is_entry_name(entry->d_name) || fstatat(dirfd(listing), entry->d_name, &info, 0) == -1) {
+			continue;
+		}
+
+		if(numEntries == capacity) {
+
+			capacity = capacity ? capacity * 2 : 64;
+			*entries = realloc(*entries, capacity * sizeof(struct memo_entry));
+		}
+		(*entries)[numEntries].name = strdup(entry->d_name);
+		(*entries)[numEntries].size = info.st_blocks * 512;
+		(*entries)[numEntries].used = info.st_mtim;
+		*total += info.st_blocks * 512;
+		numEntries++;
+	}
+	closedir(listing);
+	return numEntries;
+}
+
+
+static int compare_used (const void *a, const void *b) {
+
+	const struct memo_entry *x = a;
+	const struct memo_entry *y = b;
+
+	if(x->used.tv_sec != y->used.tv_sec) {
+		return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+	}
+	return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+
+/*
+ * Removes the least recently used entries
+ * until the cache is back under its limit.
+ */
+static void evict (const char *dir) {
+
+	struct memo_entry *entries;
+	long long total;
+	long long limit = size_limit();
+	char path[4096];
+	int numEntries = list_entries(dir, &entries, &total);
+	int i;
+
+	if(total > limit) {
+
+		qsort(entries, numEntries, sizeof(struct memo_entry), compare_used);
+
+		for(i = 0; i < numEntries && total > limit; i++) {
+
+			snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+			if(unlink(path) == 0) {
+				total -= entries[i].size;
+			}
+		}
+	}
+
+	for(i = 0; i < numEntries; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+}
+
+
+int smallsh_memo_commit (const char *dir, const char *key, int fd, const char *tempPath, int status) {
+
+	struct memo_header header;
+	char path[4096];
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MEMO_MAGIC, sizeof(header.magic));
+	header.status = status;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+
+	if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || rename(tempPath, path) == -1) {
+
+		unlink(tempPath);
+		return -1;
+	}
+
+	evict(dir);
+	return 0;
+}
+
+
+void smallsh_memo_count (const char *dir, int hit) {
+
+	uint64_t counts[2] = { 0, 0 };
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd == -1) {
+		return;
+	}
+
+	/* Several shells may share the cache */
+	flock(fd, LOCK_EX);
+	if(pread(fd, counts, sizeof(counts), 0) != sizeof(counts)) {
+		counts[0] = counts[1] = 0;
+	}
+	counts[hit ? 0 : 1]++;
+	if(pwrite(fd, counts, sizeof(counts), 0) != sizeof(counts)) {
+		perror("memo: stats");
+	}
+	close(fd);
+}
+
+
+void smallsh_memo_stats (const char *dir) {
+
+	struct memo_entry *entries;
+	uint64_t counts[2] = { 0, 0 };
+	long long total;
+	char path[4096];
+	int numEntries = list_entries(dir, &entries, &total);
+	int fd;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd != -1) {
+
+		if(pread(fd, counts, sizeof(counts), 0) != sizeof(counts)) {
+			counts[0] = counts[1] = 0;
+		}
+		close(fd);
+	}
+
+	printf("cache: %s\n", dir);
+	printf("entries: %d\n", numEntries);
+	printf("size: %lld of %lld bytes\n", total, size_limit());
+	printf("hits: %llu\n", (unsigned long long)counts[0]);
+	printf("misses: %llu\n", (unsigned long long)counts[1]);
+	if(counts[0] + counts[1] > 0) {
+		printf("hit rate: %.1f%%\n", 100.0 * counts[0] / (counts[0] + counts[1]));
+	}
+	fflush(stdout);
+
+	for(i = 0; i < numEntries; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+}
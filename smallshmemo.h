@@ -0,0 +1,101 @@
+/*
+ * On-disk result cache for the memo
+ * builtin. Entries are named by the
+ * SHA-256 of everything the command's
+ * result depends on, and hold its exit
+ * status and standard output.
+ */
+
+#ifndef SMALLSHMEMO_H
+#define SMALLSHMEMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+struct smallsh_hash {
+
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t used;
+};
+
+void smallsh_hash_init (struct smallsh_hash *hash);
+void smallsh_hash_update (struct smallsh_hash *hash, const void *data, size_t length);
+
+
+/*
+ * Writes the digest as 64 hex digits and
+ * a NUL into hex.
+ */
+void smallsh_hash_final (struct smallsh_hash *hash, char hex[65]);
+
+
+/*
+ * Adds the contents of an open file, read
+ * from the start. Regular files are mapped.
+ * Returns -1 if it cannot be read.
+ */
+int smallsh_hash_fd (struct smallsh_hash *hash, int fd);
+
+
+/*
+ * Reads a byte count with an optional K, M
+ * or G suffix, as in SMALLSH_MEMO_SIZE and
+ * SMALLSH_PREALLOC. Returns 0 if text is
+ * NULL, empty or not a positive size.
+ */
+long long smallsh_parse_size (const char *text);
+
+
+/*
+ * Returns the malloc'd cache directory,
+ * creating it if needed: $SMALLSH_MEMO_DIR,
+ * or smallsh/memo under $XDG_CACHE_HOME or
+ * ~/.cache. NULL if it cannot be made.
+ */
+char *smallsh_memo_dir (void);
+
+
+/*
+ * Opens the entry for key and marks it
+ * used. Sets the exit status, and the
+ * offset and length of the output in the
+ * file. Returns -1 on a miss.
+ */
+int smallsh_memo_open (const char *dir, const char *key, int *status, off_t *offset, off_t *length);
+
+
+/*
+ * Creates a file for a new entry, with
+ * room for the header. The command's output
+ * is written after it, from the file offset
+ * left in start. Returns -1 on error.
+ */
+int smallsh_memo_create (const char *dir, char **tempPath, off_t *start);
+
+
+/*
+ * Finishes an entry made by smallsh_memo_create
+ * and puts it in place under key, then evicts
+ * the least recently used entries if the cache
+ * is over its size limit.
+ */
+int smallsh_memo_commit (const char *dir, const char *key, int fd, const char *tempPath, int status);
+
+
+/*
+ * Counts a hit or a miss for the stats.
+ */
+void smallsh_memo_count (const char *dir, int hit);
+
+
+/*
+ * Prints the number and size of entries,
+ * the size limit and the hit rate.
+ */
+void smallsh_memo_stats (const char *dir);
+
+#endif
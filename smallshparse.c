@@ -0,0 +1,1644 @@
+/*
+ * Lexer and recursive descent parser
+ * for smallsh. See smallshparse.h.
+ *
+ * Grammar, roughly:
+ *
+ *   list     : and_or ((';' | '&' | newline) and_or)*
+ *   and_or   : pipeline (('&&' | '||') pipeline)*
+ *   pipeline : ['!'] command
+ *   command  : simple | compound redirect* | name '(' ')' command
+ *   compound : if | while | until | for | '{' list '}' | '(' list ')'
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "smallshparse.h"
+
+const size_t ARENA_BLOCK_SIZE = 8192;
+
+/* Indexed by enum smallsh_redirect_type */
+const char *const REDIRECT_OPERATORS[] = {"<", ">", ">>", "<>", "<&", ">&", "&>", "&>>"};
+
+
+enum token_type {
+
+	TOKEN_WORD,
+	TOKEN_NEWLINE,
+	TOKEN_SEMI,
+	TOKEN_AMP,
+	TOKEN_AND,
+	TOKEN_OR,
+	TOKEN_REDIRECT,
+	TOKEN_LPAREN,
+	TOKEN_RPAREN,
+	TOKEN_EOF,
+	TOKEN_ERROR
+};
+
+struct parser {
+
+	struct smallsh_arena *arena;
+	struct smallsh_parse_error *error;
+	const char *source;
+	size_t pos;
+	int line;
+
+	/* One token of lookahead */
+	int havePeek;
+	int tokenType;
+	int tokenLine;
+	const char *tokenStart;
+	size_t tokenLength;
+	int redirectType;
+	int redirectFd;				//-1 when no number came before it
+
+	int failed;
+};
+
+/*
+ * Words that start or end a compound command
+ * when they appear unquoted as the first word
+ * of a command.
+ */
+static const char *CLOSING_WORDS[] = { "then", "elif", "else", "fi", "do", "done", "}", NULL };
+
+
+void smallsh_arena_init (struct smallsh_arena *arena) {
+
+	arena->head = NULL;
+}
+
+
+void *smallsh_arena_alloc (struct smallsh_arena *arena, size_t size) {
+
+	struct smallsh_arena_block *block = arena->head;
+	size_t blockSize;
+	void *memory;
+
+	/* Keep every allocation pointer-aligned */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if(block == NULL || block->used + size > block->size) {
+
+		blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(struct smallsh_arena_block) + blockSize);
+		if(block == NULL) {
+
+			perror("malloc");
+			exit(1);
+		}
+		block->used = 0;
+		block->size = blockSize;
+		block->next = arena->head;
+		arena->head = block;
+	}
+
+	memory = block->data + block->used;
+	block->used += size;
+	memset(memory, 0, size);
+	return memory;
+}
+
+
+char *smallsh_arena_strndup (struct smallsh_arena *arena, const char *text, size_t length) {
+
+	char *copy = smallsh_arena_alloc(arena, length + 1);
+
+	memcpy(copy, text, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+
+void smallsh_arena_free (struct smallsh_arena *arena) {
+
+	struct smallsh_arena_block *block = arena->head;
+	struct smallsh_arena_block *next;
+
+	while(block != NULL) {
+
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->head = NULL;
+}
+
+
+int smallsh_is_name (const char *name, size_t length) {
+
+	size_t i;
+
+	if(length == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+		return 0;
+	}
+
+	for(i = 1; i < length; i++) {
+
+		if(!(isalnum((unsigned char)name[i]) || name[i] == '_')) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static void parse_fail (struct parser *p, int incomplete, const char *message) {
+
+	if(p->failed) {
+		return;
+	}
+	p->failed = 1;
+	p->error->line = p->line;
+	p->error->incomplete = incomplete;
+	snprintf(p->error->message, sizeof(p->error->message), "%s", message);
+}
+
+
+/*
+ * Characters that end an unquoted word.
+ */
+static int is_operator_char (char c) {
+
+	return c == ';' || c == '&' || c == '|' || c == '<' || c == '>'
+		|| c == '(' || c == ')' || c == '\n' || c == ' ' || c == '\t' || c == '\0';
+}
+
+
+size_t smallsh_substitution_length (const char *text) {
+
+	size_t length;
+	size_t i;
+	int depth = 0;
+
+	if(text[0] == '`') {
+
+		for(i = 1; text[i] != '`'; i++) {
+
+			if(text[i] == '\0' || (text[i] == '\\' && text[++i] == '\0')) {
+				return 0;
+			}
+		}
+		return i + 1;
+	}
+
+	for(i = 2; text[i] != '\0'; i++) {
+
+		if(text[i] == '\\') {
+
+			if(text[++i] == '\0') {
+				return 0;
+			}
+		}
+
+		else if(text[i] == '\'') {
+
+			for(i++; text[i] != '\''; i++) {
+
+				if(text[i] == '\0') {
+					return 0;
+				}
+			}
+		}
+
+		else if(text[i] == '"') {
+
+			for(i++; text[i] != '"'; i++) {
+
+				if(text[i] == '\0') {
+					return 0;
+				}
+				if(text[i] == '\\' && text[i + 1] != '\0') {
+					i++;
+				}
+				else if((text[i] == '$' && text[i + 1] == '(') || text[i] == '`') {
+
+					length = smallsh_substitution_length(text + i);
+					if(length == 0) {
+						return 0;
+					}
+					i += length - 1;
+				}
+			}
+		}
+
+		else if((text[i] == '$' && text[i + 1] == '(') || text[i] == '`') {
+
+			length = smallsh_substitution_length(text + i);
+			if(length == 0) {
+				return 0;
+			}
+			i += length - 1;
+		}
+
+		else if(text[i] == '(') {
+			depth++;
+		}
+
+		else if(text[i] == ')' && depth-- == 0) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+
+char *smallsh_substitution_body (struct smallsh_arena *arena, const char *text, size_t length) {
+
+	char *body;
+	size_t i;
+	size_t j;
+
+	if(text[0] != '`') {
+		return smallsh_arena_strndup(arena, text + 2, length - 3);
+	}
+
+	body = smallsh_arena_alloc(arena, length);
+	for(i = 1, j = 0; i < length - 1; i++) {
+
+		if(text[i] == '\\' && strchr("$`\\", text[i + 1]) != NULL) {
+			i++;
+		}
+		body[j++] = text[i];
+	}
+	body[j] = '\0';
+	return body;
+}
+
+
+/*
+ * Moves past a command substitution at
+ * p->pos, counting its lines. Returns 0
+ * if it is not closed.
+ */
+static int skip_substitution (struct parser *p) {
+
+	size_t length = smallsh_substitution_length(p->source + p->pos);
+	size_t i;
+
+	for(i = 0; i < length; i++) {
+
+		if(p->source[p->pos + i] == '\n') {
+			p->line++;
+		}
+	}
+	p->pos += length;
+	return length > 0;
+}
+
+
+/*
+ * Scans a word starting at p->pos, keeping
+ * its quotes and any command substitutions.
+ * Returns 0 if the source ended inside a
+ * quote or substitution.
+ */
+static int scan_word (struct parser *p) {
+
+	const char *s = p->source;
+	char quote;
+
+	while(!is_operator_char(s[p->pos])) {
+
+		if((s[p->pos] == '$' && s[p->pos + 1] == '(') || s[p->pos] == '`') {
+
+			if(!skip_substitution(p)) {
+				return 0;
+			}
+		}
+
+		else if(s[p->pos] == '\\') {
+
+			if(s[p->pos + 1] == '\0') {
+				return 0;
+			}
+			if(s[p->pos + 1] == '\n') {
+				p->line++;
+			}
+			p->pos += 2;
+		}
+
+		else if(s[p->pos] == '\'' || s[p->pos] == '"') {
+
+			quote = s[p->pos++];
+			while(s[p->pos] != quote) {
+
+				if(s[p->pos] == '\0') {
+					return 0;
+				}
+				if(s[p->pos] == '\n') {
+					p->line++;
+				}
+				if(quote == '"' && s[p->pos] == '\\' && s[p->pos + 1] != '\0') {
+					p->pos++;
+				}
+				else if(quote == '"' && ((s[p->pos] == '$' && s[p->pos + 1] == '(') || s[p->pos] == '`')) {
+
+					if(!skip_substitution(p)) {
+						return 0;
+					}
+					continue;
+				}
+				p->pos++;
+			}
+			p->pos++;
+		}
+
+		else {
+			p->pos++;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Scans the redirection operator at op,
+ * which may follow a descriptor number
+ * at the token start.
+ */
+static void scan_redirect (struct parser *p, size_t op, int fd) {
+
+	const char *s = p->source + op;
+	size_t length = 2;
+
+	p->tokenType = TOKEN_REDIRECT;
+	p->redirectFd = fd;
+
+	if(s[0] == '&') {
+
+		p->redirectType = REDIRECT_ALL;
+		if(s[2] == '>') {
+
+			p->redirectType = REDIRECT_APPEND_ALL;
+			length = 3;
+		}
+	}
+	else if(s[0] == '<') {
+
+		if(s[1] == '>') {
+			p->redirectType = REDIRECT_READ_WRITE;
+		}
+		else if(s[1] == '&') {
+			p->redirectType = REDIRECT_DUP_INPUT;
+		}
+		else if(s[1] == '<') {
+
+			parse_fail(p, 0, "here-documents are not supported");
+			p->tokenType = TOKEN_ERROR;
+		}
+		else {
+
+			p->redirectType = REDIRECT_INPUT;
+			length = 1;
+		}
+	}
+	else {
+
+		if(s[1] == '>') {
+			p->redirectType = REDIRECT_APPEND;
+		}
+		else if(s[1] == '&') {
+			p->redirectType = REDIRECT_DUP_OUTPUT;
+		}
+		else if(s[1] == '|') {
+			p->redirectType = REDIRECT_OUTPUT;
+		}
+		else {
+
+			p->redirectType = REDIRECT_OUTPUT;
+			length = 1;
+		}
+	}
+
+	p->tokenLength = op + length - p->pos;
+}
+
+
+static int peek (struct parser *p) {
+
+	const char *s = p->source;
+
+	if(p->havePeek) {
+		return p->tokenType;
+	}
+	p->havePeek = 1;
+
+	/* Skip blanks and escaped newlines */
+	for(;;) {
+
+		if(s[p->pos] == ' ' || s[p->pos] == '\t') {
+			p->pos++;
+		}
+		else if(s[p->pos] == '\\' && s[p->pos + 1] == '\n') {
+			p->pos += 2;
+			p->line++;
+		}
+		else {
+			break;
+		}
+	}
+
+	/* A # at the start of a word comments out the rest of the line */
+	if(s[p->pos] == '#') {
+
+		while(s[p->pos] != '\n' && s[p->pos] != '\0') {
+			p->pos++;
+		}
+	}
+
+	p->tokenStart = s + p->pos;
+	p->tokenLine = p->line;
+	p->tokenLength = 1;
+
+	switch(s[p->pos]) {
+
+		case '\0':
+			p->tokenType = TOKEN_EOF;
+			p->tokenLength = 0;
+			return p->tokenType;
+
+		case '\n':
+			p->tokenType = TOKEN_NEWLINE;
+			p->line++;
+			break;
+
+		case ';':
+			p->tokenType = TOKEN_SEMI;
+			break;
+
+		case '&':
+			p->tokenType = TOKEN_AMP;
+			if(s[p->pos + 1] == '&') {
+				p->tokenType = TOKEN_AND;
+				p->tokenLength = 2;
+			}
+			else if(s[p->pos + 1] == '>') {
+				scan_redirect(p, p->pos, -1);
+			}
+			break;
+
+		case '|':
+			if(s[p->pos + 1] != '|') {
+				parse_fail(p, 0, "pipelines are not supported");
+				p->tokenType = TOKEN_ERROR;
+				return p->tokenType;
+			}
+			p->tokenType = TOKEN_OR;
+			p->tokenLength = 2;
+			break;
+
+		case '<':
+		case '>':
+			scan_redirect(p, p->pos, -1);
+			if(p->tokenType == TOKEN_ERROR) {
+				return p->tokenType;
+			}
+			break;
+
+		case '(':
+			p->tokenType = TOKEN_LPAREN;
+			break;
+
+		case ')':
+			p->tokenType = TOKEN_RPAREN;
+			break;
+
+		default:
+			/* A single digit right before < or > names the descriptor */
+			if(isdigit((unsigned char)s[p->pos]) && (s[p->pos + 1] == '<' || s[p->pos + 1] == '>')) {
+
+				scan_redirect(p, p->pos + 1, s[p->pos] - '0');
+				if(p->tokenType == TOKEN_ERROR) {
+					return p->tokenType;
+				}
+				break;
+			}
+
+			p->tokenType = TOKEN_WORD;
+			if(!scan_word(p)) {
+
+				parse_fail(p, 1, "unterminated quote or substitution");
+				p->tokenType = TOKEN_ERROR;
+				return p->tokenType;
+			}
+			p->tokenLength = (s + p->pos) - p->tokenStart;
+			return p->tokenType;
+	}
+
+	p->pos += p->tokenLength;
+	return p->tokenType;
+}
+
+
+static void advance (struct parser *p) {
+
+	peek(p);
+	p->havePeek = 0;
+}
+
+
+/*
+ * True if the lookahead is the unquoted
+ * word keyword.
+ */
+static int peek_keyword (struct parser *p, const char *keyword) {
+
+	return peek(p) == TOKEN_WORD && p->tokenLength == strlen(keyword)
+		&& !strncmp(p->tokenStart, keyword, p->tokenLength);
+}
+
+
+static int peek_closing_word (struct parser *p) {
+
+	int i;
+
+	for(i = 0; CLOSING_WORDS[i] != NULL; i++) {
+
+		if(peek_keyword(p, CLOSING_WORDS[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static void unexpected (struct parser *p) {
+
+	char message[128];
+
+	if(p->failed) {
+		return;
+	}
+
+	if(peek(p) == TOKEN_EOF) {
+
+		parse_fail(p, 1, "unexpected end of input");
+	}
+	else if(p->tokenType == TOKEN_NEWLINE) {
+
+		parse_fail(p, 0, "syntax error near unexpected newline");
+	}
+	else {
+
+		snprintf(message, sizeof(message), "syntax error near unexpected '%.*s'",
+				(int)(p->tokenLength > 32 ? 32 : p->tokenLength), p->tokenStart);
+		parse_fail(p, 0, message);
+	}
+}
+
+
+static int expect_keyword (struct parser *p, const char *keyword) {
+
+	if(!peek_keyword(p, keyword)) {
+
+		unexpected(p);
+		return 0;
+	}
+	advance(p);
+	return 1;
+}
+
+
+static void skip_newlines (struct parser *p) {
+
+	while(peek(p) == TOKEN_NEWLINE) {
+		advance(p);
+	}
+}
+
+
+static struct smallsh_node *new_node (struct parser *p, int type) {
+
+	struct smallsh_node *node = smallsh_arena_alloc(p->arena, sizeof(struct smallsh_node));
+
+	node->type = type;
+	node->line = p->tokenLine;
+	return node;
+}
+
+
+/*
+ * Parses the command substitutions of a
+ * word, following quotes as expansion
+ * does. A body that fails is left for
+ * expansion to report when it runs.
+ */
+static void parse_substitutions (struct smallsh_arena *arena, struct smallsh_word *word) {
+
+	struct smallsh_substitution **tail = &word->substitutions;
+	struct smallsh_parse_error error;
+	struct smallsh_node *program;
+	const char *text = word->text;
+	size_t length;
+	size_t i;
+	int inDouble = 0;
+
+	for(i = 0; text[i] != '\0'; i++) {
+
+		if(text[i] == '\'' && !inDouble) {
+
+			for(i++; text[i] != '\'' && text[i] != '\0'; i++) {
+				;
+			}
+			if(text[i] == '\0') {
+				break;
+			}
+		}
+
+		else if(text[i] == '"') {
+			inDouble = !inDouble;
+		}
+
+		else if(text[i] == '\\' && text[i + 1] != '\0') {
+			i++;
+		}
+
+		else if((text[i] == '$' && text[i + 1] == '(') || text[i] == '`') {
+
+			length = smallsh_substitution_length(text + i);
+			if(length == 0) {
+				continue;
+			}
+
+			program = smallsh_parse(arena, smallsh_substitution_body(arena, text + i, length), &error);
+			if(program != NULL) {
+
+				*tail = smallsh_arena_alloc(arena, sizeof(struct smallsh_substitution));
+				(*tail)->offset = i;
+				(*tail)->program = program;
+				tail = &(*tail)->next;
+			}
+			i += length - 1;
+		}
+	}
+}
+
+
+static struct smallsh_word *take_word (struct parser *p) {
+
+	struct smallsh_word *word = smallsh_arena_alloc(p->arena, sizeof(struct smallsh_word));
+
+	word->text = smallsh_arena_strndup(p->arena, p->tokenStart, p->tokenLength);
+	parse_substitutions(p->arena, word);
+	advance(p);
+	return word;
+}
+
+
+static struct smallsh_node *parse_list (struct parser *p);
+static struct smallsh_node *parse_command (struct parser *p);
+
+
+/*
+ * The descriptor a redirection applies to
+ * when no number is given.
+ */
+static int default_fd (int type) {
+
+	return type == REDIRECT_INPUT || type == REDIRECT_READ_WRITE || type == REDIRECT_DUP_INPUT ? 0 : 1;
+}
+
+
+/*
+ * Parses a redirection operator and its
+ * target word, appending it to *tail.
+ */
+static int parse_redirect (struct parser *p, struct smallsh_redirect ***tail) {
+
+	struct smallsh_redirect *redirect = smallsh_arena_alloc(p->arena, sizeof(struct smallsh_redirect));
+
+	peek(p);
+	redirect->type = p->redirectType;
+	redirect->fd = p->redirectFd == -1 ? default_fd(redirect->type) : p->redirectFd;
+	advance(p);
+
+	if(peek(p) != TOKEN_WORD) {
+
+		unexpected(p);
+		return 0;
+	}
+	redirect->target = take_word(p);
+
+	**tail = redirect;
+	*tail = &redirect->next;
+	return 1;
+}
+
+
+static int parse_redirects (struct parser *p, struct smallsh_node *node) {
+
+	struct smallsh_redirect **tail = &node->redirects;
+
+	while(*tail != NULL) {
+		tail = &(*tail)->next;
+	}
+
+	while(peek(p) == TOKEN_REDIRECT) {
+
+		if(!parse_redirect(p, &tail)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Parses a list that must hold at
+ * least one command.
+ */
+static struct smallsh_node *parse_body (struct parser *p) {
+
+	struct smallsh_node *body = parse_list(p);
+
+	if(body != NULL && body->left == NULL) {
+
+		unexpected(p);
+		return NULL;
+	}
+	return body;
+}
+
+
+static struct smallsh_node *parse_if (struct parser *p) {
+
+	struct smallsh_node *node = new_node(p, NODE_IF);
+
+	/* Consumes "if" or "elif" */
+	advance(p);
+
+	if((node->left = parse_body(p)) == NULL || !expect_keyword(p, "then")
+			|| (node->right = parse_body(p)) == NULL) {
+		return NULL;
+	}
+
+	if(peek_keyword(p, "elif")) {
+
+		/* elif is an if nested in the else branch, sharing this fi */
+		node->third = parse_if(p);
+		return node->third == NULL ? NULL : node;
+	}
+
+	if(peek_keyword(p, "else")) {
+
+		advance(p);
+		if((node->third = parse_body(p)) == NULL) {
+			return NULL;
+		}
+	}
+
+	return expect_keyword(p, "fi") ? node : NULL;
+}
+
+
+static struct smallsh_node *parse_do_group (struct parser *p) {
+
+	struct smallsh_node *body;
+
+	if(!expect_keyword(p, "do") || (body = parse_body(p)) == NULL || !expect_keyword(p, "done")) {
+		return NULL;
+	}
+	return body;
+}
+
+
+static struct smallsh_node *parse_while (struct parser *p) {
+
+	struct smallsh_node *node = new_node(p, peek_keyword(p, "while") ? NODE_WHILE : NODE_UNTIL);
+
+	advance(p);
+	if((node->left = parse_body(p)) == NULL || (node->right = parse_do_group(p)) == NULL) {
+		return NULL;
+	}
+	return node;
+}
+
+
+static struct smallsh_node *parse_for (struct parser *p) {
+
+	struct smallsh_node *node = new_node(p, NODE_FOR);
+	struct smallsh_word **tail = &node->words;
+
+	advance(p);
+	if(peek(p) != TOKEN_WORD || !smallsh_is_name(p->tokenStart, p->tokenLength)) {
+
+		if(!p->failed) {
+			parse_fail(p, peek(p) == TOKEN_EOF, "for: expected a variable name");
+		}
+		return NULL;
+	}
+	node->name = take_word(p)->text;
+
+	skip_newlines(p);
+	if(peek_keyword(p, "in")) {
+
+		advance(p);
+		node->hasList = 1;
+
+		while(peek(p) == TOKEN_WORD) {
+
+			*tail = take_word(p);
+			tail = &(*tail)->next;
+		}
+
+		if(peek(p) != TOKEN_SEMI && peek(p) != TOKEN_NEWLINE) {
+
+			unexpected(p);
+			return NULL;
+		}
+		advance(p);
+	}
+	else if(peek(p) == TOKEN_SEMI) {
+
+		advance(p);
+	}
+	skip_newlines(p);
+
+	node->right = parse_do_group(p);
+	return node->right == NULL ? NULL : node;
+}
+
+
+static struct smallsh_node *parse_group (struct parser *p) {
+
+	struct smallsh_node *node = new_node(p, NODE_GROUP);
+
+	advance(p);
+	if((node->left = parse_body(p)) == NULL || !expect_keyword(p, "}")) {
+		return NULL;
+	}
+	return node;
+}
+
+
+static struct smallsh_node *parse_subshell (struct parser *p) {
+
+	struct smallsh_node *node = new_node(p, NODE_SUBSHELL);
+
+	advance(p);
+	if((node->left = parse_body(p)) == NULL) {
+		return NULL;
+	}
+
+	if(peek(p) != TOKEN_RPAREN) {
+
+		unexpected(p);
+		return NULL;
+	}
+	advance(p);
+	return node;
+}
+
+
+/*
+ * Parses the body of "name ()" or
+ * "function name", which must be a
+ * compound command.
+ */
+static struct smallsh_node *parse_function_body (struct parser *p, struct smallsh_node *node) {
+
+	skip_newlines(p);
+	if(!(peek_keyword(p, "{") || peek_keyword(p, "if") || peek_keyword(p, "while")
+			|| peek_keyword(p, "until") || peek_keyword(p, "for") || peek(p) == TOKEN_LPAREN)) {
+
+		unexpected(p);
+		return NULL;
+	}
+
+	node->left = parse_command(p);
+	return node->left == NULL ? NULL : node;
+}
+
+
+static struct smallsh_node *parse_function (struct parser *p) {
+
+	struct smallsh_node *node = new_node(p, NODE_FUNCTION);
+
+	advance(p);
+	if(peek(p) != TOKEN_WORD) {
+
+		unexpected(p);
+		return NULL;
+	}
+	node->name = take_word(p)->text;
+
+	/* The parentheses are optional after "function name" */
+	if(peek(p) == TOKEN_LPAREN) {
+
+		advance(p);
+		if(peek(p) != TOKEN_RPAREN) {
+
+			unexpected(p);
+			return NULL;
+		}
+		advance(p);
+	}
+	return parse_function_body(p, node);
+}
+
+
+/*
+ * True if the lookahead word is followed
+ * by "()", making it a function definition.
+ */
+static int at_function_definition (struct parser *p) {
+
+	const char *s = p->source;
+	size_t i = p->pos;
+
+	if(!smallsh_is_name(p->tokenStart, p->tokenLength)) {
+		return 0;
+	}
+
+	while(s[i] == ' ' || s[i] == '\t') {
+		i++;
+	}
+	if(s[i] != '(') {
+		return 0;
+	}
+
+	i++;
+	while(s[i] == ' ' || s[i] == '\t') {
+		i++;
+	}
+	return s[i] == ')';
+}
+
+
+static struct smallsh_node *parse_simple (struct parser *p) {
+
+	struct smallsh_node *node = new_node(p, NODE_COMMAND);
+	struct smallsh_word **wordTail = &node->words;
+	struct smallsh_word **assignTail = &node->assignments;
+	struct smallsh_redirect **redirectTail = &node->redirects;
+	const char *equals;
+
+	for(;;) {
+
+		if(peek(p) == TOKEN_WORD) {
+
+			/*
+			 * NAME=value before the command
+			 * name is an assignment.
+			 */
+			equals = memchr(p->tokenStart, '=', p->tokenLength);
+			if(node->words == NULL && equals != NULL
+					&& smallsh_is_name(p->tokenStart, equals - p->tokenStart)) {
+
+				*assignTail = take_word(p);
+				assignTail = &(*assignTail)->next;
+			}
+			else {
+
+				*wordTail = take_word(p);
+				wordTail = &(*wordTail)->next;
+			}
+		}
+
+		else if(peek(p) == TOKEN_REDIRECT) {
+
+			if(!parse_redirect(p, &redirectTail)) {
+				return NULL;
+			}
+		}
+
+		else {
+			break;
+		}
+	}
+
+	if(node->words == NULL && node->assignments == NULL && node->redirects == NULL) {
+
+		unexpected(p);
+		return NULL;
+	}
+	return node;
+}
+
+
+static struct smallsh_node *parse_command (struct parser *p) {
+
+	struct smallsh_node *node;
+
+	if(peek(p) == TOKEN_LPAREN) {
+
+		node = parse_subshell(p);
+	}
+
+	else if(peek(p) != TOKEN_WORD) {
+
+		unexpected(p);
+		return NULL;
+	}
+
+	else if(peek_keyword(p, "if")) {
+		node = parse_if(p);
+	}
+	else if(peek_keyword(p, "while") || peek_keyword(p, "until")) {
+		node = parse_while(p);
+	}
+	else if(peek_keyword(p, "for")) {
+		node = parse_for(p);
+	}
+	else if(peek_keyword(p, "{")) {
+		node = parse_group(p);
+	}
+	else if(peek_keyword(p, "function")) {
+		return parse_function(p);
+	}
+	else if(peek_closing_word(p)) {
+
+		unexpected(p);
+		return NULL;
+	}
+
+	else if(at_function_definition(p)) {
+
+		node = new_node(p, NODE_FUNCTION);
+		node->name = take_word(p)->text;
+		advance(p);
+		advance(p);
+		return parse_function_body(p, node);
+	}
+
+	else {
+		return parse_simple(p);
+	}
+
+	/* Compound commands may be followed by redirections */
+	if(node == NULL || !parse_redirects(p, node)) {
+		return NULL;
+	}
+	return node;
+}
+
+
+static struct smallsh_node *parse_pipeline (struct parser *p) {
+
+	struct smallsh_node *node;
+
+	if(peek_keyword(p, "!")) {
+
+		node = new_node(p, NODE_NOT);
+		advance(p);
+		node->left = parse_command(p);
+		return node->left == NULL ? NULL : node;
+	}
+	return parse_command(p);
+}
+
+
+static struct smallsh_node *parse_and_or (struct parser *p) {
+
+	struct smallsh_node *left = parse_pipeline(p);
+	struct smallsh_node *node;
+
+	while(left != NULL && (peek(p) == TOKEN_AND || peek(p) == TOKEN_OR)) {
+
+		node = new_node(p, p->tokenType == TOKEN_AND ? NODE_AND : NODE_OR);
+		advance(p);
+		skip_newlines(p);
+
+		node->left = left;
+		node->right = parse_pipeline(p);
+		left = node->right == NULL ? NULL : node;
+	}
+	return left;
+}
+
+
+/*
+ * Parses commands separated by ;, & or
+ * newlines, stopping at the end of input
+ * or at a word that closes a compound
+ * command.
+ */
+static struct smallsh_node *parse_list (struct parser *p) {
+
+	struct smallsh_node *list = new_node(p, NODE_LIST);
+	struct smallsh_node **tail = &list->left;
+	struct smallsh_node *item;
+	struct smallsh_node *background;
+
+	for(;;) {
+
+		skip_newlines(p);
+		if(peek(p) == TOKEN_EOF || peek(p) == TOKEN_RPAREN || peek(p) == TOKEN_ERROR
+				|| peek_closing_word(p)) {
+			break;
+		}
+
+		item = parse_and_or(p);
+		if(item == NULL) {
+			return NULL;
+		}
+
+		if(peek(p) == TOKEN_AMP) {
+
+			background = new_node(p, NODE_BACKGROUND);
+			background->line = item->line;
+			background->left = item;
+			item = background;
+			advance(p);
+		}
+		else if(peek(p) == TOKEN_SEMI || peek(p) == TOKEN_NEWLINE) {
+
+			advance(p);
+		}
+		else if(!(peek(p) == TOKEN_EOF || peek(p) == TOKEN_RPAREN || peek_closing_word(p))) {
+
+			unexpected(p);
+			return NULL;
+		}
+
+		*tail = item;
+		tail = &item->next;
+	}
+
+	return p->failed ? NULL : list;
+}
+
+
+struct smallsh_node *smallsh_parse (struct smallsh_arena *arena, const char *source, struct smallsh_parse_error *error) {
+
+	struct parser p;
+	struct smallsh_node *program;
+
+	memset(&p, 0, sizeof(p));
+	memset(error, 0, sizeof(*error));
+	p.arena = arena;
+	p.error = error;
+	p.source = source;
+	p.line = 1;
+
+	program = parse_list(&p);
+
+	if(program != NULL && peek(&p) != TOKEN_EOF) {
+
+		unexpected(&p);
+		program = NULL;
+	}
+	return program;
+}
+
+
+/*
+ * Appends to a fixed buffer, dropping
+ * whatever does not fit.
+ */
+struct text {
+
+	char *buffer;
+	size_t size;
+	size_t length;
+};
+
+
+static void append (struct text *t, const char *s) {
+
+	for(; *s != '\0'; s++) {
+
+		if(t->length + 1 < t->size) {
+			t->buffer[t->length] = *s;
+		}
+		t->length++;
+	}
+}
+
+
+static void append_words (struct text *t, struct smallsh_word *word) {
+
+	for(; word != NULL; word = word->next) {
+
+		append(t, word->text);
+		if(word->next != NULL) {
+			append(t, " ");
+		}
+	}
+}
+
+
+static void append_node (struct text *t, const struct smallsh_node *node) {
+
+	struct smallsh_redirect *redirect;
+	char number[2];
+
+	if(node == NULL) {
+		return;
+	}
+
+	switch(node->type) {
+
+		case NODE_COMMAND:
+			append_words(t, node->assignments);
+			if(node->assignments != NULL && node->words != NULL) {
+				append(t, " ");
+			}
+			append_words(t, node->words);
+			break;
+
+		case NODE_LIST:
+			for(node = node->left; node != NULL; node = node->next) {
+
+				append_node(t, node);
+				if(node->next != NULL && node->type != NODE_BACKGROUND) {
+					append(t, ";");
+				}
+				if(node->next != NULL) {
+					append(t, " ");
+				}
+			}
+			return;
+
+		case NODE_AND:
+		case NODE_OR:
+			append_node(t, node->left);
+			append(t, node->type == NODE_AND ? " && " : " || ");
+			append_node(t, node->right);
+			break;
+
+		case NODE_NOT:
+			append(t, "! ");
+			append_node(t, node->left);
+			break;
+
+		case NODE_BACKGROUND:
+			append_node(t, node->left);
+			append(t, " &");
+			break;
+
+		case NODE_IF:
+			append(t, "if ");
+			append_node(t, node->left);
+			append(t, "; then ");
+			append_node(t, node->right);
+			if(node->third != NULL) {
+
+				append(t, "; else ");
+				append_node(t, node->third);
+			}
+			append(t, "; fi");
+			break;
+
+		case NODE_WHILE:
+		case NODE_UNTIL:
+			append(t, node->type == NODE_WHILE ? "while " : "until ");
+			append_node(t, node->left);
+			append(t, "; do ");
+			append_node(t, node->right);
+			append(t, "; done");
+			break;
+
+		case NODE_FOR:
+			append(t, "for ");
+			append(t, node->name);
+			if(node->hasList) {
+
+				append(t, " in ");
+				append_words(t, node->words);
+			}
+			append(t, "; do ");
+			append_node(t, node->right);
+			append(t, "; done");
+			break;
+
+		case NODE_FUNCTION:
+			append(t, node->name);
+			append(t, " () ");
+			append_node(t, node->left);
+			break;
+
+		case NODE_GROUP:
+			append(t, "{ ");
+			append_node(t, node->left);
+			append(t, "; }");
+			break;
+
+		default:
+			append(t, "(");
+			append_node(t, node->left);
+			append(t, ")");
+			break;
+	}
+
+	for(redirect = node->redirects; redirect != NULL; redirect = redirect->next) {
+
+		append(t, " ");
+		if(redirect->fd != default_fd(redirect->type)) {
+
+			number[0] = '0' + redirect->fd;
+			number[1] = '\0';
+			append(t, number);
+		}
+		append(t, REDIRECT_OPERATORS[redirect->type]);
+		append(t, redirect->type == REDIRECT_DUP_INPUT || redirect->type == REDIRECT_DUP_OUTPUT ? "" : " ");
+		append(t, redirect->target->text);
+	}
+}
+
+
+size_t smallsh_node_text (const struct smallsh_node *node, char *buffer, size_t size) {
+
+	struct text t;
+
+	t.buffer = buffer;
+	t.size = size;
+	t.length = 0;
+
+	append_node(&t, node);
+
+	if(size > 0) {
+		buffer[t.length < size ? t.length : size - 1] = '\0';
+	}
+	return t.length;
+}
+
+
+/*
+ * Saved trees. Every field is written in
+ * order as native ints, with strings as a
+ * length (0 for NULL) and the text plus
+ * its NUL, so a loaded tree can point into
+ * the saved bytes. Lists of nodes linked
+ * by next are written as a count and the
+ * nodes, so long lists are not recursed.
+ */
+
+struct image {
+
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+
+static void put (struct image *image, const void *data, size_t length) {
+
+	if(image->length + length > image->capacity) {
+
+		while(image->length + length > image->capacity) {
+			image->capacity = image->capacity ? image->capacity * 2 : 4096;
+		}
+		image->data = realloc(image->data, image->capacity);
+		if(image->data == NULL) {
+
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(image->data + image->length, data, length);
+	image->length += length;
+}
+
+
+static void put_int (struct image *image, int value) {
+
+	put(image, &value, sizeof(value));
+}
+
+
+static void put_string (struct image *image, const char *text) {
+
+	if(text == NULL) {
+
+		put_int(image, 0);
+		return;
+	}
+	put_int(image, strlen(text) + 1);
+	put(image, text, strlen(text) + 1);
+}
+
+
+static void put_nodes (struct image *image, const struct smallsh_node *node);
+
+/* Each word is followed by its parsed substitutions */
+static void put_words (struct image *image, const struct smallsh_word *word) {
+
+	const struct smallsh_word *w;
+	const struct smallsh_substitution *part;
+	int count = 0;
+
+	for(w = word; w != NULL; w = w->next) {
+		count++;
+	}
+	put_int(image, count);
+	for(w = word; w != NULL; w = w->next) {
+
+		put_string(image, w->text);
+
+		count = 0;
+		for(part = w->substitutions; part != NULL; part = part->next) {
+			count++;
+		}
+		put_int(image, count);
+		for(part = w->substitutions; part != NULL; part = part->next) {
+
+			put_int(image, part->offset);
+			put_nodes(image, part->program);
+		}
+	}
+}
+
+
+static void put_nodes (struct image *image, const struct smallsh_node *node) {
+
+	const struct smallsh_node *n;
+	const struct smallsh_redirect *redirect;
+	int count = 0;
+
+	for(n = node; n != NULL; n = n->next) {
+		count++;
+	}
+	put_int(image, count);
+
+	for(n = node; n != NULL; n = n->next) {
+
+		put_int(image, n->type);
+		put_int(image, n->line);
+		put_int(image, n->hasList);
+		put_string(image, n->name);
+		put_words(image, n->words);
+		put_words(image, n->assignments);
+
+		count = 0;
+		for(redirect = n->redirects; redirect != NULL; redirect = redirect->next) {
+			count++;
+		}
+		put_int(image, count);
+		for(redirect = n->redirects; redirect != NULL; redirect = redirect->next) {
+
+			put_int(image, redirect->type);
+			put_int(image, redirect->fd);
+			put_words(image, redirect->target);
+		}
+
+		put_nodes(image, n->left);
+		put_nodes(image, n->right);
+		put_nodes(image, n->third);
+	}
+}
+
+
+size_t smallsh_node_save (const struct smallsh_node *node, char **buffer) {
+
+	struct image image = { NULL, 0, 0 };
+
+	put_nodes(&image, node);
+	*buffer = image.data;
+	return image.length;
+}
+
+
+struct reader {
+
+	struct smallsh_arena *arena;
+	const char *data;
+	size_t length;
+	size_t pos;
+	int failed;
+};
+
+
+static int get_int (struct reader *r) {
+
+	int value;
+
+	if(r->failed || r->length - r->pos < sizeof(value)) {
+
+		r->failed = 1;
+		return 0;
+	}
+	memcpy(&value, r->data + r->pos, sizeof(value));
+	r->pos += sizeof(value);
+	return value;
+}
+
+
+/*
+ * Reads a count, which cannot be more
+ * than the bytes left since every item
+ * takes at least one.
+ */
+static int get_count (struct reader *r) {
+
+	int count = get_int(r);
+
+	if(count < 0 || (size_t)count > r->length - r->pos) {
+
+		r->failed = 1;
+		return 0;
+	}
+	return count;
+}
+
+
+static char *get_string (struct reader *r) {
+
+	int length = get_count(r);
+	char *text;
+
+	if(length == 0 || r->failed || r->data[r->pos + length - 1] != '\0') {
+
+		r->failed |= length != 0;
+		return NULL;
+	}
+	text = (char *)r->data + r->pos;
+	r->pos += length;
+	return text;
+}
+
+
+static struct smallsh_node *get_nodes (struct reader *r);
+
+static struct smallsh_word *get_words (struct reader *r) {
+
+	struct smallsh_word *first = NULL;
+	struct smallsh_word **tail = &first;
+	struct smallsh_substitution **partTail;
+	int count = get_count(r);
+	int numParts;
+
+	for(; count > 0 && !r->failed; count--) {
+
+		*tail = smallsh_arena_alloc(r->arena, sizeof(struct smallsh_word));
+		(*tail)->text = get_string(r);
+		r->failed |= (*tail)->text == NULL;
+
+		partTail = &(*tail)->substitutions;
+		for(numParts = get_count(r); numParts > 0 && !r->failed; numParts--) {
+
+			*partTail = smallsh_arena_alloc(r->arena, sizeof(struct smallsh_substitution));
+			(*partTail)->offset = get_int(r);
+			(*partTail)->program = get_nodes(r);
+			if((*partTail)->offset < 0 || (size_t)(*partTail)->offset >= strlen((*tail)->text) || (*partTail)->program == NULL) {
+				r->failed = 1;
+			}
+			partTail = &(*partTail)->next;
+		}
+		tail = &(*tail)->next;
+	}
+	return first;
+}
+
+
+static struct smallsh_node *get_nodes (struct reader *r) {
+
+	struct smallsh_node *first = NULL;
+	struct smallsh_node **tail = &first;
+	struct smallsh_node *node;
+	struct smallsh_redirect **redirectTail;
+	int count = get_count(r);
+	int numRedirects;
+
+	for(; count > 0 && !r->failed; count--) {
+
+		node = smallsh_arena_alloc(r->arena, sizeof(struct smallsh_node));
+		node->type = get_int(r);
+		node->line = get_int(r);
+		node->hasList = get_int(r);
+		node->name = get_string(r);
+		node->words = get_words(r);
+		node->assignments = get_words(r);
+
+		if(node->type < NODE_COMMAND || node->type > NODE_SUBSHELL) {
+			r->failed = 1;
+		}
+
+		redirectTail = &node->redirects;
+		for(numRedirects = get_count(r); numRedirects > 0 && !r->failed; numRedirects--) {
+
+			*redirectTail = smallsh_arena_alloc(r->arena, sizeof(struct smallsh_redirect));
+			(*redirectTail)->type = get_int(r);
+			(*redirectTail)->fd = get_int(r);
+			(*redirectTail)->target = get_words(r);
+			if((*redirectTail)->type < REDIRECT_INPUT || (*redirectTail)->type > REDIRECT_APPEND_ALL || (*redirectTail)->target == NULL) {
+				r->failed = 1;
+			}
+			redirectTail = &(*redirectTail)->next;
+		}
+
+		node->left = get_nodes(r);
+		node->right = get_nodes(r);
+		node->third = get_nodes(r);
+
+		*tail = node;
+		tail = &node->next;
+	}
+	return first;
+}
+
+
+struct smallsh_node *smallsh_node_load (struct smallsh_arena *arena, const char *data, size_t length) {
+
+	struct reader r = { arena, data, length, 0, 0 };
+	struct smallsh_node *node = get_nodes(&r);
+
+	if(r.failed || r.pos != length || node == NULL) {
+		return NULL;
+	}
+	return node;
+}
@@ -0,0 +1,199 @@
+/*
+ * Parser for smallsh command lines
+ * and scripts. Source text is compiled
+ * once into a tree of nodes held in an
+ * arena, and the tree is what the shell
+ * executes, so loop and function bodies
+ * are never lexed more than once.
+ */
+
+#ifndef SMALLSHPARSE_H
+#define SMALLSHPARSE_H
+
+#include <stddef.h>
+
+
+/*
+ * Arena allocator. Every node, word
+ * and string of a parse lives in one
+ * arena and is released all at once.
+ */
+
+struct smallsh_arena_block {
+
+	struct smallsh_arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct smallsh_arena {
+
+	struct smallsh_arena_block *head;
+};
+
+void smallsh_arena_init (struct smallsh_arena *arena);
+void *smallsh_arena_alloc (struct smallsh_arena *arena, size_t size);
+char *smallsh_arena_strndup (struct smallsh_arena *arena, const char *text, size_t length);
+void smallsh_arena_free (struct smallsh_arena *arena);
+
+
+/*
+ * Node types of the command tree.
+ */
+
+enum smallsh_node_type {
+
+	NODE_COMMAND,		//Simple command: words, assignments, redirects
+	NODE_LIST,			//Commands run in sequence (; or newline)
+	NODE_AND,			//left && right
+	NODE_OR,			//left || right
+	NODE_NOT,			//! left
+	NODE_BACKGROUND,	//left &
+	NODE_IF,			//if left then right else third
+	NODE_WHILE,			//while left do right
+	NODE_UNTIL,			//until left do right
+	NODE_FOR,			//for name in words do right
+	NODE_FUNCTION,		//name () left
+	NODE_GROUP,			//{ left }
+	NODE_SUBSHELL		//( left )
+};
+
+enum smallsh_redirect_type {
+
+	REDIRECT_INPUT,			//<  (or >| as >)
+	REDIRECT_OUTPUT,		//>
+	REDIRECT_APPEND,		//>>
+	REDIRECT_READ_WRITE,	//<>
+	REDIRECT_DUP_INPUT,		//<&n or <&-
+	REDIRECT_DUP_OUTPUT,	//>&n or >&-
+	REDIRECT_ALL,			//&> to stdout and stderr
+	REDIRECT_APPEND_ALL		//&>>
+};
+
+
+/*
+ * Words are kept as raw source text,
+ * quotes included. Expansion happens
+ * each time the command runs, but the
+ * command substitutions in a word are
+ * parsed with it, so a loop does not
+ * parse them again on every pass.
+ */
+
+struct smallsh_substitution {
+
+	int offset;								//Where the $( or ` starts in the word
+	struct smallsh_node *program;
+	struct smallsh_substitution *next;
+};
+
+struct smallsh_word {
+
+	char *text;
+	struct smallsh_substitution *substitutions;		//In order; bodies that do not parse are left out
+	struct smallsh_word *next;
+};
+
+struct smallsh_redirect {
+
+	int type;
+	int fd;									//n in n>, or the default for the type
+	struct smallsh_word *target;
+	struct smallsh_redirect *next;
+};
+
+struct smallsh_node {
+
+	int type;
+	int line;
+
+	struct smallsh_word *words;				//Command words, or the for list
+	struct smallsh_word *assignments;		//NAME=value prefixes of a command
+	struct smallsh_redirect *redirects;
+
+	char *name;								//for variable or function name
+	int hasList;							//for loop had an "in" list
+
+	struct smallsh_node *left;
+	struct smallsh_node *right;
+	struct smallsh_node *third;
+	struct smallsh_node *next;				//Next command in a NODE_LIST
+};
+
+
+/*
+ * Filled in when a parse fails. If
+ * incomplete is set, the source ended
+ * inside an open construct and more
+ * input may complete it.
+ */
+
+struct smallsh_parse_error {
+
+	int line;
+	int incomplete;
+	char message[128];
+};
+
+
+/*
+ * Parses source into a tree allocated
+ * in arena. Returns NULL on error, or an
+ * empty NODE_LIST if the source held no
+ * commands.
+ */
+struct smallsh_node *smallsh_parse (struct smallsh_arena *arena, const char *source, struct smallsh_parse_error *error);
+
+
+/*
+ * Returns 1 if name is a valid
+ * variable name.
+ */
+int smallsh_is_name (const char *name, size_t length);
+
+
+/*
+ * Length of the command substitution at
+ * text, $(...) or `...`, including its
+ * delimiters. 0 if it is not closed.
+ */
+size_t smallsh_substitution_length (const char *text);
+
+
+/*
+ * The source inside the command
+ * substitution of that length at text,
+ * allocated in arena. In backquotes a
+ * backslash only quotes $, ` and itself.
+ */
+char *smallsh_substitution_body (struct smallsh_arena *arena, const char *text, size_t length);
+
+
+/*
+ * Writes node back out as one line of
+ * source, for job listings. Output that
+ * does not fit in size is cut off; the
+ * full length is returned, as snprintf
+ * does.
+ */
+size_t smallsh_node_text (const struct smallsh_node *node, char *buffer, size_t size);
+
+
+/*
+ * Flattens the tree at node into a malloc'd
+ * buffer that smallsh_node_load can read back
+ * without parsing. Returns its length.
+ */
+size_t smallsh_node_save (const struct smallsh_node *node, char **buffer);
+
+
+/*
+ * Rebuilds a tree saved by smallsh_node_save,
+ * with its nodes in arena. Strings point into
+ * data, which must outlive the tree. Returns
+ * NULL if data does not hold a saved tree.
+ */
+struct smallsh_node *smallsh_node_load (struct smallsh_arena *arena, const char *data, size_t length);
+
+#endif
@@ -0,0 +1,508 @@
+/*
+ * PATH command table and directory listing
+ * cache for libsmallsh. See smallshpath.h.
+ *
+ * Building the table only reads the PATH
+ * directories, without a stat per entry;
+ * execute permission is left for exec to
+ * check, and a failed exec falls back to
+ * a normal PATH search.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "smallshpath.h"
+
+const int WATCH_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+
+void smallsh_path_init (struct smallsh_path_table *table) {
+
+	memset(table, 0, sizeof(*table));
+	smallsh_arena_init(&table->arena);
+	smallsh_arena_init(&table->listArena);
+	table->inotifyFd = -1;
+}
+
+
+static void clear_table (struct smallsh_path_table *table) {
+
+	int i;
+
+	smallsh_arena_free(&table->arena);
+	memset(&table->root, 0, sizeof(table->root));
+	table->numCommands = 0;
+	table->built = 0;
+
+	for(i = 0; i < table->numDirs; i++) {
+		free(table->dirs[i]);
+	}
+	free(table->dirs);
+	free(table->watches);
+	free(table->mtimes);
+	table->dirs = NULL;
+	table->watches = NULL;
+	table->mtimes = NULL;
+	table->numDirs = 0;
+
+	if(table->inotifyFd != -1) {
+
+		close(table->inotifyFd);
+		table->inotifyFd = -1;
+	}
+}
+
+
+void smallsh_path_free (struct smallsh_path_table *table) {
+
+	clear_table(table);
+	free(table->path);
+	free(table->listedDir);
+	smallsh_arena_free(&table->listArena);
+	table->path = NULL;
+	table->listedDir = NULL;
+}
+
+
+/*
+ * Finds the child of node for c, adding
+ * it in sorted position if create is set.
+ */
+static struct smallsh_trie_node *trie_child (struct smallsh_path_table *table, struct smallsh_trie_node *node, char c, int create) {
+
+	struct smallsh_trie_node **link = &node->child;
+	struct smallsh_trie_node *child;
+
+	while(*link != NULL && (unsigned char)(*link)->c < (unsigned char)c) {
+		link = &(*link)->sibling;
+	}
+
+	if(*link != NULL && (*link)->c == c) {
+		return *link;
+	}
+	if(!create) {
+		return NULL;
+	}
+
+	child = smallsh_arena_alloc(&table->arena, sizeof(struct smallsh_trie_node));
+	child->c = c;
+	child->sibling = *link;
+	*link = child;
+	return child;
+}
+
+
+static struct smallsh_trie_node *trie_find (struct smallsh_path_table *table, const char *name, int create) {
+
+	struct smallsh_trie_node *node = &table->root;
+
+	for(; *name != '\0' && node != NULL; name++) {
+		node = trie_child(table, node, *name, create);
+	}
+	return node;
+}
+
+
+/*
+ * Records that directory dir has name.
+ * An earlier PATH directory wins.
+ */
+static void add_command (struct smallsh_path_table *table, const char *name, int dir) {
+
+	struct smallsh_trie_node *node = trie_find(table, name, 1);
+
+	if(!node->isCommand) {
+
+		node->isCommand = 1;
+		node->dir = dir;
+		table->numCommands++;
+	}
+	else if(node->dir > dir) {
+
+		node->dir = dir;
+	}
+}
+
+
+/*
+ * Records that directory dir no longer has
+ * name, falling back to a later directory
+ * that does.
+ */
+static void remove_command (struct smallsh_path_table *table, const char *name, int dir) {
+
+	struct smallsh_trie_node *node = trie_find(table, name, 0);
+	char fullPath[4096];
+	int i;
+
+	if(node == NULL || !node->isCommand || node->dir != dir) {
+		return;
+	}
+
+	for(i = dir + 1; i < table->numDirs; i++) {
+
+		snprintf(fullPath, sizeof(fullPath), "%s/%s", table->dirs[i], name);
+		if(access(fullPath, F_OK) == 0) {
+
+			node->dir = i;
+			return;
+		}
+	}
+
+	node->isCommand = 0;
+	table->numCommands--;
+}
+
+
+static void build_table (struct smallsh_path_table *table, const char *path) {
+
+	struct stat info;
+	struct dirent *entry;
+	const char *start;
+	const char *end;
+	DIR *directory;
+	int i;
+
+	clear_table(table);
+	free(table->path);
+	table->path = strdup(path);
+	table->cacheable = 1;
+
+	/* Split PATH, giving up on relative entries, which depend on the cwd */
+	for(start = path; ; start = end + 1) {
+
+		end = strchrnul(start, ':');
+
+		if(end == start || *start != '/') {
+			table->cacheable = 0;
+		}
+
+		table->dirs = realloc(table->dirs, (table->numDirs + 1) * sizeof(char *));
+		table->dirs[table->numDirs++] = strndup(start, end - start);
+
+		if(*end == '\0') {
+			break;
+		}
+	}
+
+	if(!table->cacheable) {
+		return;
+	}
+
+	table->watches = calloc(table->numDirs, sizeof(int));
+	table->mtimes = calloc(table->numDirs, sizeof(struct timespec));
+	table->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	table->lastChecked = time(NULL);
+
+	for(i = 0; i < table->numDirs; i++) {
+
+		table->watches[i] = -1;
+		if(table->inotifyFd != -1) {
+			table->watches[i] = inotify_add_watch(table->inotifyFd, table->dirs[i], WATCH_EVENTS);
+		}
+
+		if(stat(table->dirs[i], &info) == 0) {
+			table->mtimes[i] = info.st_mtim;
+		}
+
+		directory = opendir(table->dirs[i]);
+		if(directory == NULL) {
+			continue;
+		}
+
+		while((entry = readdir(directory)) != NULL) {
+
+			if(entry->d_name[0] == '.' || entry->d_type == DT_DIR) {
+				continue;
+			}
+			add_command(table, entry->d_name, i);
+		}
+		closedir(directory);
+	}
+
+	table->built = 1;
+}
+
+
+/*
+ * Applies queued inotify events. Returns -1
+ * if the table has to be rebuilt.
+ */
+static int apply_events (struct smallsh_path_table *table) {
+
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	ssize_t length;
+	char *position;
+	int i;
+
+	for(;;) {
+
+		length = read(table->inotifyFd, buffer, sizeof(buffer));
+		if(length <= 0) {
+			return 0;
+		}
+
+		for(position = buffer; position < buffer + length; position += sizeof(struct inotify_event) + event->len) {
+
+			event = (struct inotify_event *)position;
+
+			if(event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				return -1;
+			}
+			if(event->len == 0 || (event->mask & IN_ISDIR) || event->name[0] == '.') {
+				continue;
+			}
+
+			for(i = 0; i < table->numDirs && table->watches[i] != event->wd; i++) {
+				;
+			}
+
+			/* Two PATH entries may name the same directory */
+			for(; i < table->numDirs; i++) {
+
+				if(table->watches[i] != event->wd) {
+					continue;
+				}
+				if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+					add_command(table, event->name, i);
+				}
+				else {
+					remove_command(table, event->name, i);
+				}
+			}
+		}
+	}
+}
+
+
+/*
+ * Without inotify, rebuild when a
+ * directory's mtime has moved.
+ */
+static int check_mtimes (struct smallsh_path_table *table) {
+
+	struct stat info;
+	time_t now = time(NULL);
+	int i;
+
+	if(now == table->lastChecked) {
+		return 0;
+	}
+	table->lastChecked = now;
+
+	for(i = 0; i < table->numDirs; i++) {
+
+		if(stat(table->dirs[i], &info) == 0
+				&& (info.st_mtim.tv_sec != table->mtimes[i].tv_sec || info.st_mtim.tv_nsec != table->mtimes[i].tv_nsec)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+void smallsh_path_refresh (struct smallsh_path_table *table, const char *path) {
+
+	int result;
+
+	if(path == NULL) {
+		path = "";
+	}
+
+	if(table->path == NULL || strcmp(table->path, path)) {
+
+		build_table(table, path);
+		return;
+	}
+
+	if(!table->built) {
+		return;
+	}
+
+	result = table->inotifyFd != -1 ? apply_events(table) : check_mtimes(table);
+	if(result == -1) {
+		build_table(table, path);
+	}
+}
+
+
+const char *smallsh_path_lookup (struct smallsh_path_table *table, const char *command, char *buffer, size_t size) {
+
+	struct smallsh_trie_node *node;
+
+	if(!table->built || *command == '\0' || strchr(command, '/') != NULL) {
+		return NULL;
+	}
+
+	node = trie_find(table, command, 0);
+	if(node == NULL || !node->isCommand) {
+		return NULL;
+	}
+
+	snprintf(buffer, size, "%s/%s", table->dirs[(int)node->dir], command);
+	return buffer;
+}
+
+
+/*
+ * Walks the subtree under node in sorted
+ * order, name holding the characters on the
+ * way down.
+ */
+static void walk (struct smallsh_trie_node *node, char *name, size_t length, size_t size, smallsh_name_fn each, void *data) {
+
+	struct smallsh_trie_node *child;
+
+	if(node->isCommand) {
+
+		name[length] = '\0';
+		each(data, name);
+	}
+
+	if(length + 1 >= size) {
+		return;
+	}
+
+	for(child = node->child; child != NULL; child = child->sibling) {
+
+		name[length] = child->c;
+		walk(child, name, length + 1, size, each, data);
+	}
+}
+
+
+void smallsh_path_each (struct smallsh_path_table *table, const char *prefix, smallsh_name_fn each, void *data) {
+
+	struct smallsh_trie_node *node;
+	char name[512];
+	size_t length = strlen(prefix);
+
+	if(!table->built || length >= sizeof(name)) {
+		return;
+	}
+
+	node = trie_find(table, prefix, 0);
+	if(node != NULL) {
+
+		memcpy(name, prefix, length);
+		walk(node, name, length, sizeof(name), each, data);
+	}
+}
+
+
+static int compare_names (const void *a, const void *b) {
+
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/*
+ * Reads directory into the listing cache,
+ * sorted, marking subdirectories with '/'.
+ */
+static void list_directory (struct smallsh_path_table *table, const char *directory, struct timespec mtime) {
+
+	struct dirent *entry;
+	struct stat info;
+	char fullPath[4096];
+	size_t length;
+	int capacity = 0;
+	int isDirectory;
+	char **names;
+	DIR *listing;
+
+	smallsh_arena_free(&table->listArena);
+	free(table->listedDir);
+	table->listedDir = strdup(directory);
+	table->listedMtime = mtime;
+	table->listedNames = NULL;
+	table->numListed = 0;
+
+	listing = opendir(directory);
+	if(listing == NULL) {
+		return;
+	}
+
+	while((entry = readdir(listing)) != NULL) {
+
+		if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+			continue;
+		}
+
+		isDirectory = entry->d_type == DT_DIR;
+		if(entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+
+			snprintf(fullPath, sizeof(fullPath), "%s/%s", directory, entry->d_name);
+			isDirectory = stat(fullPath, &info) == 0 && S_ISDIR(info.st_mode);
+		}
+
+		if(table->numListed == capacity) {
+
+			capacity = capacity ? capacity * 2 : 64;
+			names = smallsh_arena_alloc(&table->listArena, capacity * sizeof(char *));
+			if(table->numListed) {
+				memcpy(names, table->listedNames, table->numListed * sizeof(char *));
+			}
+			table->listedNames = names;
+		}
+
+		length = strlen(entry->d_name);
+		table->listedNames[table->numListed] = smallsh_arena_strndup(&table->listArena, entry->d_name, length + isDirectory);
+		if(isDirectory) {
+			table->listedNames[table->numListed][length] = '/';
+		}
+		table->numListed++;
+	}
+	closedir(listing);
+
+	qsort(table->listedNames, table->numListed, sizeof(char *), compare_names);
+}
+
+
+void smallsh_dir_each (struct smallsh_path_table *table, const char *directory, const char *prefix, smallsh_name_fn each, void *data) {
+
+	struct stat info;
+	size_t length = strlen(prefix);
+	int low = 0;
+	int high;
+	int middle;
+
+	if(stat(directory, &info) != 0) {
+		return;
+	}
+
+	if(table->listedDir == NULL || strcmp(table->listedDir, directory)
+			|| info.st_mtim.tv_sec != table->listedMtime.tv_sec || info.st_mtim.tv_nsec != table->listedMtime.tv_nsec) {
+		list_directory(table, directory, info.st_mtim);
+	}
+
+	/* Binary search for the first name not before prefix */
+	high = table->numListed;
+	while(low < high) {
+
+		middle = (low + high) / 2;
+		if(strcmp(table->listedNames[middle], prefix) < 0) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+
+	for(; low < table->numListed && !strncmp(table->listedNames[low], prefix, length); low++) {
+
+		if(table->listedNames[low][0] != '.' || prefix[0] == '.') {
+			each(data, table->listedNames[low]);
+		}
+	}
+}
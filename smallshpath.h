@@ -0,0 +1,102 @@
+/*
+ * Command table for libsmallsh: every
+ * name in the PATH directories, kept in
+ * a trie so commands can be found for
+ * exec and completion without searching
+ * the directories each time. Also caches
+ * the last directory listed for file
+ * name completion.
+ */
+
+#ifndef SMALLSHPATH_H
+#define SMALLSHPATH_H
+
+#include <time.h>
+#include "smallshparse.h"
+
+
+struct smallsh_trie_node {
+
+	char c;
+	char isCommand;
+	short dir;								//PATH directory holding the command
+	struct smallsh_trie_node *child;		//Children sorted by c
+	struct smallsh_trie_node *sibling;
+};
+
+struct smallsh_path_table {
+
+	/*
+	 * The PATH value the table was built from,
+	 * split into directories. A table that
+	 * cannot be cached, such as one with
+	 * relative directories, is left unbuilt.
+	 */
+	char *path;
+	char **dirs;
+	int numDirs;
+	int built;
+	int cacheable;
+
+	struct smallsh_arena arena;
+	struct smallsh_trie_node root;
+	int numCommands;
+
+	/*
+	 * Directories are watched with inotify so
+	 * changes are applied name by name. Without
+	 * inotify, directory mtimes are checked at
+	 * most once a second.
+	 */
+	int inotifyFd;
+	int *watches;
+	struct timespec *mtimes;
+	time_t lastChecked;
+
+	/* Last directory listed for file name completion */
+	char *listedDir;
+	struct timespec listedMtime;
+	char **listedNames;				//Directories end in '/'
+	int numListed;
+	struct smallsh_arena listArena;
+};
+
+
+typedef void (*smallsh_name_fn) (void *data, const char *name);
+
+
+void smallsh_path_init (struct smallsh_path_table *table);
+void smallsh_path_free (struct smallsh_path_table *table);
+
+
+/*
+ * Brings the table up to date with PATH,
+ * building it if needed.
+ */
+void smallsh_path_refresh (struct smallsh_path_table *table, const char *path);
+
+
+/*
+ * Writes the full path of command into
+ * buffer and returns it, or returns NULL
+ * if the table does not know it.
+ */
+const char *smallsh_path_lookup (struct smallsh_path_table *table, const char *command, char *buffer, size_t size);
+
+
+/*
+ * Calls each for every command starting
+ * with prefix, in sorted order.
+ */
+void smallsh_path_each (struct smallsh_path_table *table, const char *prefix, smallsh_name_fn each, void *data);
+
+
+/*
+ * Calls each for every entry of directory
+ * starting with prefix. Entries starting
+ * with '.' are only given if the prefix
+ * does.
+ */
+void smallsh_dir_each (struct smallsh_path_table *table, const char *directory, const char *prefix, smallsh_name_fn each, void *data);
+
+#endif
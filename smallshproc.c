@@ -0,0 +1,272 @@
+/*
+ * /proc sampler for jtop.
+ * See smallshproc.h.
+ *
+ * A tree is walked through each process's
+ * /proc/PID/task/PID/children, which lists
+ * the children of its main thread.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "smallshproc.h"
+
+
+void smallsh_proc_init (struct smallsh_proc_table *table) {
+
+	memset(table, 0, sizeof(*table));
+	table->bufferSize = 4096;
+	table->buffer = malloc(table->bufferSize);
+}
+
+
+static void close_proc (struct smallsh_proc *proc) {
+
+	close(proc->statFd);
+	close(proc->statmFd);
+	close(proc->childrenFd);
+	if(proc->ioFd != -1) {
+		close(proc->ioFd);
+	}
+}
+
+
+void smallsh_proc_free (struct smallsh_proc_table *table) {
+
+	int i;
+
+	for(i = 0; i < table->numProcs; i++) {
+		close_proc(&table->procs[i]);
+	}
+	free(table->procs);
+	free(table->buffer);
+	free(table->pending);
+	memset(table, 0, sizeof(*table));
+}
+
+
+void smallsh_proc_begin_sample (struct smallsh_proc_table *table) {
+
+	table->generation++;
+}
+
+
+void smallsh_proc_end_sample (struct smallsh_proc_table *table) {
+
+	int kept = 0;
+	int i;
+
+	for(i = 0; i < table->numProcs; i++) {
+
+		if(table->procs[i].generation == table->generation) {
+			table->procs[kept++] = table->procs[i];
+		}
+		else {
+			close_proc(&table->procs[i]);
+		}
+	}
+	table->numProcs = kept;
+}
+
+
+/*
+ * Reads the whole of a /proc file into the
+ * table's buffer, growing it if needed.
+ * Returns the length, or -1 once the
+ * process is gone.
+ */
+static ssize_t read_proc_file (struct smallsh_proc_table *table, int fd) {
+
+	ssize_t length;
+
+	for(;;) {
+
+		length = pread(fd, table->buffer, table->bufferSize - 1, 0);
+		if(length == -1 || (size_t)length < table->bufferSize - 1) {
+			break;
+		}
+		table->bufferSize *= 2;
+		table->buffer = realloc(table->buffer, table->bufferSize);
+	}
+
+	if(length >= 0) {
+		table->buffer[length] = '\0';
+	}
+	return length;
+}
+
+
+static int open_proc_file (pid_t pid, const char *name) {
+
+	/* Room for /proc/<pid>/ and a name as long as find_proc's task/<pid>/children buffer */
+	char path[sizeof("/proc//") + 20 + 64];
+
+	snprintf(path, sizeof(path), "/proc/%ld/%s", (long)pid, name);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+
+/*
+ * Finds the entry for pid, opening its
+ * files if it is new. Returns NULL if the
+ * process cannot be read.
+ */
+static struct smallsh_proc *find_proc (struct smallsh_proc_table *table, pid_t pid, int *isNew) {
+
+	struct smallsh_proc proc;
+	char children[64];
+	int low = 0;
+	int high = table->numProcs;
+	int middle;
+
+	while(low < high) {
+
+		middle = (low + high) / 2;
+		if(table->procs[middle].pid == pid) {
+
+			*isNew = 0;
+			return &table->procs[middle];
+		}
+		if(table->procs[middle].pid < pid) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+
+	memset(&proc, 0, sizeof(proc));
+	proc.pid = pid;
+	snprintf(children, sizeof(children), "task/%ld/children", (long)pid);
+	proc.statFd = open_proc_file(pid, "stat");
+	proc.statmFd = open_proc_file(pid, "statm");
+	proc.childrenFd = open_proc_file(pid, children);
+	proc.ioFd = open_proc_file(pid, "io");
+
+	if(proc.statFd == -1 || proc.statmFd == -1 || proc.childrenFd == -1) {
+
+		if(proc.statFd != -1) {
+			close(proc.statFd);
+		}
+		if(proc.statmFd != -1) {
+			close(proc.statmFd);
+		}
+		if(proc.childrenFd != -1) {
+			close(proc.childrenFd);
+		}
+		if(proc.ioFd != -1) {
+			close(proc.ioFd);
+		}
+		return NULL;
+	}
+
+	if(table->numProcs == table->capacity) {
+
+		table->capacity = table->capacity ? table->capacity * 2 : 64;
+		table->procs = realloc(table->procs, table->capacity * sizeof(struct smallsh_proc));
+	}
+	memmove(&table->procs[low + 1], &table->procs[low], (table->numProcs - low) * sizeof(struct smallsh_proc));
+	table->procs[low] = proc;
+	table->numProcs++;
+	*isNew = 1;
+	return &table->procs[low];
+}
+
+
+/* Value of a "name: value" line of /proc/PID/io */
+static unsigned long long io_field (const char *text, const char *name) {
+
+	const char *field = strstr(text, name);
+
+	return field != NULL ? strtoull(field + strlen(name), NULL, 10) : 0;
+}
+
+
+/*
+ * Samples one process, adding it to totals.
+ * Pushes its children onto the pending
+ * stack. Returns its state, or 0 if it is
+ * gone.
+ */
+static char sample_proc (struct smallsh_proc_table *table, pid_t pid, struct smallsh_proc_totals *totals) {
+
+	struct smallsh_proc *proc;
+	unsigned long long utime;
+	unsigned long long stime;
+	unsigned long long readBytes = 0;
+	unsigned long long writtenBytes = 0;
+	unsigned long resident;
+	char *cursor;
+	char *end;
+	char state;
+	int isNew;
+	long child;
+
+	proc = find_proc(table, pid, &isNew);
+	if(proc == NULL || proc->generation == table->generation) {
+		return 0;						//Gone, or already counted in this sample
+	}
+
+	/* Fields after the command name, which may hold spaces and parentheses */
+	if(read_proc_file(table, proc->statFd) <= 0 || (cursor = strrchr(table->buffer, ')')) == NULL
+			|| sscanf(cursor + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &state, &utime, &stime) != 3) {
+		return 0;
+	}
+	proc->generation = table->generation;
+
+	if(read_proc_file(table, proc->statmFd) > 0 && sscanf(table->buffer, "%*u %lu", &resident) == 1) {
+		totals->rssBytes += (unsigned long long)resident * sysconf(_SC_PAGESIZE);
+	}
+
+	if(proc->ioFd != -1 && read_proc_file(table, proc->ioFd) > 0) {
+
+		readBytes = io_field(table->buffer, "rchar:");
+		writtenBytes = io_field(table->buffer, "wchar:");
+	}
+
+	if(!isNew) {
+
+		totals->cpuTicks += utime + stime - proc->cpuTicks;
+		totals->readBytes += readBytes - proc->readBytes;
+		totals->writtenBytes += writtenBytes - proc->writtenBytes;
+	}
+	proc->cpuTicks = utime + stime;
+	proc->readBytes = readBytes;
+	proc->writtenBytes = writtenBytes;
+	totals->numProcs++;
+
+	/* proc may move when children are added, so read them last */
+	if(read_proc_file(table, proc->childrenFd) > 0) {
+
+		for(cursor = table->buffer; (child = strtol(cursor, &end, 10)) > 0; cursor = end) {
+
+			if(table->numPending == table->pendingCapacity) {
+
+				table->pendingCapacity = table->pendingCapacity ? table->pendingCapacity * 2 : 64;
+				table->pending = realloc(table->pending, table->pendingCapacity * sizeof(pid_t));
+			}
+			table->pending[table->numPending++] = child;
+		}
+	}
+	return state;
+}
+
+
+void smallsh_proc_sample_tree (struct smallsh_proc_table *table, pid_t root, struct smallsh_proc_totals *totals) {
+
+	memset(totals, 0, sizeof(*totals));
+
+	table->numPending = 0;
+	totals->state = sample_proc(table, root, totals);
+	if(totals->state == 0) {
+		totals->state = '?';
+	}
+
+	while(table->numPending > 0) {
+		sample_proc(table, table->pending[--table->numPending], totals);
+	}
+}
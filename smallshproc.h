@@ -0,0 +1,81 @@
+/*
+ * Process sampler for the jtop builtin.
+ * Reads CPU time, resident memory, I/O and
+ * state of whole process trees from /proc.
+ *
+ * Every process seen keeps its /proc files
+ * open between samples, and they are read
+ * again with pread into one reused buffer,
+ * so each sample of a process costs four
+ * reads and no opens or allocations. A file
+ * of a process that has exited reads as an
+ * error even if its PID is reused, so stale
+ * entries are easy to spot and are dropped.
+ */
+
+#ifndef SMALLSHPROC_H
+#define SMALLSHPROC_H
+
+#include <sys/types.h>
+
+
+struct smallsh_proc {
+
+	pid_t pid;
+	int statFd;
+	int statmFd;
+	int ioFd;								//-1 if not readable, as for other users
+	int childrenFd;
+
+	unsigned long long cpuTicks;			//utime + stime at the last sample
+	unsigned long long readBytes;			//rchar and wchar at the last sample
+	unsigned long long writtenBytes;
+	unsigned int generation;				//Sample it was last seen in
+};
+
+struct smallsh_proc_table {
+
+	struct smallsh_proc *procs;				//Sorted by pid
+	int numProcs;
+	int capacity;
+	unsigned int generation;
+
+	char *buffer;
+	size_t bufferSize;
+	pid_t *pending;							//Stack for walking trees
+	int numPending;
+	int pendingCapacity;
+};
+
+/*
+ * One process tree's share of a sample.
+ * Counts are what changed since the last
+ * sample; a process seen for the first
+ * time adds nothing to them.
+ */
+struct smallsh_proc_totals {
+
+	int numProcs;
+	char state;								//Of the tree's root, '?' once it is gone
+	unsigned long long cpuTicks;
+	unsigned long long rssBytes;
+	unsigned long long readBytes;
+	unsigned long long writtenBytes;
+};
+
+
+void smallsh_proc_init (struct smallsh_proc_table *table);
+void smallsh_proc_free (struct smallsh_proc_table *table);
+
+
+/*
+ * Starts a sample. Each tree is then added
+ * with smallsh_proc_sample_tree, and
+ * smallsh_proc_end_sample drops processes
+ * that were not seen.
+ */
+void smallsh_proc_begin_sample (struct smallsh_proc_table *table);
+void smallsh_proc_sample_tree (struct smallsh_proc_table *table, pid_t root, struct smallsh_proc_totals *totals);
+void smallsh_proc_end_sample (struct smallsh_proc_table *table);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Launch throttle pressure readings.
+ * See smallshpsi.h.
+ *
+ * Each /proc/pressure file starts with
+ * "some avg10=.. avg60=.. avg300=.. total=N",
+ * N being the microseconds during which at
+ * least one task was stalled.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "smallshpsi.h"
+
+const int PSI_WINDOW_MS = 100;
+const char *const PSI_RESOURCES[] = { "cpu", "memory", "io" };
+
+
+void smallsh_psi_init (struct smallsh_psi *psi) {
+
+	int i;
+
+	memset(psi, 0, sizeof(*psi));
+	for(i = 0; i < 3; i++) {
+		psi->fds[i] = -1;
+	}
+}
+
+
+void smallsh_psi_free (struct smallsh_psi *psi) {
+
+	int i;
+
+	for(i = 0; i < 3; i++) {
+
+		if(psi->fds[i] != -1) {
+			close(psi->fds[i]);
+		}
+		psi->fds[i] = -1;
+	}
+	free(psi->setting);
+	psi->setting = NULL;
+}
+
+
+/*
+ * Stall total and 10 second average from
+ * the "some" line, or 0 if it cannot be read.
+ */
+static unsigned long long read_total (int fd, double *average) {
+
+	char text[256];
+	ssize_t length = pread(fd, text, sizeof(text) - 1, 0);
+	char *total;
+	char *avg10;
+
+	*average = 0;
+	if(length <= 0) {
+		return 0;
+	}
+	text[length] = '\0';
+	avg10 = strstr(text, "avg10=");
+	if(avg10 != NULL) {
+		*average = strtod(avg10 + 6, NULL);
+	}
+	total = strstr(text, "total=");
+	return total != NULL ? strtoull(total + 6, NULL, 10) : 0;
+}
+
+
+int smallsh_psi_configure (struct smallsh_psi *psi, const char *setting) {
+
+	char path[32];
+	const char *field;
+	char *end;
+	size_t nameLength;
+	double limit;
+	int status = 0;
+	int i;
+
+	smallsh_psi_free(psi);
+	if(setting == NULL || *setting == '\0') {
+		return 0;
+	}
+	psi->setting = strdup(setting);
+
+	for(field = setting; *field != '\0'; field += *field == ',') {
+
+		nameLength = strcspn(field, "=,");
+		for(i = 0; i < 3; i++) {
+
+			if(strlen(PSI_RESOURCES[i]) == nameLength && !strncmp(field, PSI_RESOURCES[i], nameLength)) {
+				break;
+			}
+		}
+
+		limit = field[nameLength] == '=' ? strtod(field + nameLength + 1, &end) : -1;
+		if(i == 3 || limit < 0 || limit > 100 || (*end != ',' && *end != '\0')) {
+
+			status = -1;
+			field += strcspn(field, ",");
+			continue;
+		}
+		field = end;
+
+		snprintf(path, sizeof(path), "/proc/pressure/%s", PSI_RESOURCES[i]);
+		if(psi->fds[i] == -1) {
+			psi->fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+		}
+		if(psi->fds[i] == -1) {
+
+			status = -1;
+			continue;
+		}
+		psi->limits[i] = limit;
+	}
+
+	psi->sampled = 0;
+	return status;
+}
+
+
+int smallsh_psi_check (struct smallsh_psi *psi, long long now) {
+
+	unsigned long long total;
+	double average;
+	long long elapsed = now - psi->sampled;
+	int stale = psi->sampled == 0 || elapsed > 2 * PSI_WINDOW_MS;
+	int over = -1;
+	int i;
+
+	/*
+	 * A window's change in the stall total
+	 * gives its pressure. With no sample in
+	 * the last two windows, that would average
+	 * over idle time, so the kernel's 10 second
+	 * average stands in and a new window starts.
+	 */
+	if(stale || elapsed >= PSI_WINDOW_MS) {
+
+		for(i = 0; i < 3; i++) {
+
+			if(psi->fds[i] == -1) {
+				continue;
+			}
+			total = read_total(psi->fds[i], &average);
+			psi->pressure[i] = stale ? average : (total - psi->totals[i]) / 10.0 / elapsed;
+			psi->totals[i] = total;
+		}
+		psi->sampled = now;
+	}
+
+	for(i = 0; i < 3 && over == -1; i++) {
+
+		if(psi->fds[i] != -1 && psi->pressure[i] > psi->limits[i]) {
+			over = i;
+		}
+	}
+	return over;
+}
@@ -0,0 +1,67 @@
+/*
+ * Pressure stall information for the
+ * launch throttle. SMALLSH_PSI holds limits
+ * such as "cpu=80,memory=10,io=30": the
+ * share of wall time, in percent, that some
+ * task may spend stalled on each resource
+ * before background launches are held back.
+ *
+ * Pressure is measured from the stall time
+ * totals in /proc/pressure over the last
+ * window of PSI_WINDOW_MS (up to two when
+ * checks are late), rather than from the
+ * kernel's 10 second averages, so the
+ * throttle lets go as soon as pressure
+ * drops. The 10 second average is used only
+ * when there is no recent sample, such as on
+ * the first check. The files are kept open
+ * and read with pread.
+ */
+
+#ifndef SMALLSHPSI_H
+#define SMALLSHPSI_H
+
+extern const int PSI_WINDOW_MS;
+extern const char *const PSI_RESOURCES[];	//cpu, memory, io
+
+
+struct smallsh_psi {
+
+	char *setting;							//Parsed copy of SMALLSH_PSI
+	int fds[3];								//-1 if not limited or not available
+	double limits[3];
+	double pressure[3];						//Percent over the last window
+	unsigned long long totals[3];			//Stall microseconds at the last sample
+	long long sampled;						//CLOCK_MONOTONIC ms of the last sample
+
+	/* Launches held back, and for how long */
+	int numThrottled;
+	long long throttledMs;
+};
+
+
+void smallsh_psi_init (struct smallsh_psi *psi);
+void smallsh_psi_free (struct smallsh_psi *psi);
+
+
+/*
+ * Sets the limits from a SMALLSH_PSI value,
+ * NULL or empty for none. Returns -1 if the
+ * setting is not understood or its pressure
+ * files cannot be opened; what was
+ * understood still applies.
+ */
+int smallsh_psi_configure (struct smallsh_psi *psi, const char *setting);
+
+
+/*
+ * Measures pressure if the window has
+ * passed since the last sample, and uses
+ * the 10 second average if there is no
+ * recent sample. Returns the index of a
+ * resource over its limit, or -1 if there
+ * is none.
+ */
+int smallsh_psi_check (struct smallsh_psi *psi, long long now);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Performance counters for the pstat
+ * builtin. See smallshpstat.h.
+ *
+ * Counters are opened one by one rather
+ * than as a group, because the kernel only
+ * allows inherited counters to be read
+ * singly. Each is read with its enabled and
+ * running times, so a count the kernel had
+ * to multiplex is scaled to the full run.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "smallshpstat.h"
+
+static const struct {
+
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+
+} COUNTERS[] = {
+
+	{ "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }
+};
+
+
+int smallsh_pstat_open (struct smallsh_pstat *pstat, int onExec) {
+
+	struct perf_event_attr attr;
+	int opened = 0;
+	int i;
+
+	for(i = 0; i < NUM_COUNTERS; i++) {
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = COUNTERS[i].type;
+		attr.config = COUNTERS[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.inherit = 1;
+		attr.disabled = onExec;
+		attr.enable_on_exec = onExec;
+		attr.exclude_hv = 1;
+
+		/*
+		 * Context switches and most page faults
+		 * happen in the kernel, but at the default
+		 * perf_event_paranoid of 2 an unprivileged
+		 * shell may only count user space.
+		 */
+		pstat->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if(pstat->fds[i] == -1 && (errno == EACCES || errno == EPERM)) {
+
+			attr.exclude_kernel = 1;
+			pstat->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		}
+		pstat->values[i] = 0;
+		opened += pstat->fds[i] != -1;
+	}
+
+	if(opened == 0) {
+		return -1;
+	}
+	return 0;
+}
+
+
+void smallsh_pstat_read (struct smallsh_pstat *pstat) {
+
+	uint64_t counts[3];				//Value, time enabled, time running
+	int i;
+
+	for(i = 0; i < NUM_COUNTERS; i++) {
+
+		if(pstat->fds[i] == -1) {
+			continue;
+		}
+
+		if(read(pstat->fds[i], counts, sizeof(counts)) == sizeof(counts)) {
+
+			pstat->values[i] = counts[0];
+			if(counts[2] > 0 && counts[2] < counts[1]) {
+				pstat->values[i] = (double)counts[0] * counts[1] / counts[2];
+			}
+		}
+		close(pstat->fds[i]);
+	}
+}
+
+
+/* A ratio of two counters, or -1 if either was not counted */
+static double ratio (const struct smallsh_pstat *pstat, int numerator, int denominator) {
+
+	if(pstat->fds[numerator] == -1 || pstat->fds[denominator] == -1 || pstat->values[denominator] == 0) {
+		return -1;
+	}
+	return pstat->values[numerator] / pstat->values[denominator];
+}
+
+
+void smallsh_pstat_print (const struct smallsh_pstat *pstat, FILE *out, const char *command) {
+
+	double ipc = ratio(pstat, COUNTER_INSTRUCTIONS, COUNTER_CYCLES);
+	double cacheMisses = ratio(pstat, COUNTER_CACHE_MISSES, COUNTER_CACHE_REFERENCES);
+	double branchMisses = ratio(pstat, COUNTER_BRANCH_MISSES, COUNTER_BRANCHES);
+	int i;
+
+	fprintf(out, "\n Performance counters for '%s':\n\n", command);
+
+	for(i = 0; i < NUM_COUNTERS; i++) {
+
+		if(pstat->fds[i] == -1) {
+
+			fprintf(out, "  %18s  %-18s\n", "<not supported>", COUNTERS[i].name);
+			continue;
+		}
+
+		if(i == COUNTER_TASK_CLOCK) {
+			fprintf(out, "  %18.2f  %-18s", pstat->values[i] / 1e6, "msec task-clock");
+		}
+		else {
+			fprintf(out, "  %18.0f  %-18s", pstat->values[i], COUNTERS[i].name);
+		}
+
+		if(i == COUNTER_INSTRUCTIONS && ipc >= 0) {
+			fprintf(out, "  # %6.2f insn per cycle", ipc);
+		}
+		else if(i == COUNTER_CACHE_MISSES && cacheMisses >= 0) {
+			fprintf(out, "  # %6.2f%% of cache refs", cacheMisses * 100);
+		}
+		else if(i == COUNTER_BRANCH_MISSES && branchMisses >= 0) {
+			fprintf(out, "  # %6.2f%% of branches", branchMisses * 100);
+		}
+		fprintf(out, "\n");
+	}
+	fprintf(out, "\n");
+	fflush(out);
+}
+
+
+void smallsh_pstat_log (const struct smallsh_pstat *pstat, FILE *log, int status, const char *command) {
+
+	int i;
+
+	fprintf(log, "status=%d", status);
+	for(i = 0; i < NUM_COUNTERS; i++) {
+
+		if(pstat->fds[i] != -1) {
+			fprintf(log, " %s=%.0f", COUNTERS[i].name, pstat->values[i]);
+		}
+	}
+	if(ratio(pstat, COUNTER_INSTRUCTIONS, COUNTER_CYCLES) >= 0) {
+		fprintf(log, " ipc=%.3f", ratio(pstat, COUNTER_INSTRUCTIONS, COUNTER_CYCLES));
+	}
+	if(ratio(pstat, COUNTER_CACHE_MISSES, COUNTER_CACHE_REFERENCES) >= 0) {
+		fprintf(log, " cache-miss-rate=%.4f", ratio(pstat, COUNTER_CACHE_MISSES, COUNTER_CACHE_REFERENCES));
+	}
+	if(ratio(pstat, COUNTER_BRANCH_MISSES, COUNTER_BRANCHES) >= 0) {
+		fprintf(log, " branch-miss-rate=%.4f", ratio(pstat, COUNTER_BRANCH_MISSES, COUNTER_BRANCHES));
+	}
+	fprintf(log, " command=%s\n", command);
+	fflush(log);
+}
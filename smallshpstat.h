@@ -0,0 +1,76 @@
+/*
+ * Hardware and software performance
+ * counters for one command, through
+ * perf_event_open.
+ *
+ * Counters are opened on the shell's own
+ * thread with inherit set, so a child
+ * started afterwards gets copies of them,
+ * and with enable_on_exec, so they start
+ * counting when the child runs its program
+ * rather than while the shell sets it up.
+ * When the child exits its counts are added
+ * into the shell's, which are read once it
+ * has been reaped. Only one command may be
+ * counted at a time, since every child
+ * started while counters are open inherits
+ * them.
+ */
+
+#ifndef SMALLSHPSTAT_H
+#define SMALLSHPSTAT_H
+
+#include <stdio.h>
+
+enum smallsh_counter {
+
+	COUNTER_TASK_CLOCK,
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_REFERENCES,
+	COUNTER_CACHE_MISSES,
+	COUNTER_BRANCHES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_PAGE_FAULTS,
+	COUNTER_CONTEXT_SWITCHES,
+	NUM_COUNTERS
+};
+
+struct smallsh_pstat {
+
+	int fds[NUM_COUNTERS];					//-1 where not supported
+	double values[NUM_COUNTERS];			//Scaled up if the kernel multiplexed
+};
+
+
+/*
+ * Opens the counters for the next child
+ * the calling thread starts. With onExec
+ * clear they count from now, for a forked
+ * shell that runs a builtin or function.
+ * Returns -1 if none could be opened.
+ */
+int smallsh_pstat_open (struct smallsh_pstat *pstat, int onExec);
+
+
+/*
+ * Reads the counters, after the child has
+ * been reaped, and closes them.
+ */
+void smallsh_pstat_read (struct smallsh_pstat *pstat);
+
+
+/*
+ * Prints the counts, with IPC and miss
+ * rates, the way perf stat does.
+ */
+void smallsh_pstat_print (const struct smallsh_pstat *pstat, FILE *out, const char *command);
+
+
+/*
+ * Appends the counts as one line of
+ * name=value fields to log.
+ */
+void smallsh_pstat_log (const struct smallsh_pstat *pstat, FILE *log, int status, const char *command);
+
+#endif
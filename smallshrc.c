@@ -0,0 +1,262 @@
+/*
+ * Startup file and snapshot for smallsh.
+ * See smallshrc.h.
+ *
+ * A snapshot is a header followed by the
+ * tree as written by smallsh_node_save. It
+ * is mapped private and writable, and the
+ * loaded tree points into the mapping, so
+ * the mapping is kept for the life of the
+ * shell once its tree has run.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "smallshrc.h"
+#include "smallshmemo.h"
+
+const char SNAPSHOT_MAGIC[8] = "ssnap02\n";
+
+struct snapshot_header {
+
+	char magic[8];
+	int64_t size;				//Of the rc file it was made from
+	int64_t mtime;
+	int64_t mtimeNsec;
+	char hash[64];				//SHA-256 of the rc file, in hex
+	int64_t treeLength;
+};
+
+
+/*
+ * Returns 1 if header was made from the
+ * rc file open on fd. A match by hash
+ * alone updates the times in the header.
+ */
+static int snapshot_current (struct snapshot_header *header, int fd, const struct stat *info, const char *snapPath) {
+
+	struct smallsh_hash hash;
+	char hex[65];
+	int snapFd;
+
+	if(header->size != info->st_size) {
+		return 0;
+	}
+	if(header->mtime == info->st_mtim.tv_sec && header->mtimeNsec == info->st_mtim.tv_nsec) {
+		return 1;
+	}
+
+	smallsh_hash_init(&hash);
+	if(smallsh_hash_fd(&hash, fd) == -1) {
+		return 0;
+	}
+	smallsh_hash_final(&hash, hex);
+	if(memcmp(hex, header->hash, sizeof(header->hash))) {
+		return 0;
+	}
+
+	header->mtime = info->st_mtim.tv_sec;
+	header->mtimeNsec = info->st_mtim.tv_nsec;
+	snapFd = open(snapPath, O_WRONLY | O_CLOEXEC);
+	if(snapFd != -1) {
+
+		if(pwrite(snapFd, header, sizeof(*header), 0) != sizeof(*header)) {
+			unlink(snapPath);
+		}
+		close(snapFd);
+	}
+	return 1;
+}
+
+
+/*
+ * Maps the snapshot at snapPath and loads
+ * its tree into arena. Returns NULL if there
+ * is no usable snapshot for the rc file.
+ */
+static struct smallsh_node *load_snapshot (struct smallsh_arena *arena, int fd, const struct stat *info, const char *snapPath) {
+
+	struct snapshot_header *header;
+	struct smallsh_node *program = NULL;
+	struct stat snapInfo;
+	void *map;
+	int snapFd = open(snapPath, O_RDONLY | O_CLOEXEC);
+
+	if(snapFd == -1) {
+		return NULL;
+	}
+	if(fstat(snapFd, &snapInfo) == -1 || snapInfo.st_size < (off_t)sizeof(struct snapshot_header)) {
+
+		close(snapFd);
+		return NULL;
+	}
+
+	map = mmap(NULL, snapInfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, snapFd, 0);
+	close(snapFd);
+	if(map == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = map;
+	if(!memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))
+			&& header->treeLength == snapInfo.st_size - (off_t)sizeof(struct snapshot_header)
+			&& snapshot_current(header, fd, info, snapPath)) {
+
+		program = smallsh_node_load(arena, (char *)(header + 1), header->treeLength);
+	}
+
+	if(program == NULL) {
+		munmap(map, snapInfo.st_size);
+	}
+	return program;
+}
+
+
+/*
+ * Writes a snapshot of program, compiled
+ * from the rc file source. It is put in
+ * place by renaming, so a shell starting
+ * meanwhile sees the old one or the new.
+ */
+static void save_snapshot (const char *snapPath, const struct smallsh_node *program, const char *source, const struct stat *info) {
+
+	struct snapshot_header header;
+	struct smallsh_hash hash;
+	char hex[65];
+	char *tree;
+	char *tempPath;
+	int tempFd;
+	int written;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.size = info->st_size;
+	header.mtime = info->st_mtim.tv_sec;
+	header.mtimeNsec = info->st_mtim.tv_nsec;
+	smallsh_hash_init(&hash);
+	smallsh_hash_update(&hash, source, info->st_size);
+	smallsh_hash_final(&hash, hex);
+	memcpy(header.hash, hex, sizeof(header.hash));
+	header.treeLength = smallsh_node_save(program, &tree);
+
+	tempPath = malloc(strlen(snapPath) + 8);
+	sprintf(tempPath, "%s.XXXXXX", snapPath);
+	tempFd = mkstemp(tempPath);
+
+	if(tempFd != -1) {
+
+		written = write(tempFd, &header, sizeof(header)) == sizeof(header)
+			&& write(tempFd, tree, header.treeLength) == header.treeLength;
+
+		if(close(tempFd) == -1 || !written || rename(tempPath, snapPath) == -1) {
+			unlink(tempPath);
+		}
+	}
+
+	free(tempPath);
+	free(tree);
+}
+
+
+/*
+ * Reads size bytes of the file open on
+ * fd into a malloc'd string.
+ */
+static char *read_source (int fd, off_t size) {
+
+	char *source = malloc(size + 1);
+	off_t length = 0;
+	ssize_t bytesRead;
+
+	while(length < size && (bytesRead = read(fd, source + length, size - length)) > 0) {
+		length += bytesRead;
+	}
+	if(length < size) {
+
+		free(source);
+		return NULL;
+	}
+	source[size] = '\0';
+	return source;
+}
+
+
+int smallsh_shell_load_rc (struct smallsh_shell *sh, const char *path) {
+
+	struct smallsh_arena *arena;
+	struct smallsh_parse_error error;
+	struct smallsh_node *program = NULL;
+	struct stat info;
+	const char *setting = getenv("SMALLSH_SNAPSHOT");
+	int useSnapshot = setting == NULL || strcmp(setting, "0");
+	char *snapPath;
+	char *source = NULL;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if(fd == -1) {
+
+		if(errno != ENOENT) {
+			perror(path);
+		}
+		return 0;
+	}
+	if(fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+
+		close(fd);
+		return 0;
+	}
+
+	snapPath = malloc(strlen(path) + 6);
+	sprintf(snapPath, "%s.snap", path);
+	arena = malloc(sizeof(struct smallsh_arena));
+	smallsh_arena_init(arena);
+
+	if(useSnapshot) {
+		program = load_snapshot(arena, fd, &info, snapPath);
+	}
+
+	if(program == NULL) {
+
+		smallsh_arena_free(arena);
+		if(lseek(fd, 0, SEEK_SET) == 0) {
+			source = read_source(fd, info.st_size);
+		}
+		if(source == NULL) {
+			perror(path);
+		}
+		else if(memchr(source, '\0', info.st_size) != NULL) {
+			fprintf(stderr, "smallsh: %s: not a text file\n", path);
+		}
+		else {
+
+			program = smallsh_parse(arena, source, &error);
+			if(program == NULL) {
+				fprintf(stderr, "smallsh: %s: line %d: %s\n", path, error.line, error.message);
+			}
+			else if(useSnapshot) {
+				save_snapshot(snapPath, program, source, &info);
+			}
+		}
+		fflush(stderr);
+	}
+
+	close(fd);
+	free(snapPath);
+	free(source);
+
+	if(program == NULL) {
+
+		smallsh_arena_free(arena);
+		free(arena);
+		return 2;
+	}
+	return smallsh_shell_exec(sh, program, arena);
+}
@@ -0,0 +1,34 @@
+/*
+ * Startup file for smallsh. The rc file is
+ * run before the first command, and its
+ * compiled tree is kept in a snapshot next
+ * to it (the same name plus .snap) so later
+ * shells map the tree in instead of parsing
+ * the rc file again.
+ *
+ * A snapshot is used when the rc file's size
+ * and modification time match the ones it
+ * was made from, or when its contents still
+ * hash to the same SHA-256 (the times are
+ * then brought up to date). Otherwise the
+ * rc file is parsed and a new snapshot
+ * written. The tree is run each time, so
+ * variables, exports and functions set by
+ * the rc file are made fresh in every shell.
+ */
+
+#ifndef SMALLSHRC_H
+#define SMALLSHRC_H
+
+#include "smallshlib.h"
+
+
+/*
+ * Runs the rc file at path, through its
+ * snapshot unless SMALLSH_SNAPSHOT is 0.
+ * A missing file does nothing. Returns the
+ * exit status of the file.
+ */
+int smallsh_shell_load_rc (struct smallsh_shell *sh, const char *path);
+
+#endif
@@ -0,0 +1,667 @@
+/*
+ * Daemon mode for smallsh.
+ * See smallshserve.h.
+ *
+ * One thread runs an epoll loop over the
+ * listening socket, the clients and the job
+ * context. Commands given as argv go straight
+ * to smallsh_spawn; shell source is run by a
+ * fork of the server's shell, so both find
+ * commands through the same PATH table, which
+ * stays warm for the life of the server.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "smallshserve.h"
+#include "smallshexec.h"
+
+const int SERVE_MAX_REQUEST = 65536;
+const int SERVE_MAX_FDS = 3;
+const int SERVE_EVENTS = 64;
+
+
+/* A reply waiting for room in the client's socket */
+struct pending {
+
+	struct pending *next;
+	size_t length;
+	char message[];
+};
+
+struct client {
+
+	int fd;
+	int running;				//Requests started and not finished
+	int events;					//What epoll is watching for
+	int closed;					//Hung up; freed once nothing is running
+	struct pending *pending;	//Replies not yet sent, oldest first
+	struct pending **pendingTail;
+	struct client *next;
+};
+
+struct server {
+
+	struct smallsh_shell *sh;
+	struct smallsh_ctx *ctx;
+	int epoll;
+	int listener;
+	int signals;
+	int limit;
+	struct client *clients;
+};
+
+/* A running request, passed to its completion callback */
+struct request {
+
+	struct server *server;
+	struct client *client;
+	char id[64];
+};
+
+
+/*
+ * Watches a client for input only while it
+ * has fewer than the limit of requests running,
+ * so a busy client waits in its socket buffer
+ * rather than in the server. Backed up replies
+ * wait for room to write.
+ */
+static void update_events (struct server *s, struct client *client) {
+
+	struct epoll_event event;
+	int wanted = (client->running < s->limit ? EPOLLIN : 0) | (client->pending != NULL ? EPOLLOUT : 0);
+
+	if(client->closed || wanted == client->events) {
+		return;
+	}
+
+	event.events = wanted;
+	event.data.ptr = client;
+	epoll_ctl(s->epoll, EPOLL_CTL_MOD, client->fd, &event);
+	client->events = wanted;
+}
+
+
+/*
+ * Sends replies that were backed up, for as
+ * long as the socket takes them.
+ */
+static void flush_replies (struct server *s, struct client *client) {
+
+	struct pending *reply;
+
+	while(client->pending != NULL) {
+
+		reply = client->pending;
+		if(send(client->fd, reply->message, reply->length, MSG_NOSIGNAL | MSG_DONTWAIT) == -1
+				&& (errno == EAGAIN || errno == EINTR)) {
+			break;
+		}
+
+		client->pending = reply->next;
+		free(reply);
+	}
+	if(client->pending == NULL) {
+		client->pendingTail = &client->pending;
+	}
+	update_events(s, client);
+}
+
+
+/*
+ * Sends one reply message, queueing it if
+ * the client is not keeping up. A client
+ * that has gone away just misses it.
+ */
+static void reply (struct server *s, struct client *client, const char *format, ...) {
+
+	struct pending *queued;
+	char message[512];
+	va_list args;
+	int length;
+
+	if(client->closed) {
+		return;
+	}
+
+	va_start(args, format);
+	length = vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	if(length >= (int)sizeof(message)) {
+		length = sizeof(message) - 1;
+	}
+
+	if(client->pending == NULL && (send(client->fd, message, length, MSG_NOSIGNAL | MSG_DONTWAIT) != -1
+			|| (errno != EAGAIN && errno != EINTR))) {
+		return;
+	}
+
+	queued = malloc(sizeof(struct pending) + length);
+	queued->next = NULL;
+	queued->length = length;
+	memcpy(queued->message, message, length);
+	*client->pendingTail = queued;
+	client->pendingTail = &queued->next;
+	update_events(s, client);
+}
+
+
+static void close_client (struct server *s, struct client *client) {
+
+	struct pending *reply;
+
+	if(client->closed) {
+		return;
+	}
+
+	epoll_ctl(s->epoll, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	client->closed = 1;
+
+	while(client->pending != NULL) {
+
+		reply = client->pending;
+		client->pending = reply->next;
+		free(reply);
+	}
+}
+
+
+/*
+ * Completion callback for every request.
+ * Reports the status as $? would show it,
+ * and the resources the command used.
+ */
+static void request_done (struct smallsh_job *job, void *data) {
+
+	struct request *request = data;
+	struct client *client = request->client;
+	struct rusage usage;
+	int waitStatus;
+
+	smallsh_job_status(job, &waitStatus, &usage);
+
+	reply(request->server, client, "%s exit %d user %lld sys %lld maxrss %ld", request->id,
+			WIFEXITED(waitStatus) ? WEXITSTATUS(waitStatus) : 128 + WTERMSIG(waitStatus),
+			usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec,
+			usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec, usage.ru_maxrss);
+
+	smallsh_job_release(job);
+	client->running--;
+	update_events(request->server, client);
+	free(request);
+}
+
+
+/*
+ * Runs shell source in a fork of the server's
+ * shell, with the request's descriptors,
+ * directory and environment.
+ */
+static struct smallsh_job *fork_source (struct server *s, struct request *request, const char *source,
+		int targets[], int passed[], int numPassed, const char *cwd, char **env) {
+
+	struct sigaction handling;
+	struct client *client;
+	pid_t pid;
+	int null;
+	int fd;
+	int i;
+
+	fflush(stdout);
+	pid = fork();
+
+	if(pid == -1) {
+		return NULL;
+	}
+	if(pid > 0) {
+		return smallsh_job_adopt(s->ctx, pid, request_done, request);
+	}
+
+	sigemptyset(&(handling.sa_mask));
+	handling.sa_flags = 0;
+	handling.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &handling, NULL);
+	sigprocmask(SIG_SETMASK, &(handling.sa_mask), NULL);
+
+	smallsh_ctx_after_fork(s->ctx);
+	close(s->listener);
+	close(s->epoll);
+	close(s->signals);
+	for(client = s->clients; client != NULL; client = client->next) {
+
+		if(!client->closed) {
+			close(client->fd);
+		}
+	}
+
+	for(fd = 0; fd < 3; fd++) {
+
+		for(i = 0; i < numPassed && targets[i] != fd; i++) {
+			;
+		}
+		if(i < numPassed) {
+			dup2(passed[i], fd);
+		}
+		else {
+
+			null = open("/dev/null", fd == 0 ? O_RDONLY : O_WRONLY);
+			if(null != fd) {
+
+				dup2(null, fd);
+				close(null);
+			}
+		}
+	}
+
+	if(cwd != NULL && chdir(cwd) == -1) {
+
+		perror(cwd);
+		_exit(1);
+	}
+	for(i = 0; env[i] != NULL; i++) {
+		putenv(env[i]);
+	}
+
+	exit(smallsh_shell_run(s->sh, "request", source));
+}
+
+
+/*
+ * Reads one request from a client and starts
+ * it. Returns 0 when the client has hung up.
+ */
+static int read_request (struct server *s, struct client *client) {
+
+	union {
+
+		struct cmsghdr header;
+		char space[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	char *buffer = malloc(SERVE_MAX_REQUEST + 1);
+	struct smallsh_fd_action actions[3];
+	struct smallsh_job_spec spec;
+	struct smallsh_job *job = NULL;
+	struct request *request;
+	struct cmsghdr *message;
+	struct msghdr header;
+	struct iovec data;
+	char resolved[4096];
+	char **argv;
+	char **env;
+	char *field;
+	const char *source = NULL;
+	const char *cwd = NULL;
+	const char *fdList = "";
+	int passed[3];
+	int targets[3];
+	int numPassed = 0;
+	int numArgs = 0;
+	int numEnv = 0;
+	int hasPath = 0;
+	ssize_t length;
+	int fd;
+	int i;
+
+	data.iov_base = buffer;
+	data.iov_len = SERVE_MAX_REQUEST;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &data;
+	header.msg_iovlen = 1;
+	header.msg_control = control.space;
+	header.msg_controllen = sizeof(control.space);
+
+	length = recvmsg(client->fd, &header, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if(length <= 0) {
+
+		free(buffer);
+		return length == -1 && (errno == EAGAIN || errno == EINTR);
+	}
+	buffer[length] = '\0';
+
+	for(message = CMSG_FIRSTHDR(&header); message != NULL; message = CMSG_NXTHDR(&header, message)) {
+
+		if(message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_RIGHTS) {
+
+			for(i = 0; i < (int)((message->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++) {
+
+				memcpy(&fd, CMSG_DATA(message) + i * sizeof(int), sizeof(int));
+				if(numPassed < SERVE_MAX_FDS) {
+					passed[numPassed++] = fd;
+				}
+				else {
+					close(fd);
+				}
+			}
+		}
+	}
+
+	/* Every field needs at least its tag and NUL */
+	argv = calloc(length / 2 + 2, sizeof(char *));
+	env = calloc(length / 2 + 2, sizeof(char *));
+	request = calloc(1, sizeof(struct request));
+	request->server = s;
+	request->client = client;
+	strcpy(request->id, "-");
+
+	for(field = buffer; field < buffer + length; field += strlen(field) + 1) {
+
+		switch(field[0]) {
+
+			case 'i':
+				snprintf(request->id, sizeof(request->id), "%s", field + 1);
+				break;
+
+			case 'a':
+				argv[numArgs++] = field + 1;
+				break;
+
+			case 'c':
+				source = field + 1;
+				break;
+
+			case 'd':
+				cwd = field + 1;
+				break;
+
+			case 'e':
+				env[numEnv++] = field + 1;
+				hasPath |= !strncmp(field + 1, "PATH=", 5);
+				break;
+
+			case 'f':
+				fdList = field + 1;
+				break;
+		}
+	}
+
+	if(header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		reply(s, client, "%s error request too large", request->id);
+	}
+	else if((numArgs > 0) == (source != NULL)) {
+		reply(s, client, "%s error give either argv or source", request->id);
+	}
+	else if((int)strlen(fdList) != numPassed || strspn(fdList, "012") != strlen(fdList)) {
+		reply(s, client, "%s error descriptors do not match the f field", request->id);
+	}
+	else {
+
+		for(i = 0; i < numPassed; i++) {
+			targets[i] = fdList[i] - '0';
+		}
+
+		if(source != NULL) {
+			job = fork_source(s, request, source, targets, passed, numPassed, cwd, env);
+		}
+		else {
+
+			memset(&spec, 0, sizeof(spec));
+			spec.argv = argv;
+			spec.env = numEnv > 0 ? env : NULL;
+			spec.cwd = cwd;
+			spec.flags = SMALLSH_SPAWN_DEFAULT_SIGINT;
+			spec.onComplete = request_done;
+			spec.data = request;
+
+			/* The same warm table the shell uses, unless PATH is overridden */
+			if(!hasPath) {
+
+				smallsh_path_refresh(&s->sh->paths, getenv("PATH"));
+				spec.path = smallsh_path_lookup(&s->sh->paths, argv[0], resolved, sizeof(resolved));
+			}
+
+			for(fd = 0; fd < 3; fd++) {
+
+				actions[fd].fd = fd;
+				for(i = 0; i < numPassed && targets[i] != fd; i++) {
+					;
+				}
+				if(i < numPassed) {
+
+					actions[fd].type = SMALLSH_FD_DUP;
+					actions[fd].source = passed[i];
+				}
+				else {
+
+					actions[fd].type = SMALLSH_FD_OPEN;
+					actions[fd].path = "/dev/null";
+					actions[fd].flags = fd == 0 ? O_RDONLY : O_WRONLY;
+					actions[fd].mode = 0;
+				}
+			}
+			spec.actions = actions;
+			spec.numActions = 3;
+
+			job = smallsh_spawn(s->ctx, &spec);
+		}
+
+		if(job == NULL) {
+			reply(s, client, "%s error %s", request->id, strerror(errno));
+		}
+		else {
+
+			reply(s, client, "%s started %ld", request->id, (long)smallsh_job_pid(job));
+			client->running++;
+			update_events(s, client);
+		}
+	}
+
+	if(job == NULL) {
+		free(request);
+	}
+	for(i = 0; i < numPassed; i++) {
+		close(passed[i]);
+	}
+	free(argv);
+	free(env);
+	free(buffer);
+	return 1;
+}
+
+
+static void accept_clients (struct server *s) {
+
+	struct epoll_event event;
+	struct client *client;
+	int fd;
+
+	while((fd = accept4(s->listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+
+		client = calloc(1, sizeof(struct client));
+		client->fd = fd;
+		client->events = EPOLLIN;
+		client->pendingTail = &client->pending;
+		client->next = s->clients;
+		s->clients = client;
+
+		event.events = EPOLLIN;
+		event.data.ptr = client;
+		epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+
+/*
+ * Frees clients that have hung up and have
+ * nothing left running. Done between batches
+ * of events so none is freed while an event
+ * for it is still to be handled.
+ */
+static void sweep_clients (struct server *s) {
+
+	struct client **link = &s->clients;
+	struct client *client;
+
+	while(*link != NULL) {
+
+		client = *link;
+		if(client->closed && client->running == 0) {
+
+			*link = client->next;
+			free(client);
+		}
+		else {
+			link = &client->next;
+		}
+	}
+}
+
+
+/*
+ * Binds the listening socket, replacing a
+ * socket left by a server that is gone.
+ */
+static int listen_at (const char *path) {
+
+	struct sockaddr_un address;
+	struct stat info;
+	int fd;
+
+	if(strlen(path) >= sizeof(address.sun_path)) {
+
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(fd == -1) {
+		return -1;
+	}
+
+	if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)
+			&& connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1 && errno == ECONNREFUSED) {
+		unlink(path);
+	}
+
+	if(bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1) {
+
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int smallsh_serve (struct smallsh_shell *sh, const char *path, int limit) {
+
+	struct epoll_event events[SERVE_EVENTS];
+	struct epoll_event event;
+	struct server s;
+	struct client *client;
+	struct signalfd_siginfo caught;
+	sigset_t stopping;
+	sigset_t savedMask;
+	int numEvents;
+	int running = 1;
+	int i;
+
+	memset(&s, 0, sizeof(s));
+	s.sh = sh;
+	s.ctx = sh->ctx;
+	s.limit = limit > 0 ? limit : 1;
+
+	s.listener = listen_at(path);
+	if(s.listener == -1) {
+
+		fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	sigemptyset(&stopping);
+	sigaddset(&stopping, SIGTERM);
+	sigaddset(&stopping, SIGHUP);
+	sigaddset(&stopping, SIGINT);
+	sigprocmask(SIG_BLOCK, &stopping, &savedMask);
+	s.signals = signalfd(-1, &stopping, SFD_CLOEXEC | SFD_NONBLOCK);
+
+	/*
+	 * The listener, the signals and the job
+	 * context are told apart from clients by
+	 * pointing at their fields.
+	 */
+	s.epoll = epoll_create1(EPOLL_CLOEXEC);
+	event.events = EPOLLIN;
+	event.data.ptr = &s.listener;
+	epoll_ctl(s.epoll, EPOLL_CTL_ADD, s.listener, &event);
+	event.data.ptr = &s.signals;
+	epoll_ctl(s.epoll, EPOLL_CTL_ADD, s.signals, &event);
+	event.data.ptr = &s.ctx;
+	epoll_ctl(s.epoll, EPOLL_CTL_ADD, smallsh_ctx_fd(s.ctx), &event);
+
+	while(running) {
+
+		numEvents = epoll_wait(s.epoll, events, SERVE_EVENTS, -1);
+		if(numEvents == -1 && errno != EINTR) {
+
+			perror("epoll_wait");
+			break;
+		}
+
+		for(i = 0; i < numEvents; i++) {
+
+			if(events[i].data.ptr == &s.listener) {
+				accept_clients(&s);
+			}
+			else if(events[i].data.ptr == &s.signals) {
+				running = 0;
+			}
+			else if(events[i].data.ptr == &s.ctx) {
+				smallsh_ctx_dispatch(s.ctx, 0);
+			}
+			else {
+
+				client = events[i].data.ptr;
+				if(!client->closed && (events[i].events & EPOLLOUT)) {
+					flush_replies(&s, client);
+				}
+				if(!client->closed && (events[i].events & EPOLLIN) && !read_request(&s, client)) {
+					close_client(&s, client);
+				}
+				if(!client->closed && (events[i].events & (EPOLLHUP | EPOLLERR)) && !(events[i].events & EPOLLIN)) {
+					close_client(&s, client);
+				}
+			}
+		}
+
+		sweep_clients(&s);
+	}
+
+	/* Requests still running finish on their own */
+	for(client = s.clients; client != NULL; client = client->next) {
+		close_client(&s, client);
+	}
+
+	unlink(path);
+	close(s.listener);
+
+	/* Take the stop signals, or restoring the mask would deliver them */
+	while(read(s.signals, &caught, sizeof(caught)) == sizeof(caught)) {
+		;
+	}
+	close(s.signals);
+	close(s.epoll);
+	sigprocmask(SIG_SETMASK, &savedMask, NULL);
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Daemon mode for smallsh: one long-lived
+ * shell running command requests from
+ * local clients, so they do not pay for a
+ * new shell process each time.
+ *
+ * Clients connect to a SOCK_SEQPACKET UNIX
+ * socket. Each message is one request made
+ * of NUL-terminated fields, each starting
+ * with a tag letter:
+ *
+ *   i<id>          Request id, echoed in replies
+ *   a<arg>         Next argv word of a command
+ *   c<source>      Shell source to run instead
+ *   d<dir>         Working directory
+ *   e<NAME=value>  Environment override
+ *   f<digits>      Where passed descriptors go
+ *
+ * Descriptors passed with SCM_RIGHTS become
+ * the ones listed by f, in order, so "f12"
+ * with two descriptors sets standard output
+ * and error. Any of 0, 1 and 2 not given is
+ * /dev/null. Replies are text messages:
+ *
+ *   <id> started <pid>
+ *   <id> exit <status> user <us> sys <us> maxrss <kB>
+ *   <id> error <message>
+ *
+ * Requests run concurrently; a client with
+ * its limit of requests running is not read
+ * from until one finishes.
+ */
+
+#ifndef SMALLSHSERVE_H
+#define SMALLSHSERVE_H
+
+#include "smallshlib.h"
+
+
+/*
+ * Serves requests on a socket at path,
+ * replacing a stale one, until SIGTERM,
+ * SIGHUP or SIGINT. Each client may run up
+ * to limit requests at once. Returns the
+ * exit status for the shell.
+ */
+int smallsh_serve (struct smallsh_shell *sh, const char *path, int limit);
+
+#endif